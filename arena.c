@@ -0,0 +1,87 @@
+/*
+** arena.c -- bump allocator released in one step
+*/
+
+#include <stdalign.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ALIGNMENT alignof(max_align_t)
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size, used;
+    alignas(max_align_t) unsigned char data[];
+};
+
+static ArenaChunk *new_chunk(size_t size, ArenaChunk *next)
+{
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    if (chunk == NULL) return NULL;
+
+    chunk->next = next;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void free_chunks(ArenaChunk *chunk)
+{
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+void arena_init(Arena *arena, size_t retain)
+{
+    arena->chunks = NULL;
+    arena->retain = retain;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    ArenaChunk *chunk = arena->chunks;
+
+    size = ALIGN(size ? size : 1);
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        // Grow geometrically so a large use takes few chunks
+        size_t chunk_size = chunk ? chunk->size * 2 : ARENA_CHUNK_SIZE;
+        if (chunk_size < size) chunk_size = size;
+
+        chunk = new_chunk(chunk_size, arena->chunks);
+        if (chunk == NULL) return NULL;
+        arena->chunks = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void arena_reset(Arena *arena)
+{
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk == NULL) return;
+
+    if (chunk->next == NULL) {
+        chunk->used = 0;
+        return;
+    }
+
+    size_t total = 0;
+    for (ArenaChunk *c = chunk; c != NULL; c = c->next) total += c->size;
+    free_chunks(chunk);
+
+    // One chunk of the size the last use needed, or the first size again after an outlier
+    arena->chunks = new_chunk(total <= arena->retain ? total : ARENA_CHUNK_SIZE, NULL);
+}
+
+void arena_destroy(Arena *arena)
+{
+    free_chunks(arena->chunks);
+    arena->chunks = NULL;
+}
@@ -0,0 +1,33 @@
+/*
+** arena.h -- bump allocator released in one step
+**
+** Allocations are carved one after the other out of large chunks and are
+** never freed one by one: arena_reset() makes the whole arena free again.
+** Memory is kept across resets, so once the arena has grown to the size of
+** the largest use it serves the following ones without calling malloc.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE 65536 // size of the first chunk, and the least a new one gets
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunks;  // chunk being carved first, older (full) ones after it
+    size_t retain;       // most memory kept by a reset
+} Arena;
+
+void arena_init(Arena *arena, size_t retain);
+// Memory for size bytes, aligned for any type, NULL when out of memory
+void *arena_alloc(Arena *arena, size_t size);
+// Free every allocation at once. The chunks are merged into one of their total
+// size so the next use fits in it, unless that is more than the arena retains.
+void arena_reset(Arena *arena);
+// Give all the memory back
+void arena_destroy(Arena *arena);
+
+#endif
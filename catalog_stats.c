@@ -0,0 +1,228 @@
+/*
+** catalog_stats.c -- aggregates of the catalog kept up to date by every write
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "catalog_stats.h"
+
+static int num_movies = 0;
+static Tally genres, years, directors;
+
+static uint32_t hash_key(const char *key)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slot of key in the index, or of the first free place to put it when it is not there
+static size_t tally_slot(const Tally *tally, const char *key, int *entry)
+{
+    size_t mask = tally->num_slots - 1;
+    size_t free_slot = SIZE_MAX;
+    size_t i = hash_key(key) & mask;
+
+    for (; tally->slots[i] != 0; i = (i + 1) & mask) {
+        int e = tally->slots[i] - 1;
+        if (tally->slots[i] == TALLY_TOMBSTONE) {
+            if (free_slot == SIZE_MAX) free_slot = i;
+        } else if (strcmp(tally->entries[e].key, key) == 0) {
+            *entry = e;
+            return i;
+        }
+    }
+    *entry = -1;
+    return free_slot != SIZE_MAX ? free_slot : i;
+}
+
+static int tally_rehash(Tally *tally, size_t num_slots)
+{
+    int *slots = calloc(num_slots, sizeof(int));
+    if (slots == NULL) return -1;
+
+    free(tally->slots);
+    tally->slots = slots;
+    tally->num_slots = num_slots;
+    tally->used_slots = tally->num_entries;
+
+    size_t mask = num_slots - 1;
+    for (int e = 0; e < tally->num_entries; e++) {
+        size_t i = hash_key(tally->entries[e].key) & mask;
+        while (slots[i] != 0) i = (i + 1) & mask;
+        slots[i] = e + 1;
+    }
+    return 0;
+}
+
+static int tally_add(Tally *tally, const char *key)
+{
+    int e;
+
+    // Keep the index at most half full, tombstones included
+    if ((tally->used_slots + 1) * 2 > tally->num_slots) {
+        size_t num_slots = tally->num_slots ? tally->num_slots : 64;
+        while ((size_t)(tally->num_entries + 1) * 2 > num_slots / 2) num_slots *= 2;
+        if (tally_rehash(tally, num_slots) != 0) return -1;
+    }
+
+    size_t i = tally_slot(tally, key, &e);
+    if (e >= 0) {
+        tally->entries[e].count++;
+        return 0;
+    }
+
+    if (tally->num_entries == tally->capacity) {
+        int capacity = tally->capacity ? tally->capacity * 2 : 32;
+        TallyEntry *grown = realloc(tally->entries, capacity * sizeof(TallyEntry));
+        if (grown == NULL) return -1;
+        tally->entries = grown;
+        tally->capacity = capacity;
+    }
+
+    e = tally->num_entries++;
+    snprintf(tally->entries[e].key, sizeof(tally->entries[e].key), "%s", key);
+    tally->entries[e].count = 1;
+    if (tally->slots[i] == 0) tally->used_slots++;
+    tally->slots[i] = e + 1;
+    return 0;
+}
+
+static void tally_remove(Tally *tally, const char *key)
+{
+    int e, last;
+
+    if (tally->num_slots == 0) return;
+    size_t i = tally_slot(tally, key, &e);
+    if (e < 0 || --tally->entries[e].count > 0) return;
+
+    // Drop the entry, the last one takes its place in the dense array
+    tally->slots[i] = TALLY_TOMBSTONE;
+    last = --tally->num_entries;
+    if (e != last) {
+        // Its slot still points at the old place, which still holds the same key
+        tally->entries[e] = tally->entries[last];
+        tally->slots[tally_slot(tally, tally->entries[e].key, &last)] = e + 1;
+    }
+}
+
+static void tally_free(Tally *tally)
+{
+    free(tally->entries);
+    free(tally->slots);
+    memset(tally, 0, sizeof(Tally));
+}
+
+// A movie listing a genre twice counts once for it
+static bool repeated_genre(const Movie *movie, int i)
+{
+    for (int j = 0; j < i; j++) {
+        if (strcmp(movie->genre[j], movie->genre[i]) == 0) return true;
+    }
+    return false;
+}
+
+int catalog_stats_add(const Movie *movie)
+{
+    char year[16];
+    int rc = 0;
+
+    snprintf(year, sizeof(year), "%d", movie->release_year);
+    num_movies++;
+    rc |= tally_add(&years, year);
+    rc |= tally_add(&directors, movie->director);
+    for (int i = 0; i < movie->num_genres; i++) {
+        if (!repeated_genre(movie, i)) rc |= tally_add(&genres, movie->genre[i]);
+    }
+    return rc;
+}
+
+void catalog_stats_remove(const Movie *movie)
+{
+    char year[16];
+
+    snprintf(year, sizeof(year), "%d", movie->release_year);
+    num_movies--;
+    tally_remove(&years, year);
+    tally_remove(&directors, movie->director);
+    for (int i = 0; i < movie->num_genres; i++) {
+        if (!repeated_genre(movie, i)) tally_remove(&genres, movie->genre[i]);
+    }
+}
+
+void catalog_stats_clear(void)
+{
+    num_movies = 0;
+    tally_free(&genres);
+    tally_free(&years);
+    tally_free(&directors);
+}
+
+static int tally_save(const Tally *tally, FILE *file)
+{
+    int32_t count = tally->num_entries;
+    if (fwrite(&count, sizeof(count), 1, file) != 1) return -1;
+    if (fwrite(tally->entries, sizeof(TallyEntry), count, file) != (size_t)count) return -1;
+    return 0;
+}
+
+static int tally_load(Tally *tally, FILE *file)
+{
+    int32_t count;
+    TallyEntry entry;
+
+    if (fread(&count, sizeof(count), 1, file) != 1 || count < 0) return -1;
+    for (int i = 0; i < count; i++) {
+        if (fread(&entry, sizeof(entry), 1, file) != 1) return -1;
+        entry.key[sizeof(entry.key) - 1] = '\0';
+        if (tally_add(tally, entry.key) != 0) return -1;
+        // A key shows up once in a saved tally, so it was added last
+        tally->entries[tally->num_entries - 1].count = entry.count;
+    }
+    return 0;
+}
+
+int catalog_stats_save(FILE *file)
+{
+    int32_t movies = num_movies;
+    if (fwrite(&movies, sizeof(movies), 1, file) != 1) return -1;
+    if (tally_save(&genres, file) != 0 || tally_save(&years, file) != 0 || tally_save(&directors, file) != 0) return -1;
+    return 0;
+}
+
+int catalog_stats_load(FILE *file)
+{
+    int32_t movies;
+    if (fread(&movies, sizeof(movies), 1, file) != 1) return -1;
+    if (tally_load(&genres, file) != 0 || tally_load(&years, file) != 0 || tally_load(&directors, file) != 0) return -1;
+    num_movies = movies;
+    return 0;
+}
+
+int catalog_stats_movies(void)
+{
+    return num_movies;
+}
+
+const Tally *catalog_stats_genres(void)
+{
+    return &genres;
+}
+
+const Tally *catalog_stats_years(void)
+{
+    return &years;
+}
+
+const Tally *catalog_stats_directors(void)
+{
+    return &directors;
+}
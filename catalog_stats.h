@@ -0,0 +1,47 @@
+/*
+** catalog_stats.h -- aggregates of the catalog kept up to date by every write
+**
+** Movies are counted per genre, per release year and per director when they
+** are added and uncounted when they are removed, so the totals are read
+** without looking at the catalog.
+*/
+
+#ifndef CATALOG_STATS_H
+#define CATALOG_STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "storage.h"
+
+#define TALLY_TOMBSTONE -1
+
+// Number of movies per key, keys whose count drops to zero are removed
+typedef struct {
+    char key[DIRECTOR_SIZE];
+    int count;
+} TallyEntry;
+
+typedef struct {
+    TallyEntry *entries;     // dense, in no particular order
+    int num_entries, capacity;
+    int *slots;              // open addressing index: entry + 1, 0 empty, TALLY_TOMBSTONE removed
+    size_t num_slots, used_slots;
+} Tally;
+
+// Count a movie, returns 0 on success
+int catalog_stats_add(const Movie *movie);
+// Uncount a movie counted before, with the fields it was counted with
+void catalog_stats_remove(const Movie *movie);
+void catalog_stats_clear(void);
+
+// Write the aggregates to a file, or read them back into empty ones. Return 0 on success.
+int catalog_stats_save(FILE *file);
+int catalog_stats_load(FILE *file);
+
+int catalog_stats_movies(void);
+const Tally *catalog_stats_genres(void);
+const Tally *catalog_stats_years(void);
+const Tally *catalog_stats_directors(void);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+** changefeed.c -- feed of changes made to the catalog
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "changefeed.h"
+
+typedef struct {
+    long long seq;
+    size_t len;
+    char line[CHANGE_LINE_SIZE];
+} ChangeEntry;
+
+static ChangeEntry ring[CHANGEFEED_CAPACITY];
+static long long head = 0;     // last published sequence number
+static long long oldest = 1;   // oldest sequence number in the ring
+
+static const char *change_names[] = {
+    [CHANGE_CREATED] = "created",
+    [CHANGE_UPDATED] = "updated",
+    [CHANGE_DELETED] = "deleted",
+};
+
+void changefeed_init(long long seq)
+{
+    memset(ring, 0, sizeof(ring));
+    head = seq;
+    oldest = seq + 1;
+}
+
+void changefeed_publish(long long seq, ChangeType type, int movie_id, int version)
+{
+    ChangeEntry *entry = &ring[seq % CHANGEFEED_CAPACITY];
+    int n;
+
+    // Deleted movies have no version left to report
+    if (type == CHANGE_DELETED) {
+        n = snprintf(entry->line, sizeof(entry->line), "{\"seq\":%lld,\"event\":\"%s\",\"id\":%d}\n",
+                     seq, change_names[type], movie_id);
+    } else {
+        n = snprintf(entry->line, sizeof(entry->line), "{\"seq\":%lld,\"event\":\"%s\",\"id\":%d,\"version\":%d}\n",
+                     seq, change_names[type], movie_id, version);
+    }
+    entry->seq = seq;
+    entry->len = n;
+
+    // Sequence numbers follow the catalog version, a gap means events were never published
+    if (seq != head + 1) oldest = seq;
+    head = seq;
+    if (head - oldest >= CHANGEFEED_CAPACITY) oldest = head - CHANGEFEED_CAPACITY + 1;
+}
+
+long long changefeed_head(void)
+{
+    return head;
+}
+
+const char *changefeed_line(long long seq, size_t *len)
+{
+    if (seq < oldest || seq > head) return NULL;
+
+    const ChangeEntry *entry = &ring[seq % CHANGEFEED_CAPACITY];
+    *len = entry->len;
+    return entry->line;
+}
+
+int changefeed_save(FILE *file)
+{
+    int64_t range[2] = { oldest, head };
+    if (fwrite(range, sizeof(range), 1, file) != 1) return -1;
+
+    for (long long seq = oldest; seq <= head; seq++) {
+        if (fwrite(&ring[seq % CHANGEFEED_CAPACITY], sizeof(ChangeEntry), 1, file) != 1) return -1;
+    }
+    return 0;
+}
+
+int changefeed_load(FILE *file)
+{
+    int64_t range[2];
+    if (fread(range, sizeof(range), 1, file) != 1) return -1;
+    if (range[0] < 1 || range[0] > range[1] + 1 || range[1] - range[0] >= CHANGEFEED_CAPACITY) return -1;
+
+    changefeed_init(range[1]);
+    for (long long seq = range[0]; seq <= range[1]; seq++) {
+        ChangeEntry *entry = &ring[seq % CHANGEFEED_CAPACITY];
+        if (fread(entry, sizeof(ChangeEntry), 1, file) != 1 || entry->seq != seq || entry->len >= CHANGE_LINE_SIZE) {
+            changefeed_init(range[1]);
+            return -1;
+        }
+    }
+    oldest = range[0];
+    return 0;
+}
+
+int changefeed_reset_line(long long seq, char *out, size_t out_size)
+{
+    return snprintf(out, out_size, "{\"seq\":%lld,\"event\":\"reset\"}\n", seq);
+}
@@ -0,0 +1,47 @@
+/*
+** changefeed.h -- feed of changes made to the catalog
+**
+** Every write publishes an event whose sequence number is the catalog
+** version it produced. The most recent events are kept in a ring shared by
+** all subscribers: a subscriber only holds a cursor into it, so its queue is
+** bounded by the ring size and fan-out costs no copy per subscriber.
+*/
+
+#ifndef CHANGEFEED_H
+#define CHANGEFEED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define CHANGEFEED_CAPACITY 4096 // events kept for subscribers that lag behind or reconnect
+#define CHANGE_LINE_SIZE 96      // longest formatted event, newline included
+
+typedef enum {
+    CHANGE_CREATED,
+    CHANGE_UPDATED,
+    CHANGE_DELETED,
+} ChangeType;
+
+// Start an empty feed whose last event would have been seq
+void changefeed_init(long long seq);
+
+// Publish the change of a movie that brought the catalog to version seq
+void changefeed_publish(long long seq, ChangeType type, int movie_id, int version);
+
+// Sequence number of the last published event
+long long changefeed_head(void);
+
+// Formatted line (compact JSON and a newline) of the event seq, NULL when it is not available
+const char *changefeed_line(long long seq, size_t *len);
+
+// Format the line telling a subscriber that events up to seq are lost and it must
+// reload the catalog, returns its length
+int changefeed_reset_line(long long seq, char *out, size_t out_size);
+
+// Write the events still available to a file, or read them back in place of the current feed.
+// Return 0 on success.
+int changefeed_save(FILE *file);
+int changefeed_load(FILE *file);
+
+#endif
@@ -8,121 +8,114 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
 
 // Include base C socket programming libraries
-#include <netdb.h>
 #include <sys/types.h>
-#include <netinet/in.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
 
 // External library for JSON parser
-#include <sqlite3.h>
 #include "vendor/cJSON/cJSON.h"
 
-#define PORT "7777" // the port client will be connecting to 
+#include "tcpstreaming_client.h"
 
-#define MAXDATASIZE 2048 // max number of bytes we can get at once 
+#define MAXDATASIZE 2048 // max number of bytes we can get at once
 
+// Read a whole file into a new NUL terminated buffer, NULL on error
+char *read_file(const char *path){
+    FILE *file = fopen(path, "r");
+    if (!file) return NULL;
 
-// get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa)
-{
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
+    size_t len = 0, size = MAXDATASIZE;
+    char *data = malloc(size);
+    size_t n;
+    while (data != NULL && (n = fread(data + len, 1, size - len - 1, file)) > 0) {
+        len += n;
+        if (len + 1 == size) {
+            size *= 2;
+            char *grown = realloc(data, size);
+            if (grown == NULL) free(data);
+            data = grown;
+        }
+    }
+    fclose(file);
+    if (data != NULL) data[len] = '\0';
+    return data;
+}
+
+// A subscription never ends, print the changes as they come
+int subscribe(const char *host, const char *port, cJSON *request){
+    char chunk[MAXDATASIZE];
+    ssize_t numbytes;
+
+    int sockfd = ts_connect(host, port);
+    if (sockfd == -1) {
+        fprintf(stderr, "client: failed to connect\n");
+        return 2;
     }
 
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+    char *req_str = cJSON_PrintUnformatted(request);
+    if (req_str == NULL || send(sockfd, req_str, strlen(req_str), 0) == -1) {
+        perror("send");
+        return 1;
+    }
+    cJSON_free(req_str);
+
+    while ((numbytes = recv(sockfd, chunk, sizeof chunk, 0)) > 0) {
+        fwrite(chunk, 1, numbytes, stdout);
+        fflush(stdout);
+    }
+    if (numbytes == -1) {
+        perror("recv");
+        return 1;
+    }
+    close(sockfd);
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    int sockfd, numbytes;  
-    char res[MAXDATASIZE];
-    char req[MAXDATASIZE];
-    struct addrinfo hints, *servinfo, *p;
-    int rv;
-    char s[INET6_ADDRSTRLEN];
-
-    if (argc != 3) {
-        fprintf(stderr,"usage: client hostname json_file_address\n");
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr,"usage: client hostname json_file_address [port]\n");
         exit(1);
     }
+    const char *host = argv[1];
+    const char *port = argc == 4 ? argv[3] : TS_DEFAULT_PORT;
 
     // Read JSON file passed through CLI
-    {
-        FILE *file = fopen(argv[2], "r");
-        if (!file) {
-            perror("Erro ao abrir arquivo");
-            return -1;
-        }
-        size_t len = fread(req, 1, MAXDATASIZE - 1, file);
-        req[len] = '\0';
-        fclose(file);
-    }
-    
-
-    // Configure server address
-    {
-        memset(&hints, 0, sizeof hints);
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        if ((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) {
-            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-            return 1;
-        }
+    char *req = read_file(argv[2]);
+    if (!req) {
+        perror("Erro ao abrir arquivo");
+        return -1;
     }
-    
-    /* Connect to server
-    **
-    ** Loop through all the results and connect to the first we can
-    */
-    {
-        for(p = servinfo; p != NULL; p = p->ai_next) {
-            if ((sockfd = socket(p->ai_family, p->ai_socktype,
-                    p->ai_protocol)) == -1) {
-                perror("client: socket");
-                continue;
-            }
-    
-            if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-                close(sockfd);
-                perror("client: connect");
-                continue;
-            }
-    
-            break;
-        }
-        if (p == NULL) {
-            fprintf(stderr, "client: failed to connect\n");
-            return 2;
-        }
-        inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
-                s, sizeof s);
-        printf("client: connecting to %s\n", s);
-        freeaddrinfo(servinfo); // all done with this structure
+    cJSON *json = cJSON_Parse(req);
+    free(req);
+    if (json == NULL || !cJSON_IsObject(json)) {
+        fprintf(stderr, "client: %s does not hold a JSON request\n", argv[2]);
+        return 1;
     }
 
-    // Send JSON Request to Server
-    {
-        send(sockfd, req, strlen(req), 0);
-        //Debug request:
-        //printf("Client send JSON:\n%s\n", req);
+    printf("client: connecting to %s:%s\n", host, port);
+
+    const cJSON *method = cJSON_GetObjectItemCaseSensitive(json, "method");
+    if (cJSON_IsString(method) && strcmp(method->valuestring, "SUBSCRIBE") == 0) {
+        int rc = subscribe(host, port, json);
+        cJSON_Delete(json);
+        return rc;
     }
 
-    // Recieve response from server
-    {
-        if ((numbytes = recv(sockfd, res, MAXDATASIZE-1, 0)) == -1) {
-            perror("recv");
-            exit(1);
-        }
-        res[numbytes] = '\0';
-        printf("client: received:\n '%s'\n",res);
-    
-        // Close server connection socket
-        close(sockfd);
+    // Send JSON Request to Server and wait for its response
+    TsClient *client = ts_client_new(host, port, 1);
+    TsCall *call = client ? ts_request(client, json) : NULL;
+    if (call == NULL || (ts_call_wait(client, call) == TS_ERROR && ts_call_response(call) == NULL)) {
+        fprintf(stderr, "client: request failed\n");
+        exit(2);
     }
-    
+
+    printf("client: received:\n '%s'\n", ts_call_response(call));
+
+    ts_call_free(call);
+    ts_client_free(client);
 
     return 0;
-}
\ No newline at end of file
+}
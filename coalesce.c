@@ -0,0 +1,72 @@
+/*
+** coalesce.c -- singleflight coalescing of identical reads
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coalesce.h"
+#include "arena.h"
+
+#define FLIGHT_ARENA_RETAIN (16 * 1024 * 1024) // most memory kept for the responses of a pass
+
+static Flight *flights = NULL;
+static int num_flights = 0;
+static int flights_capacity = 0;
+static unsigned long saved_total = 0;
+static Arena arena = { NULL, FLIGHT_ARENA_RETAIN }; // keys and responses of the flights of this pass
+
+const Flight *coalesce_join(const char *key)
+{
+    // A pass sees few distinct reads, most of them repeats of one popular list
+    for (int i = 0; i < num_flights; i++) {
+        if (strcmp(flights[i].key, key) == 0) {
+            flights[i].saved++;
+            return &flights[i];
+        }
+    }
+    return NULL;
+}
+
+int coalesce_add(const char *key, const char *label, const char *response, size_t len)
+{
+    if (num_flights == flights_capacity) {
+        int capacity = flights_capacity ? flights_capacity * 2 : 16;
+        Flight *grown = realloc(flights, capacity * sizeof(Flight));
+        if (grown == NULL) return -1;
+        flights = grown;
+        flights_capacity = capacity;
+    }
+
+    Flight *flight = &flights[num_flights];
+    size_t key_len = strlen(key) + 1;
+    flight->key = arena_alloc(&arena, key_len);
+    flight->response = arena_alloc(&arena, len);
+    if (flight->key == NULL || flight->response == NULL) return -1;
+    memcpy(flight->key, key, key_len);
+    memcpy(flight->response, response, len);
+    flight->len = len;
+    flight->saved = 0;
+    snprintf(flight->label, sizeof(flight->label), "%s", label);
+    num_flights++;
+    return 0;
+}
+
+void coalesce_clear(void)
+{
+    for (int i = 0; i < num_flights; i++) {
+        if (flights[i].saved > 0) {
+            printf("server: coalesced %lu identical reads of %s into one execution\n",
+                   flights[i].saved, flights[i].label);
+            saved_total += flights[i].saved;
+        }
+    }
+    num_flights = 0;
+    arena_reset(&arena);
+}
+
+unsigned long coalesce_saved_total(void)
+{
+    return saved_total;
+}
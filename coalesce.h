@@ -0,0 +1,33 @@
+/*
+** coalesce.h -- singleflight coalescing of identical reads
+**
+** The first read of a key in a pass of the event loop runs and its response
+** bytes are kept: the identical reads that arrived with it are answered with
+** a copy instead of running the same query and serialization again.
+*/
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stddef.h>
+
+#define COALESCE_KEY_SIZE 1024
+
+typedef struct {
+    char *key;
+    char label[64];        // what was read, for the log
+    char *response;
+    size_t len;
+    unsigned long saved;   // executions spared by sharing the response
+} Flight;
+
+// Flight of a key run in this pass, NULL when there is none. A found flight counts one more saved execution.
+const Flight *coalesce_join(const char *key);
+// Keep the response of the read of key for the identical reads of this pass, returns 0 on success
+int coalesce_add(const char *key, const char *label, const char *response, size_t len);
+// End of the pass: report the executions saved and drop every flight
+void coalesce_clear(void);
+// Executions saved since the server started
+unsigned long coalesce_saved_total(void);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+** compression.c -- deflate (zlib) compression of response payloads
+*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "compression.h"
+
+#define HEADER_PREFIX "{\"encoding\":\"" ENCODING_DEFLATE "\","
+#define LENGTH_PREFIX "{\"length\":"
+
+static const DeflateAllocator default_allocator = { malloc, free };
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+    const DeflateAllocator *allocator = opaque;
+    return allocator->alloc_fn((size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr)
+{
+    const DeflateAllocator *allocator = opaque;
+    allocator->free_fn(ptr);
+}
+
+int deflate_buffer(const char *in, size_t len, char **out, size_t *out_len, const DeflateAllocator *allocator)
+{
+    z_stream stream = { 0 };
+    if (allocator == NULL) allocator = &default_allocator;
+    if (len > UINT_MAX) return -1;
+
+    stream.zalloc = zlib_alloc;
+    stream.zfree = zlib_free;
+    stream.opaque = (voidpf)allocator;
+    // Responses are small and compressed while the client waits, favor speed over ratio
+    if (deflateInit(&stream, Z_BEST_SPEED) != Z_OK) return -1;
+
+    uLong bound = deflateBound(&stream, len);
+    char *buf = allocator->alloc_fn(bound);
+    if (buf == NULL) {
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    // The whole input and a buffer it surely fits in: one call compresses it all
+    stream.next_in = (Bytef *)in;
+    stream.avail_in = len;
+    stream.next_out = (Bytef *)buf;
+    stream.avail_out = bound;
+    int rc = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (rc != Z_STREAM_END) {
+        allocator->free_fn(buf);
+        return -1;
+    }
+
+    *out = buf;
+    *out_len = stream.total_out;
+    return 0;
+}
+
+int inflate_buffer(const char *in, size_t len, size_t original_len, char **out)
+{
+    uLongf dest_len = original_len;
+    char *buf = malloc(original_len + 1);
+    if (buf == NULL) return -1;
+
+    if (uncompress((Bytef *)buf, &dest_len, (const Bytef *)in, len) != Z_OK || dest_len != original_len) {
+        free(buf);
+        return -1;
+    }
+
+    buf[original_len] = '\0';
+    *out = buf;
+    return 0;
+}
+
+int compression_header(char *out, size_t out_size, size_t length, size_t original_length)
+{
+    int n = snprintf(out, out_size, HEADER_PREFIX "\"length\":%zu,\"original_length\":%zu}\n",
+                     length, original_length);
+    return (n < 0 || (size_t)n >= out_size) ? -1 : n;
+}
+
+int length_header(char *out, size_t out_size, size_t length)
+{
+    int n = snprintf(out, out_size, LENGTH_PREFIX "%zu}\n", length);
+    return (n < 0 || (size_t)n >= out_size) ? -1 : n;
+}
+
+// Check if data starts with prefix, -1 when it is too short to tell
+static int starts_with(const char *data, size_t len, const char *prefix)
+{
+    size_t prefix_len = strlen(prefix);
+    if (len < prefix_len) return memcmp(data, prefix, len) == 0 ? -1 : 0;
+    return memcmp(data, prefix, prefix_len) == 0;
+}
+
+int parse_response_header(const char *data, size_t len, size_t *length, size_t *original_length)
+{
+    int compressed = starts_with(data, len, HEADER_PREFIX);
+    int plain = starts_with(data, len, LENGTH_PREFIX);
+
+    // Plain JSON responses never start with a header prefix
+    if (compressed == 0 && plain == 0) return 0;
+    if (compressed == -1 || plain == -1) return -1;
+
+    const char *end = memchr(data, '\n', len);
+    if (end == NULL) return -1;
+
+    if (compressed) {
+        if (sscanf(data + strlen(HEADER_PREFIX), "\"length\":%zu,\"original_length\":%zu}",
+                   length, original_length) != 2) return 0;
+    } else {
+        *original_length = 0;
+        if (sscanf(data + strlen(LENGTH_PREFIX), "%zu}", length) != 1) return 0;
+    }
+    return (int)(end - data) + 1;
+}
@@ -0,0 +1,50 @@
+/*
+** compression.h -- deflate (zlib) compression of response payloads
+**
+** A compressed response is sent as a one line JSON header followed by the
+** compressed bytes:
+**
+**     {"encoding":"deflate","length":<compressed bytes>,"original_length":<bytes>}\n
+**     <compressed bytes>
+**
+** Responses that are not compressed are sent as plain JSON, as before. On a
+** keep-alive connection the end of a response is not marked by closing the
+** socket, so plain responses get a header with their length too:
+**
+**     {"length":<bytes>}\n
+**     <bytes>
+*/
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h>
+
+#define ENCODING_DEFLATE "deflate"
+
+// Memory for the compressed buffer and the compressor state
+typedef struct {
+    void *(*alloc_fn)(size_t size);
+    void (*free_fn)(void *ptr);
+} DeflateAllocator;
+
+// Compress len bytes of in into a new buffer, returns 0 on success. The buffer comes from
+// allocator and is freed by the caller with it, NULL stands for malloc and free.
+int deflate_buffer(const char *in, size_t len, char **out, size_t *out_len, const DeflateAllocator *allocator);
+
+// Decompress a buffer into a new NUL terminated buffer of original_len bytes
+// (freed by the caller), returns 0 on success
+int inflate_buffer(const char *in, size_t len, size_t original_len, char **out);
+
+// Write the header of a compressed payload into out, returns its length or -1 when it does not fit
+int compression_header(char *out, size_t out_size, size_t length, size_t original_length);
+
+// Write the header of a plain payload sent on a keep-alive connection, returns its length or -1
+int length_header(char *out, size_t out_size, size_t length);
+
+// Parse a compression or length header line. Returns the header length (newline included) and
+// fills the payload lengths (original_length is 0 for plain payloads), 0 when data does not start
+// with a header, -1 when the header is incomplete.
+int parse_response_header(const char *data, size_t len, size_t *length, size_t *original_length);
+
+#endif
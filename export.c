@@ -0,0 +1,95 @@
+/*
+** export.c -- immutable export files of the whole catalog
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "export.h"
+
+static char export_path[PATH_MAX];
+static char tmp_path[PATH_MAX + 4];
+static Export *current = NULL;
+
+void export_init(const char *path)
+{
+    snprintf(export_path, sizeof(export_path), "%s", path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+}
+
+// Replace the current export with the file at export_path
+static int open_current(long long version)
+{
+    struct stat st;
+    int fd = open(export_path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    Export *export = malloc(sizeof(Export));
+    if (export == NULL || fstat(fd, &st) == -1) {
+        free(export);
+        close(fd);
+        return -1;
+    }
+    export->fd = fd;
+    export->size = st.st_size;
+    export->version = version;
+    export->refs = 1;
+
+    if (current != NULL) export_release(current);
+    current = export;
+    return 0;
+}
+
+int export_load(long long version)
+{
+    char line[256];
+
+    // The first line of an export is its status, with the version it was written at
+    FILE *file = fopen(export_path, "r");
+    if (file == NULL) return -1;
+    char *found = fgets(line, sizeof(line), file) ? strstr(line, "\"version\":") : NULL;
+    fclose(file);
+
+    if (found == NULL || strtoll(found + strlen("\"version\":"), NULL, 10) != version) return -1;
+    return open_current(version);
+}
+
+FILE *export_begin(void)
+{
+    return fopen(tmp_path, "w");
+}
+
+void export_abort(FILE *file)
+{
+    fclose(file);
+    remove(tmp_path);
+}
+
+int export_commit(FILE *file, long long version)
+{
+    bool failed = ferror(file);
+    if (fclose(file) != 0 || failed || rename(tmp_path, export_path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return open_current(version);
+}
+
+Export *export_acquire(void)
+{
+    if (current != NULL) current->refs++;
+    return current;
+}
+
+void export_release(Export *export)
+{
+    if (--export->refs > 0) return;
+    close(export->fd);
+    free(export);
+}
@@ -0,0 +1,40 @@
+/*
+** export.h -- immutable export files of the whole catalog
+**
+** An export is written to a temporary file and renamed into place, it is
+** never changed afterwards. Connections sending an export hold it open, so
+** a newer export replacing it on disk does not disturb them: the old file
+** is closed once the last of them is done.
+*/
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef struct {
+    int fd;
+    off_t size;
+    long long version;   // catalog version it was written at
+    int refs;            // connections sending it, plus one while it is the current export
+} Export;
+
+// Exports are written at path
+void export_init(const char *path);
+// Take the export left at path when it was written at version, returns 0 on success
+int export_load(long long version);
+
+// Start a new export, returns the file to write it to or NULL on error
+FILE *export_begin(void);
+// Make the file written since export_begin the current export, returns 0 on success.
+// On error the file is dropped and the current export stays.
+int export_commit(FILE *file, long long version);
+// Drop the file written since export_begin
+void export_abort(FILE *file);
+
+// Current export held for sending, NULL when there is none
+Export *export_acquire(void);
+void export_release(Export *export);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+** genre_index.c -- in-memory bitmap indexes of movie IDs per genre
+**
+** Movie IDs come from an AUTOINCREMENT key, so they are dense and a plain
+** bitmap per genre stays compact (one bit per movie) without a compressed
+** container format. Intersections and unions are straight loops over 64-bit
+** words that the compiler can vectorize.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "genre_index.h"
+
+#define WORD_BITS 64
+
+typedef struct {
+    char name[GENRE_NAME_SIZE];
+    Bitmap ids;
+} GenreEntry;
+
+static GenreEntry *genres = NULL;
+static int num_genres = 0;
+static int genres_capacity = 0;
+
+// Grow a bitmap so that it can hold the given word index
+static int bitmap_reserve(Bitmap *bm, size_t word)
+{
+    if (word < bm->num_words) return 0;
+
+    size_t num_words = bm->num_words ? bm->num_words : 16;
+    while (num_words <= word) num_words *= 2;
+
+    uint64_t *words = realloc(bm->words, num_words * sizeof(uint64_t));
+    if (words == NULL) return -1;
+    memset(words + bm->num_words, 0, (num_words - bm->num_words) * sizeof(uint64_t));
+
+    bm->words = words;
+    bm->num_words = num_words;
+    return 0;
+}
+
+static int bitmap_set(Bitmap *bm, int id)
+{
+    size_t word = (size_t)id / WORD_BITS;
+    if (bitmap_reserve(bm, word) != 0) return -1;
+    bm->words[word] |= (uint64_t)1 << (id % WORD_BITS);
+    return 0;
+}
+
+static void bitmap_clear(Bitmap *bm, int id)
+{
+    size_t word = (size_t)id / WORD_BITS;
+    if (word < bm->num_words) {
+        bm->words[word] &= ~((uint64_t)1 << (id % WORD_BITS));
+    }
+}
+
+void bitmap_free(Bitmap *bm)
+{
+    free(bm->words);
+    bm->words = NULL;
+    bm->num_words = 0;
+}
+
+int bitmap_next(const Bitmap *bm, int from)
+{
+    if (from < 0) from = 0;
+    size_t word = (size_t)from / WORD_BITS;
+    if (word >= bm->num_words) return -1;
+
+    // Mask out the bits below from in the first word
+    uint64_t bits = bm->words[word] & (~(uint64_t)0 << (from % WORD_BITS));
+    while (bits == 0) {
+        if (++word >= bm->num_words) return -1;
+        bits = bm->words[word];
+    }
+    return (int)(word * WORD_BITS + __builtin_ctzll(bits));
+}
+
+static GenreEntry *find_genre(const char *name)
+{
+    for (int i = 0; i < num_genres; i++) {
+        if (strcmp(genres[i].name, name) == 0) return &genres[i];
+    }
+    return NULL;
+}
+
+static GenreEntry *find_or_add_genre(const char *name)
+{
+    GenreEntry *entry = find_genre(name);
+    if (entry != NULL) return entry;
+
+    if (num_genres == genres_capacity) {
+        int capacity = genres_capacity ? genres_capacity * 2 : 16;
+        GenreEntry *grown = realloc(genres, capacity * sizeof(GenreEntry));
+        if (grown == NULL) return NULL;
+        genres = grown;
+        genres_capacity = capacity;
+    }
+
+    entry = &genres[num_genres++];
+    memset(entry, 0, sizeof(GenreEntry));
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    return entry;
+}
+
+void genre_index_clear(void)
+{
+    for (int i = 0; i < num_genres; i++) {
+        bitmap_free(&genres[i].ids);
+    }
+    free(genres);
+    genres = NULL;
+    num_genres = 0;
+    genres_capacity = 0;
+}
+
+int genre_index_add(const char *genre, int movie_id)
+{
+    if (movie_id < 0) return -1;
+
+    GenreEntry *entry = find_or_add_genre(genre);
+    if (entry == NULL) return -1;
+    return bitmap_set(&entry->ids, movie_id);
+}
+
+void genre_index_remove_movie(int movie_id)
+{
+    if (movie_id < 0) return;
+
+    for (int i = 0; i < num_genres; i++) {
+        bitmap_clear(&genres[i].ids, movie_id);
+    }
+}
+
+int genre_index_save(FILE *file)
+{
+    int32_t count = num_genres;
+    if (fwrite(&count, sizeof(count), 1, file) != 1) return -1;
+
+    for (int i = 0; i < num_genres; i++) {
+        uint64_t num_words = genres[i].ids.num_words;
+        if (fwrite(genres[i].name, sizeof(genres[i].name), 1, file) != 1
+                || fwrite(&num_words, sizeof(num_words), 1, file) != 1
+                || fwrite(genres[i].ids.words, sizeof(uint64_t), num_words, file) != num_words) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int genre_index_load(FILE *file)
+{
+    int32_t count;
+    if (fread(&count, sizeof(count), 1, file) != 1 || count < 0) return -1;
+
+    for (int i = 0; i < count; i++) {
+        char name[GENRE_NAME_SIZE];
+        uint64_t num_words;
+        if (fread(name, sizeof(name), 1, file) != 1 || fread(&num_words, sizeof(num_words), 1, file) != 1) return -1;
+        name[sizeof(name) - 1] = '\0';
+
+        GenreEntry *entry = find_or_add_genre(name);
+        if (entry == NULL || (num_words > 0 && bitmap_reserve(&entry->ids, num_words - 1) != 0)) return -1;
+        if (fread(entry->ids.words, sizeof(uint64_t), num_words, file) != num_words) return -1;
+    }
+    return 0;
+}
+
+int genre_index_query(const char names[][GENRE_NAME_SIZE], int count, bool match_all, Bitmap *out)
+{
+    const Bitmap *sets[count > 0 ? count : 1];
+    int num_sets = 0;
+    size_t num_words = 0;
+
+    out->words = NULL;
+    out->num_words = 0;
+
+    for (int i = 0; i < count; i++) {
+        GenreEntry *entry = find_genre(names[i]);
+        if (entry == NULL) {
+            // An unknown genre empties an intersection and adds nothing to a union
+            if (match_all) return 0;
+            continue;
+        }
+        sets[num_sets++] = &entry->ids;
+    }
+    if (num_sets == 0) return 0;
+
+    // An intersection can't be longer than its shortest operand, a union than its longest
+    num_words = sets[0]->num_words;
+    for (int i = 1; i < num_sets; i++) {
+        if (match_all ? sets[i]->num_words < num_words : sets[i]->num_words > num_words) {
+            num_words = sets[i]->num_words;
+        }
+    }
+    if (num_words == 0) return 0;
+
+    out->words = calloc(num_words, sizeof(uint64_t));
+    if (out->words == NULL) return -1;
+    out->num_words = num_words;
+
+    memcpy(out->words, sets[0]->words,
+           (sets[0]->num_words < num_words ? sets[0]->num_words : num_words) * sizeof(uint64_t));
+
+    for (int i = 1; i < num_sets; i++) {
+        uint64_t *dst = out->words;
+        const uint64_t *src = sets[i]->words;
+        size_t n = sets[i]->num_words < num_words ? sets[i]->num_words : num_words;
+
+        if (match_all) {
+            for (size_t w = 0; w < n; w++) dst[w] &= src[w];
+        } else {
+            for (size_t w = 0; w < n; w++) dst[w] |= src[w];
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+** genre_index.h -- in-memory bitmap indexes of movie IDs per genre
+*/
+
+#ifndef GENRE_INDEX_H
+#define GENRE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "storage.h"
+
+// Set of movie IDs, one bit per ID packed in 64-bit words
+typedef struct {
+    uint64_t *words;
+    size_t num_words;
+} Bitmap;
+
+void bitmap_free(Bitmap *bm);
+// Next ID in the set that is >= from, or -1 when there is none
+int bitmap_next(const Bitmap *bm, int from);
+
+// Drop every bitmap
+void genre_index_clear(void);
+
+// Mark movie_id as having the genre, returns 0 on success
+int genre_index_add(const char *genre, int movie_id);
+// Remove movie_id from every genre
+void genre_index_remove_movie(int movie_id);
+
+// Fill out with the movies having all (match_all) or any of the given genres.
+// Returns 0 on success, the caller must bitmap_free(out).
+int genre_index_query(const char genres[][GENRE_NAME_SIZE], int num_genres, bool match_all, Bitmap *out);
+
+// Write the index to a file, or read it back into an empty index. Return 0 on success.
+int genre_index_save(FILE *file);
+int genre_index_load(FILE *file);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+** hot_restart.c -- hand the listening socket over to a new server process
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hot_restart.h"
+
+static int control_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "hot restart: control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int hot_restart_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if (control_address(path, &addr) != 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("hot restart: socket");
+        return -1;
+    }
+
+    // Left behind by a server that did not exit cleanly, the port is ours so it is not in use
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        perror("hot restart: bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int hot_restart_request(const char *path)
+{
+    struct sockaddr_un addr;
+    if (control_address(path, &addr) != 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("hot restart: socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("hot restart: connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int hot_restart_send_listener(int control_fd, int listener)
+{
+    char byte = 'L';
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.data,
+        .msg_controllen = sizeof(control.data),
+    };
+
+    memset(&control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listener, sizeof(int));
+
+    while (sendmsg(control_fd, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno == EINTR) continue;
+        perror("hot restart: sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+int hot_restart_receive_listener(int control_fd)
+{
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.data,
+        .msg_controllen = sizeof(control.data),
+    };
+    ssize_t n;
+
+    while ((n = recvmsg(control_fd, &msg, 0)) == -1 && errno == EINTR) {}
+    if (n <= 0) {
+        if (n == -1) perror("hot restart: recvmsg");
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        fprintf(stderr, "hot restart: no listener in the message\n");
+        return -1;
+    }
+
+    int listener;
+    memcpy(&listener, CMSG_DATA(cmsg), sizeof(int));
+    return listener;
+}
@@ -0,0 +1,23 @@
+/*
+** hot_restart.h -- hand the listening socket over to a new server process
+**
+** A running server listens on a Unix control socket. A new server started
+** to replace it connects there and waits: the running one stops accepting,
+** finishes the requests it has, then sends its listening socket over the
+** control connection (SCM_RIGHTS) and exits. Clients connecting meanwhile
+** wait in the listen backlog, none of them is refused.
+*/
+
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+// Listen for hot restart requests at path, returns the socket or -1 on error
+int hot_restart_listen(const char *path);
+// Ask the server listening at path to hand its listener over, returns the control connection or -1
+int hot_restart_request(const char *path);
+// Send the listening socket over an accepted control connection, returns 0 on success
+int hot_restart_send_listener(int control_fd, int listener);
+// Wait for the listening socket sent over the control connection, returns it or -1 on error
+int hot_restart_receive_listener(int control_fd);
+
+#endif
@@ -9,6 +9,12 @@
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+#include <ctype.h>
 
 // Include base C socket programming libraries
 #include <sys/types.h>
@@ -16,145 +22,238 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 
-// External libraries for SQLite Database and JSON parser
-#include <sqlite3.h>
+// External library for JSON parser
 #include "vendor/cJSON/cJSON.h"
 
+#include "storage.h"
+#include "genre_index.h"
+#include "compression.h"
+#include "changefeed.h"
+#include "timer_wheel.h"
+#include "coalesce.h"
+#include "arena.h"
+#include "catalog_stats.h"
+#include "hot_restart.h"
+#include "export.h"
+
 #define PORT "7777"  // the port users will be connecting to
 #define MAXDATASIZE 2048 // max number of bytes we can get at once 
 
-#define BACKLOG 10   // how many pending connections queue will hold
+#define BACKLOG SOMAXCONN   // how many pending connections queue will hold
+#define FIRST_CONN 2        // pfds[0] is the listener, pfds[1] the hot restart control socket
+
+#define MAX_CONNECTIONS 4096 // default max number of clients served at the same time, subscribers included
+#define MAX_INFLIGHT 64       // default max number of requests served by one pass of the event loop
+#define MAX_QUEUE 1024        // default max number of whole requests waiting for a later pass
+
+#define TIMER_TICK_MS 100   // resolution of the connection deadlines
+#define IDLE_TIMEOUT 60     // default seconds a kept alive connection may wait for its next request
+#define READ_TIMEOUT 10     // default seconds a client has to send a whole request
+#define WRITE_TIMEOUT 10    // default seconds a client may leave a response unread
+
+#define OUTPUT_HIGH_WATER 65536 // unsent response bytes over which pipelined requests wait
+
+#define REQUEST_ARENA_RETAIN (16 * 1024 * 1024) // most memory kept for parsing requests and building responses
+#define SUBSCRIBER_SNDBUF 16384 // kernel send buffer of a subscriber, lagging further falls back on the change ring
+
+#define COMPRESSION_THRESHOLD 1024 // responses smaller than this are never compressed
+
+#define SEARCH_DEFAULT_LIMIT 20 // Results returned by a search when no limit is requested
+#define SEARCH_MAX_LIMIT 100    // Upper bound for the limit of a single search
+
+#define BATCH_MAX_IDS 200 // Most movies fetched by a single batch request
 
-#define MAX_GENRES 10 // Max number of genres in a single movie
+#define SLOW_QUERY_MS 100 // default run time in milliseconds over which a statement goes to the slow query log
+
+#define EXPORT_DEBOUNCE_MS 1000   // quiet time after a write before the export is rebuilt
+#define EXPORT_MAX_DELAY_MS 10000 // longest an export lags behind a steady stream of writes
+
+#define WARM_MAGIC "TCPWARM1" // start of the warm caches handed over on a hot restart
 
 // JSON Request Struct
 typedef struct {
     char method[16];  // "GET"
     char resource[64]; // "Ex: /movies"
     // Only for GET
-    char query[64];    // Query param for genre filtering
-    // Only for POST and PUT
-    char title[128];
-    char genre[MAX_GENRES][64];
+    char query[64];    // Query param for genre filtering and title search
+    int limit;         // Max number of search (or listing) results
+    bool prefix;       // Match search terms as prefixes
+    bool match_all;    // Genre filter needs all genres (AND) instead of any (OR)
+    int year_from, year_to; // Release years of a listing
+    MovieSort sort;         // Order of a listing
+    int ids[BATCH_MAX_IDS]; // Movies of a batch, in the order they are answered
+    int num_ids;
+    bool has_if_version;
+    long long if_version; // Version the client already has, answered with "not modified"
+    // Only for SUBSCRIBE
+    bool has_since;
+    long long since;      // Last change seen by the client, the feed resumes after it
+    // Only for POST and PUT (genre is also the genre filter of GET)
+    char title[TITLE_SIZE];
+    char genre[MAX_GENRES][GENRE_NAME_SIZE];
     int num_genres;
-    char director[128];
+    char director[DIRECTOR_SIZE];
     int release_year;
 } JsonRequest;
 
-static int callback(void *response_ptr, int argc, char **argv, char **azColName) {
-   int i;
-   cJSON *res = (cJSON*) response_ptr;
-   cJSON *movies_array = cJSON_GetObjectItem(res, "movies");
+// Deadline a connection's timer is armed for
+typedef enum {
+    DEADLINE_NONE,
+    DEADLINE_READ,   // whole request expected
+    DEADLINE_IDLE,   // kept alive, waiting for the next request
+    DEADLINE_WRITE,  // response waiting for the client to read it
+} Deadline;
 
-    // Create movies array for response
-    if(!movies_array){
-        movies_array = cJSON_CreateArray();
-        cJSON_AddItemToObject(res, "movies", movies_array);
-    }
+// Client connection whose request is being received.
+// Once subscribed to the change feed the buffer holds the events waiting to be sent instead.
+typedef struct {
+    size_t len;              // bytes received so far (subscribers: bytes queued)
+    char buf[MAXDATASIZE];
+    bool pending;            // a whole request waits in buf to be served
+    bool is_write;           // the pending request changes the catalog
+    bool closing;            // done with, closed at the end of the pass
+    unsigned long arrival;   // order in which pending requests arrived
+    bool served;             // answered a request already
+    // Responses not written yet, the socket is non-blocking
+    char *out;
+    size_t out_len, out_sent, out_size;
+    bool close_after_write;  // done with once the output is written
+    Export *export;          // file sent after the buffered output, NULL when there is none
+    off_t export_sent;
+    bool progressed;         // bytes were written in this pass
+    Deadline deadline;
+    Timer timer;
+    bool subscriber;
+    size_t sent;             // queued bytes already sent
+    long long cursor;        // next change to queue, -1 when the subscriber must reload first
+} Connection;
+
+// Pending request in the queue of one pass of the event loop
+typedef struct {
+    int slot;
+    bool is_write;
+    unsigned long arrival;
+} ReadyRequest;
+
+// Request whose write runs along with the other writes of the pass, answered once they all ran
+typedef struct {
+    int slot;
+    size_t req_len;     // end of the request in the buffer of the connection
+    char next;          // byte after the request, overwritten by its end
+    bool keep_alive, deflate_accepted;
+} QueuedWrite;
+
+static const Storage *storage = &sqlite_storage; // backend serving every request
+
+static size_t compression_threshold = COMPRESSION_THRESHOLD;
+static bool deflate_accepted = false; // the client of the current request accepts deflate responses
+static bool keep_alive = false;       // the client of the current request keeps its connection for more
+
+// Admission control
+static int max_connections = MAX_CONNECTIONS;
+static int max_inflight = MAX_INFLIGHT;
+static int max_queue = MAX_QUEUE;
+static bool prioritize_reads = false; // serve reads before writes, shed writes first
+static unsigned long arrivals = 0;    // pending requests seen so far
+
+// Connection deadlines, in seconds
+static int idle_timeout = IDLE_TIMEOUT;
+static int read_timeout = READ_TIMEOUT;
+static int write_timeout = WRITE_TIMEOUT;
+static TimerWheel wheel;
+
+static Connection *current_conn = NULL; // connection of the current request
+static bool queueing_writes = false;    // writes are queued to run together instead of at once
+static StorageWrite *pass_writes;       // writes queued by the current pass
+static QueuedWrite *queued_writes;      // their requests
+static int num_queued = 0;
+static Timer export_timer;              // armed while the export is behind the catalog
+static double slow_query_ms = SLOW_QUERY_MS;
+static uint64_t export_stale_since;     // tick of the first write the export misses
+
+// Every cJSON tree and printed string of a request is allocated here and released
+// at once when the request is done with, none of them is freed on its own
+static Arena request_arena;
+
+static void *json_alloc(size_t size){
+    return arena_alloc(&request_arena, size);
+}
 
-    // Create a new movie object
+static void json_free(void *ptr){
+    (void)ptr;
+}
+
+// Compressed responses and the compressor state come from the request arena too
+static const DeflateAllocator deflate_allocator = { json_alloc, json_free };
+
+// Create the JSON object of a movie, without detail only id and title are added
+cJSON *movie_to_json(const Movie *movie, bool detail){
     cJSON *movie_obj = cJSON_CreateObject();
-    cJSON_AddNumberToObject(movie_obj, "id", atoi(argv[0]));
-    cJSON_AddStringToObject(movie_obj, "title", argv[1]);
+    cJSON_AddNumberToObject(movie_obj, "id", movie->id);
+    cJSON_AddStringToObject(movie_obj, "title", movie->title);
 
-    if(argv[2] != NULL && argv[3] != NULL){
-        cJSON_AddStringToObject(movie_obj, "director", argv[2]);
-        cJSON_AddNumberToObject(movie_obj, "release_year", atoi(argv[3]));
-    }
-    
+    if (detail) {
+        cJSON_AddNumberToObject(movie_obj, "version", movie->version);
+        cJSON_AddStringToObject(movie_obj, "director", movie->director);
+        cJSON_AddNumberToObject(movie_obj, "release_year", movie->release_year);
 
-    // Create a Genres array
-    if (argv[4] != NULL) {
+        // Create a Genres array
         cJSON *genres_array = cJSON_CreateArray();
-        char *genre_token = strtok(argv[4], ", ");
-        while (genre_token != NULL) {
-            cJSON_AddItemToArray(genres_array, cJSON_CreateString(genre_token));
-            genre_token = strtok(NULL, ",");
+        for (int i = 0; i < movie->num_genres; i++) {
+            cJSON_AddItemToArray(genres_array, cJSON_CreateString(movie->genre[i]));
         }
         cJSON_AddItemToObject(movie_obj, "genre", genres_array);
     }
 
-    cJSON_AddItemToArray(movies_array, movie_obj);
-    
-//    Used for debugging SELECT operations
-//    for(i = 0; i<argc; i++) {
-//       printf("%s = %s\n", azColName[i], argv[i] ? argv[i] : "NULL");
-//    }
-//   printf("\n");
-
-
-   return 0;
+    return movie_obj;
 }
 
-// Initialize Database
-int initialize_db(sqlite3* db)
-{
-    char *zErrMsg = 0;
-    int rc;
-    char *sql;
-
-    /* Open database */
-    rc = sqlite3_open("test.db", &db);
+// Storage visitor adding each movie to the "movies" array of a response
+static int add_movie(const Movie *movie, void *movies_array){
+    cJSON_AddItemToArray((cJSON *)movies_array, movie_to_json(movie, true));
+    return 0;
+}
 
-    if( rc ) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        return(0);
-    } else {
-        fprintf(stdout, "Opened database successfully\n");
-        fprintf(stdout, "Initializing database...\n");
-    }
-
-    /*
-    sqlite> SELECT * FROM Movie m
-   ...> JOIN Movie_Genre mg on m.ID = mg.MovieID
-   ...> JOIN Genre g ON mg.GenreID = g.id;
-    */
-
-    /* Create SQL statement */
-    sql =
-    "DROP TABLE IF EXISTS Genre;"\
-    "DROP TABLE IF EXISTS Movie;"\
-    "DROP TABLE IF EXISTS Movie_Genre;"\
-    "CREATE TABLE Genre(" \
-        "ID   INTEGER    PRIMARY KEY AUTOINCREMENT,"
-        "Name TEXT                 NOT NULL UNIQUE);"
-    "CREATE TABLE Movie("  \
-        "ID INTEGER PRIMARY KEY AUTOINCREMENT," \
-        "Title          TEXT    NOT NULL UNIQUE," \
-        "Director       TEXT    NOT NULL, " \
-        "ReleaseYear    INT     NOT NULL);"
-    "CREATE TABLE Movie_Genre("\
-        "ID      INT  PRIMARY KEY,"
-        "MovieID INT,"\
-        "GenreID INT,"\
-        "FOREIGN KEY(MovieID) REFERENCES Movie(ID),"\
-        "FOREIGN KEY(GenreID) REFERENCES Genre(ID));";
-
-    /* Execute SQL statement */
-    rc = sqlite3_exec(db, sql, callback, 0, &zErrMsg);
-
-    if( rc != SQLITE_OK ){
-        fprintf(stderr, "SQL error: %s\n", zErrMsg);
-        sqlite3_free(zErrMsg);
-    } else {
-        fprintf(stdout, "Table created successfully\n");
-    }
-    sqlite3_close(db);
+// Same as add_movie, with only the id and title of each movie
+static int add_movie_summary(const Movie *movie, void *movies_array){
+    cJSON_AddItemToArray((cJSON *)movies_array, movie_to_json(movie, false));
     return 0;
+}
 
+// Keep the genre index in step with a movie that was created or updated
+void index_movie(const Movie *movie){
+    genre_index_remove_movie(movie->id);
+    for (int i = 0; i < movie->num_genres; i++) {
+        genre_index_add(movie->genre[i], movie->id);
+    }
 }
 
-void sigchld_handler(int s)
-{
-    // waitpid() might overwrite errno, so we save and restore it:
-    int saved_errno = errno;
+// Count a movie that was created or updated in the catalog stats
+void count_movie(const Movie *movie){
+    if (catalog_stats_add(movie) != 0) fprintf(stderr, "Failed to count movie in catalog stats\n");
+}
 
-    while(waitpid(-1, NULL, WNOHANG) > 0);
+static int index_movie_visitor(const Movie *movie, void *ctx){
+    (void)ctx;
+    index_movie(movie);
+    count_movie(movie);
+    return 0;
+}
 
-    errno = saved_errno;
+// Copy the movie fields of a POST or PUT request
+void movie_from_request(const JsonRequest *req, Movie *movie){
+    memset(movie, 0, sizeof(Movie));
+    memcpy(movie->title, req->title, sizeof(movie->title));
+    memcpy(movie->director, req->director, sizeof(movie->director));
+    movie->release_year = req->release_year;
+    memcpy(movie->genre, req->genre, sizeof(movie->genre));
+    movie->num_genres = req->num_genres;
 }
 
 // get sockaddr, IPv4 or IPv6:
@@ -167,6 +266,115 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+// Send all len bytes, returns -1 on error
+int send_all(int fd, const char *data, size_t len){
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Queue bytes of the response to the current request, written as the client's socket takes them.
+// Without a connection (turned down at accept) they are sent at once. Returns -1 on error.
+int queue_output(int fd, const char *data, size_t len){
+    Connection *conn = current_conn;
+    if (conn == NULL) return send_all(fd, data, len);
+    if (len == 0) return 0;
+
+    if (conn->out_len + len > conn->out_size) {
+        size_t size = conn->out_size ? conn->out_size : MAXDATASIZE;
+        while (size < conn->out_len + len) size *= 2;
+        char *grown = realloc(conn->out, size);
+        if (grown == NULL) return -1;
+        conn->out = grown;
+        conn->out_size = size;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
+// Response bytes are waiting to be written
+bool output_pending(const Connection *conn){
+    return conn->out_sent < conn->out_len || conn->export != NULL;
+}
+
+// Write as much queued output as the socket takes, returns -1 when the connection failed
+int flush_output(int fd, Connection *conn){
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->out_sent += n;
+        conn->progressed = true;
+    }
+
+    // An export follows the buffered bytes, the kernel copies it from the file
+    while (conn->export != NULL && conn->export_sent < conn->export->size) {
+        ssize_t n = sendfile(fd, conn->export->fd, &conn->export_sent, conn->export->size - conn->export_sent);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1; // the file is shorter than it was, it is never changed
+        conn->progressed = true;
+    }
+    if (conn->export != NULL) {
+        export_release(conn->export);
+        conn->export = NULL;
+    }
+
+    // All written, don't keep a large buffer around for a connection that may stay idle
+    conn->out_len = conn->out_sent = 0;
+    if (conn->out_size > OUTPUT_HIGH_WATER) {
+        free(conn->out);
+        conn->out = NULL;
+        conn->out_size = 0;
+    }
+    return 0;
+}
+
+// Convert a response to a JSON string and send it, compressed when the client accepts it
+// and the response is large enough to be worth it. On keep-alive connections plain responses
+// are preceded by their length.
+void send_response(int new_fd, cJSON *res){
+    // convert the cJSON object to a JSON string 
+    char *res_str = cJSON_Print(res);
+    if (res_str == NULL) {
+        fprintf(stderr, "Failed to print response\n");
+        return ;
+    }
+
+    size_t len = strlen(res_str);
+    char *compressed;
+    size_t compressed_len;
+    char header[128];
+    int header_len;
+
+    if (deflate_accepted && len >= compression_threshold
+            && deflate_buffer(res_str, len, &compressed, &compressed_len, &deflate_allocator) == 0) {
+        header_len = compression_header(header, sizeof(header), compressed_len, len);
+        if (queue_output(new_fd, header, header_len) == -1 || queue_output(new_fd, compressed, compressed_len) == -1)
+            perror("send");
+    } else {
+        header_len = keep_alive ? length_header(header, sizeof(header), len) : 0;
+        if (queue_output(new_fd, header, header_len) == -1 || queue_output(new_fd, res_str, len) == -1)
+            perror("send");
+    }
+
+    return ;
+}
+
 // Send server response of error (400) for request format error
 void invalid_request(int new_fd, char loc_err[]){
     char buffer[100];
@@ -177,12 +385,7 @@ void invalid_request(int new_fd, char loc_err[]){
     cJSON_AddNumberToObject(res, "status", 400);
     cJSON_AddStringToObject(res, "message", buffer);
     
-    // convert the cJSON object to a JSON string 
-   char *res_str = cJSON_Print(res); 
-
-    if (send(new_fd, res_str, MAXDATASIZE, 0) == -1)
-        perror("send");
-    return ;
+    return send_response(new_fd, res);
 }
 
 // Send server response of error (404) for resource Not Found request error
@@ -194,12 +397,7 @@ void not_found(int new_fd){
     cJSON_AddNumberToObject(res, "status", 404);
     cJSON_AddStringToObject(res, "message", buffer);
     
-    // convert the cJSON object to a JSON string 
-   char *res_str = cJSON_Print(res); 
-
-    if (send(new_fd, res_str, MAXDATASIZE, 0) == -1)
-        perror("send");
-    return ;
+    return send_response(new_fd, res);
 }
 
 // Send server response of error (500) for server internal error
@@ -212,16 +410,34 @@ void server_error(int new_fd, const char loc_err[]){
     cJSON_AddNumberToObject(res, "status", 500);
     cJSON_AddStringToObject(res, "message", buffer);
     
-    // convert the cJSON object to a JSON string 
-   char *res_str = cJSON_Print(res); 
+    return send_response(new_fd, res);
+}
 
-    if (send(new_fd, res_str, MAXDATASIZE, 0) == -1)
-        perror("send");
-    return ;
+// Send server response of error (503) for a request turned down while the server is overloaded
+void overloaded(int new_fd){
+    char buffer[] = "Service Unavailable: Server overloaded";
+
+    // create a cJSON object 
+    cJSON *res = cJSON_CreateObject();
+    cJSON_AddNumberToObject(res, "status", 503);
+    cJSON_AddStringToObject(res, "message", buffer);
+    
+    return send_response(new_fd, res);
+}
+
+// Send server response (304) when the client already has the current version of the data
+void not_modified(int new_fd, long long version){
+    // create a cJSON object 
+    cJSON *res = cJSON_CreateObject();
+    cJSON_AddNumberToObject(res, "status", 304);
+    cJSON_AddStringToObject(res, "message", "Not Modified");
+    cJSON_AddNumberToObject(res, "version", version);
+
+    return send_response(new_fd, res);
 }
 
 // Send server response of success for creation of a new movie in DB
-void successful_movie(int new_fd, const char *title, char director[128], int release_year, int movie_id, char genres[][64], int genre_count){
+void successful_movie(int new_fd, const char *title, const char *director, int release_year, int movie_id, const char genres[][GENRE_NAME_SIZE], int genre_count){
     char buffer[MAXDATASIZE];
 
     // create a cJSON object 
@@ -233,6 +449,7 @@ void successful_movie(int new_fd, const char *title, char director[128], int rel
     cJSON *movie = cJSON_CreateObject();
     cJSON_AddNumberToObject(movie, "id", movie_id);
     cJSON_AddStringToObject(movie, "title", title);
+    cJSON_AddNumberToObject(movie, "version", 1);
     cJSON_AddStringToObject(movie, "director", director);
     cJSON_AddNumberToObject(movie, "release_year", release_year);
 
@@ -248,565 +465,553 @@ void successful_movie(int new_fd, const char *title, char director[128], int rel
     // Adiciona o objeto filme ao objeto principal
     cJSON_AddItemToObject(res, "movie", movie);
     
-    // convert the cJSON object to a JSON string 
-    char *res_str = cJSON_Print(res); 
-
-    if (send(new_fd, res_str, MAXDATASIZE, 0) == -1)
-        perror("send");
-    return ;
+    return send_response(new_fd, res);
 }
 
 // Send server response for successful query in DB for movies
 void successful_query(int new_fd, cJSON *res){
     cJSON_AddNumberToObject(res, "status", 200);
     cJSON_AddStringToObject(res, "message", "Successfully found movies");
-    // convert the cJSON object to a JSON string 
-    char *res_str = cJSON_Print(res); 
+    cJSON_AddNumberToObject(res, "version", storage->catalog_version());
+    return send_response(new_fd, res);
+}
 
-    if (send(new_fd, res_str, MAXDATASIZE, 0) == -1)
-        perror("send");
-    return ;
+// Send server response for the stats of the catalog
+void successful_stats(int new_fd, cJSON *res){
+    cJSON_AddNumberToObject(res, "status", 200);
+    cJSON_AddStringToObject(res, "message", "Successfully computed stats");
+    cJSON_AddNumberToObject(res, "version", storage->catalog_version());
+    return send_response(new_fd, res);
 }
 
 // Send server response for successful query in DB for a single movie
 void successful_query_one(int new_fd, cJSON *res){
     cJSON_AddNumberToObject(res, "status", 200);
     cJSON_AddStringToObject(res, "message", "Successfully found movie");
-    // convert the cJSON object to a JSON string 
-    char *res_str = cJSON_Print(res); 
-
-    if (send(new_fd, res_str, MAXDATASIZE, 0) == -1)
-        perror("send");
-    return ;
+    return send_response(new_fd, res);
 }
 
 // Send server response for successful update in DB for a single movie
 void successful_update_one(int new_fd, cJSON *res){
     cJSON_AddNumberToObject(res, "status", 200);
     cJSON_AddStringToObject(res, "message", "Successfully updated movie");
-    // convert the cJSON object to a JSON string 
-    char *res_str = cJSON_Print(res); 
-
-    if (send(new_fd, res_str, MAXDATASIZE, 0) == -1)
-        perror("send");
-    return ;
+    return send_response(new_fd, res);
 }
 
 // Send server response for successful query in DB for a single movie
 void successful_delete(int new_fd, cJSON *res){
     cJSON_AddNumberToObject(res, "status", 200);
     cJSON_AddStringToObject(res, "message", "Deleted successfully");
-    // convert the cJSON object to a JSON string 
-    char *res_str = cJSON_Print(res); 
-
-    if (send(new_fd, res_str, MAXDATASIZE, 0) == -1)
-        perror("send");
-    return ;
+    return send_response(new_fd, res);
 }
 
-// POST
-// Add new movie to DB and send server adequate response
-void post_movie(int new_fd, JsonRequest req, sqlite3* db){
-    char *zErrMsg = 0;
-    int rc;
-    char *sql;
-    const char* data = "Callback function called";
-    sqlite3_stmt *stmt;
+// Answer a write once run, bringing the caches and the feed up to date with it
+void answer_write(int new_fd, const StorageWrite *write){
+    const Movie *movie = &write->movie;
+    cJSON *res;
 
-    // create a cJSON object 
-    cJSON *res = cJSON_CreateObject();
-
-    /* Open database */
-    rc = sqlite3_open("test.db", &db);
-
-    if( rc ) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-        return ;
+    if (write->status == STORAGE_NOT_FOUND) {
+        return not_found(new_fd);
+    } else if (write->status != STORAGE_OK) {
+        return server_error(new_fd, write->error);
     }
 
-    /* Create SQL statement */
-    sql = "INSERT INTO Movie (Title, Director, ReleaseYear) VALUES (?, ?, ?);";
+    switch (write->type) {
+    case WRITE_CREATE:
+        fprintf(stdout, "Added Movie to DB\n");
+        index_movie(movie);
+        count_movie(movie);
+        changefeed_publish(write->catalog_version, CHANGE_CREATED, movie->id, movie->version);
+        return successful_movie(new_fd, movie->title, movie->director, movie->release_year, movie->id, movie->genre, movie->num_genres);
+    case WRITE_UPDATE:
+        printf("Movie updated successfully.\n");
+        index_movie(movie);
+        // The stats uncount the movie as it was counted
+        catalog_stats_remove(&write->previous);
+        count_movie(movie);
+        changefeed_publish(write->catalog_version, CHANGE_UPDATED, movie->id, movie->version);
+        res = cJSON_CreateObject();
+        cJSON_AddItemToObject(res, "movie", movie_to_json(movie, true));
+        return successful_update_one(new_fd, res);
+    case WRITE_REMOVE:
+        genre_index_remove_movie(movie->id);
+        catalog_stats_remove(&write->previous);
+        changefeed_publish(write->catalog_version, CHANGE_DELETED, movie->id, 0);
+        return successful_delete(new_fd, cJSON_CreateObject());
+    }
+}
 
-    /* Prepare statement */
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
+// Run a write and answer it, or queue it to run along with the other writes of the pass
+void submit_write(int new_fd, StorageWrite *write){
+    if (queueing_writes) {
+        pass_writes[num_queued] = *write;
+        queued_writes[num_queued].keep_alive = keep_alive;
+        queued_writes[num_queued].deflate_accepted = deflate_accepted;
+        num_queued++;
         return;
     }
 
-    /* Bind values with JSON Request Data */
-    sqlite3_bind_text(stmt, 1, req.title, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, req.director, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 3, req.release_year);
-
-    /* Execute the statement */
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-    } else {
-        fprintf(stdout, "Added Movie to DB\n");
-    }
+    storage_write_batch(storage, write, 1);
+    return answer_write(new_fd, write);
+}
 
-    /* Finalize statement to avoid memory leaks */
-    sqlite3_finalize(stmt);
+// POST
+// Add new movie to DB and send server adequate response
+void post_movie(int new_fd, JsonRequest req){
+    StorageWrite write = { .type = WRITE_CREATE };
 
-    /* Get the last inserted Movie ID */
-    int movie_id = (int)sqlite3_last_insert_rowid(db);
+    movie_from_request(&req, &write.movie);
+    return submit_write(new_fd, &write);
+}
 
-    sql = "INSERT INTO Movie_Genre (MovieID, GenreID) VALUES (?, ?);";
-    /* Prepare statement */
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-        return;
-    }
+// Answer "not modified" when nothing in the catalog changed since the version the client has.
+// Any list of movies is derived from the catalog, so it is unchanged too.
+bool catalog_not_modified(int new_fd, const JsonRequest *req){
+    long long version = storage->catalog_version();
+    if (!req->has_if_version || req->if_version != version) return false;
 
-    /* For each genre in movie JSON Request do a statement */
-    for (int i = 0; i < req.num_genres; i++) {
-        int genre_id = -1;
+    not_modified(new_fd, version);
+    return true;
+}
 
-        /* Check if genre exists */
-        sql = "SELECT ID FROM Genre WHERE Name = ?;";
-        sqlite3_stmt *genre_stmt;
-        rc = sqlite3_prepare_v2(db, sql, -1, &genre_stmt, 0);
+// GET
+// Get all movies from DB and the server send to client as response 
+void get_all(int new_fd, JsonRequest req, bool withDetail){
+    if (catalog_not_modified(new_fd, &req)) return ;
 
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "Failed to prepare genre query: %s\n", sqlite3_errmsg(db));
-            server_error(new_fd, sqlite3_errmsg(db));
-            return;
-        }
+    cJSON *res = cJSON_CreateObject();
+    cJSON *movies_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(res, "movies", movies_array);
 
-        sqlite3_bind_text(genre_stmt, 1, req.genre[i], -1, SQLITE_STATIC);
+    if (storage->scan(withDetail, withDetail ? add_movie : add_movie_summary, movies_array) != STORAGE_OK) {
+        return server_error(new_fd, storage->errmsg());
+    }
+    fprintf(stdout, "Operation done successfully\n");
 
-        rc = sqlite3_step(genre_stmt);
+    successful_query(new_fd, res);
 
-        if (rc == SQLITE_ROW) {
-            genre_id = sqlite3_column_int(genre_stmt, 0);
-        }
-        sqlite3_finalize(genre_stmt);
+    return ;
+}
 
-        /* If genre not found, insert it in table with genres */
-        if (genre_id == -1) {
-            sql = "INSERT INTO Genre (Name) VALUES (?);";
-            rc = sqlite3_prepare_v2(db, sql, -1, &genre_stmt, 0);
+void get_all_summary(int new_fd, JsonRequest req){
+    return get_all(new_fd, req, false);
+}
 
-            if (rc != SQLITE_OK) {
-                fprintf(stderr, "Failed to prepare genre insert: %s\n", sqlite3_errmsg(db));
-                server_error(new_fd, sqlite3_errmsg(db));
-                return;
-            }
+void get_all_detail(int new_fd, JsonRequest req){
+    return get_all(new_fd, req, true);
+}
 
-            sqlite3_bind_text(genre_stmt, 1, req.genre[i], -1, SQLITE_STATIC);
+// Get all movies matching all (or any) of the requested genres and the server send to client as response 
+void get_by_genre(int new_fd, JsonRequest req){
+    if (catalog_not_modified(new_fd, &req)) return ;
 
-            rc = sqlite3_step(genre_stmt);
+    Bitmap movie_ids;
+    Movie movie;
+    int rc = STORAGE_OK;
+    cJSON *res = cJSON_CreateObject();
+    cJSON *movies_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(res, "movies", movies_array);
 
-            if (rc != SQLITE_DONE) {
-                fprintf(stderr, "Failed to insert genre: %s\n", sqlite3_errmsg(db));
-                server_error(new_fd, sqlite3_errmsg(db));
-                sqlite3_finalize(genre_stmt);
-                return;
-            }
+    // Resolve the genre filter on the in-memory bitmaps, the storage is only hit for matching movies
+    if (genre_index_query(req.genre, req.num_genres, req.match_all, &movie_ids) != 0) {
+        fprintf(stderr, "Failed to query genre index\n");
+        return server_error(new_fd, "Out of memory");
+    }
 
-            genre_id = (int)sqlite3_last_insert_rowid(db);
-            sqlite3_finalize(genre_stmt);
+    // Fetch every matching movie by primary key
+    for (int id = bitmap_next(&movie_ids, 0); id >= 0; id = bitmap_next(&movie_ids, id + 1)) {
+        rc = storage->get(id, &movie);
+        if (rc == STORAGE_OK) {
+            add_movie(&movie, movies_array);
+        } else if (rc == STORAGE_ERROR) {
+            break;
         }
+    }
 
-        /* Insert into Movie_Genre table */
-        sqlite3_bind_int(stmt, 1, movie_id);
-        sqlite3_bind_int(stmt, 2, genre_id);
+    bitmap_free(&movie_ids);
 
-        rc = sqlite3_step(stmt);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "Failed to insert into Movie_Genre: %s\n", sqlite3_errmsg(db));
-            server_error(new_fd, sqlite3_errmsg(db));
-        }
-        sqlite3_reset(stmt);
+    if (rc == STORAGE_ERROR) {
+        return server_error(new_fd, storage->errmsg());
     }
 
-    sqlite3_finalize(stmt);
-
-    return successful_movie(new_fd, req.title, req.director, req.release_year, movie_id,req.genre, req.num_genres);
+    successful_query(new_fd, res);
 
+    return ;
 }
 
-// GET
-// Get all movies from DB and the server send to client as response 
-void get_all(int new_fd, JsonRequest req, sqlite3* db, bool withDetail){
-    char *zErrMsg = 0;
-    int rc;
-    char *sql;
-    cJSON *res = cJSON_CreateObject();
+// Search movies by title and director using the full-text index, best matches first
+void search_movies(int new_fd, JsonRequest req){
+    if (catalog_not_modified(new_fd, &req)) return ;
 
-    /* Open database */
-    rc = sqlite3_open("test.db", &db);
-
-    if( rc ) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        return server_error(new_fd, sqlite3_errmsg(db));
-    }
+    cJSON *res = cJSON_CreateObject();
+    cJSON *movies_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(res, "movies", movies_array);
 
-    sql = "SELECT ID, Title from Movie";
-    /* Create SQL statement */
-    if(withDetail){
-        sql = "SELECT m.ID, Title, Director, ReleaseYear, GROUP_CONCAT(Name, ', ') AS Genre FROM Movie m "\
-            "JOIN Movie_Genre mg on m.ID = mg.MovieID "\
-            "JOIN Genre g ON mg.GenreID = g.id "\
-            "GROUP BY m.ID";
+    if (storage->search(req.query, req.prefix, req.limit, add_movie, movies_array) != STORAGE_OK) {
+        return server_error(new_fd, storage->errmsg());
     }
-    
-    /* Execute SQL statement */
-    rc = sqlite3_exec(db, sql, callback, res, &zErrMsg);
 
-    if( rc != SQLITE_OK ) {
-        fprintf(stderr, "SQL error: %s\n", zErrMsg);
-        sqlite3_free(zErrMsg);
-        server_error(new_fd, sqlite3_errmsg(db));
-    } else {
-        fprintf(stdout, "Operation done successfully\n");
-    }
-    
     successful_query(new_fd, res);
 
     return ;
 }
 
-// Get all movies that have the same genre requested from DB and the server send to client as response 
-void get_by_genre(int new_fd, JsonRequest req, sqlite3* db){
-    char *zErrMsg = 0;
-    int rc;
-    char *sql;
-    sqlite3_stmt *stmt;
+// Get the movies released in a range of years, of a genre when one is given, sorted and limited.
+// The storage walks an index, the rest of the catalog is not read.
+void list_movies(int new_fd, JsonRequest req){
+    if (catalog_not_modified(new_fd, &req)) return ;
+
+    MovieQuery query = { .year_from = req.year_from, .year_to = req.year_to, .sort = req.sort, .limit = req.limit };
+    snprintf(query.genre, sizeof(query.genre), "%s", req.num_genres > 0 ? req.genre[0] : "");
+
     cJSON *res = cJSON_CreateObject();
-    // Need to add movies array before in this case because of calls to callbacks by rows
     cJSON *movies_array = cJSON_CreateArray();
     cJSON_AddItemToObject(res, "movies", movies_array);
 
-    /* Open database */
-    rc = sqlite3_open("test.db", &db);
-
-    if( rc ) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        return server_error(new_fd, sqlite3_errmsg(db));
+    if (storage->query(&query, add_movie, movies_array) != STORAGE_OK) {
+        return server_error(new_fd, storage->errmsg());
     }
 
-    sql = "SELECT m.ID, Title, Director, ReleaseYear, GROUP_CONCAT(Name, ', ') AS Genre FROM Movie m "\
-        "JOIN Movie_Genre mg on m.ID = mg.MovieID "\
-        "JOIN Genre g ON mg.GenreID = g.id "\
-        "WHERE g.Name = ? "\
-        "GROUP BY m.ID";
+    successful_query(new_fd, res);
 
-    // Prepare the SQL statement
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        return server_error(new_fd, sqlite3_errmsg(db));
+    return ;
+}
+
+// Send the current export of the catalog, written after the latest writes once they pause: a status
+// line then one movie per line. The file goes out after the buffered output, it is never compressed.
+void export_catalog(int new_fd, JsonRequest req, Connection *conn){
+    char header[128];
+    int header_len;
+
+    Export *export = export_acquire();
+    if (export == NULL) return server_error(new_fd, "No export available");
+    if (req.has_if_version && req.if_version == export->version) {
+        long long version = export->version;
+        export_release(export);
+        return not_modified(new_fd, version);
     }
 
-    // Bind the genre name to the statement
-    rc = sqlite3_bind_text(stmt, 1, req.query, -1, SQLITE_STATIC);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to bind parameter: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        return server_error(new_fd, sqlite3_errmsg(db));
+    header_len = keep_alive ? length_header(header, sizeof(header), export->size) : 0;
+    if (queue_output(new_fd, header, header_len) == -1) {
+        perror("send");
+        export_release(export);
+        return ;
     }
+    conn->export = export;
+    conn->export_sent = 0;
+}
 
-    // Execute the prepared statement with the callback function
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        char *row_data[5];
-        for (int i = 0; i < 5; i++) {
-            row_data[i] = (char *)sqlite3_column_text(stmt, i);
+// Movies of a batch, each one put at the places of the batch that asked for it
+typedef struct {
+    const int *ids;
+    int num_ids;
+    cJSON **items;
+} Batch;
+
+static int add_batch_movie(const Movie *movie, void *ctx){
+    Batch *batch = ctx;
+    for (int i = 0; i < batch->num_ids; i++) {
+        if (batch->ids[i] == movie->id && batch->items[i] == NULL) {
+            batch->items[i] = movie_to_json(movie, true);
         }
-        callback(res, 5, row_data, NULL);
     }
+    return 0;
+}
 
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Query execution error: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
+// Get the movies of a list of IDs in one lookup, answered in request order.
+// A movie that does not exist is a {"id","status":404} marker in its place.
+void get_batch(int new_fd, JsonRequest req){
+    if (catalog_not_modified(new_fd, &req)) return ;
+
+    cJSON *items[BATCH_MAX_IDS] = { NULL };
+    Batch batch = { req.ids, req.num_ids, items };
+
+    if (storage->get_many(req.ids, req.num_ids, add_batch_movie, &batch) != STORAGE_OK) {
+        return server_error(new_fd, storage->errmsg());
     }
 
-    // Cleanup
-    sqlite3_finalize(stmt);
+    cJSON *res = cJSON_CreateObject();
+    cJSON *movies_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(res, "movies", movies_array);
+    for (int i = 0; i < req.num_ids; i++) {
+        if (items[i] == NULL) {
+            items[i] = cJSON_CreateObject();
+            cJSON_AddNumberToObject(items[i], "id", req.ids[i]);
+            cJSON_AddNumberToObject(items[i], "status", 404);
+        }
+        cJSON_AddItemToArray(movies_array, items[i]);
+    }
 
-    
     successful_query(new_fd, res);
 
     return ;
 }
 
-// Get a movies that have the matching ID from JSON Request Query and send it as JSON Response
-void get_one(int new_fd, JsonRequest req, sqlite3* db){
-    char *zErrMsg = 0;
-    int rc;
-    char *sql;
-    sqlite3_stmt *stmt;
+// Object with the count of every key of a tally
+static cJSON *tally_to_json(const Tally *tally){
+    cJSON *counts = cJSON_CreateObject();
+    for (int i = 0; i < tally->num_entries; i++) {
+        cJSON_AddNumberToObject(counts, tally->entries[i].key, tally->entries[i].count);
+    }
+    return counts;
+}
+
+// Counts of movies per genre, release year and director, from the aggregates kept by every write
+void get_stats(int new_fd, JsonRequest req){
+    if (catalog_not_modified(new_fd, &req)) return ;
+
     cJSON *res = cJSON_CreateObject();
+    cJSON *stats = cJSON_CreateObject();
+    cJSON_AddNumberToObject(stats, "movies", catalog_stats_movies());
+    cJSON_AddItemToObject(stats, "genres", tally_to_json(catalog_stats_genres()));
+    cJSON_AddItemToObject(stats, "release_years", tally_to_json(catalog_stats_years()));
+    cJSON_AddItemToObject(stats, "directors", tally_to_json(catalog_stats_directors()));
+    cJSON_AddItemToObject(res, "stats", stats);
 
-    /* Open database */
-    rc = sqlite3_open("test.db", &db);
+    successful_stats(new_fd, res);
 
-    if( rc ) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-        return ;
-    }
+    return ;
+}
 
-    sql = "SELECT m.ID, Title, Director, ReleaseYear, GROUP_CONCAT(Name, ', ') AS Genre FROM Movie m "\
-        "JOIN Movie_Genre mg on m.ID = mg.MovieID "\
-        "JOIN Genre g ON mg.GenreID = g.id "\
-        "WHERE m.ID = ? ";
+// Storage visitor adding the profile of a statement to the "statements" array
+static void add_statement_stats(const StatementStats *stats, void *statements){
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "sql", stats->sql);
+    cJSON_AddNumberToObject(item, "runs", stats->runs);
+    cJSON_AddNumberToObject(item, "total_ms", stats->total_ms);
+    cJSON_AddNumberToObject(item, "avg_ms", stats->runs > 0 ? stats->total_ms / stats->runs : 0);
+    cJSON_AddNumberToObject(item, "max_ms", stats->max_ms);
+    cJSON_AddNumberToObject(item, "fullscan_steps", stats->fullscan_steps);
+    cJSON_AddNumberToObject(item, "sorts", stats->sorts);
+    cJSON_AddNumberToObject(item, "autoindexes", stats->autoindexes);
+    cJSON_AddNumberToObject(item, "vm_steps", stats->vm_steps);
+    cJSON_AddItemToArray(statements, item);
+}
 
-    // Prepare the SQL statement
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-        return;
-    }
+// Run counts and times of the statements the storage ran, those taking the most time in total first
+void get_statement_stats(int new_fd, JsonRequest req){
+    (void)req;
+    cJSON *res = cJSON_CreateObject();
+    cJSON *statements = cJSON_CreateArray();
+
+    // A backend without statements has nothing to profile
+    if (storage->statement_stats != NULL) storage->statement_stats(add_statement_stats, statements);
+    cJSON_AddItemToObject(res, "statements", statements);
+    cJSON_AddNumberToObject(res, "slow_query_ms", slow_query_ms);
+    // Reads answered from an identical read of the same pass never reached the storage
+    cJSON_AddNumberToObject(res, "coalesced_reads", coalesce_saved_total());
+    cJSON_AddNumberToObject(res, "status", 200);
+    cJSON_AddStringToObject(res, "message", "Successfully profiled statements");
+
+    return send_response(new_fd, res);
+}
+
+// Get a movies that have the matching ID from JSON Request Query and send it as JSON Response
+void get_one(int new_fd, JsonRequest req){
+    Movie movie;
+    cJSON *res = cJSON_CreateObject();
 
-    
     // Extract the movie ID from the URL
     int movie_id = atoi(req.resource + 8); // Skip "/movies/"
 
-    // Bind the route ID to the statement
-    rc = sqlite3_bind_int(stmt, 1, movie_id);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to bind parameter: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        return;
-    }
-
-    // Only one row, so its better to not use the callback function
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        if(sqlite3_column_int(stmt, 0) == 0){
-            sqlite3_finalize(stmt);
+    // Check the version alone first, an unchanged movie is neither read nor serialized
+    if (req.has_if_version) {
+        int version;
+        int rc = storage->version(movie_id, &version);
+        if (rc == STORAGE_OK && version == req.if_version) {
+            return not_modified(new_fd, version);
+        } else if (rc == STORAGE_NOT_FOUND) {
             return not_found(new_fd);
         }
-        
-        // Create JSON response
-        cJSON *movie_obj = cJSON_CreateObject();
-
-        cJSON_AddNumberToObject(movie_obj, "id", sqlite3_column_int(stmt, 0));
-        cJSON_AddStringToObject(movie_obj, "title", (const char*)sqlite3_column_text(stmt, 1));
-        cJSON_AddStringToObject(movie_obj, "director", (const char*)sqlite3_column_text(stmt, 2));
-        cJSON_AddNumberToObject(movie_obj, "release_year", sqlite3_column_int(stmt, 3));
-
-        // Parse the concatenated genre string into a JSON array
-        cJSON *genres_array = cJSON_CreateArray();
-        const char *genres_str = (const char*)sqlite3_column_text(stmt, 4);
-        if (genres_str != NULL) {
-            char *genres_copy = strdup(genres_str);
-            char *token = strtok(genres_copy, ",");
-            while (token != NULL) {
-                cJSON_AddItemToArray(genres_array, cJSON_CreateString(token));
-                token = strtok(NULL, ",");
-            }
-            free(genres_copy);
-        }
-
-        cJSON_AddItemToObject(movie_obj, "genre", genres_array);
-        cJSON_AddItemToObject(res, "movie", movie_obj);
+    }
 
-    } else if (rc == SQLITE_DONE) {
+    int rc = storage->get(movie_id, &movie);
+    if (rc == STORAGE_NOT_FOUND) {
         return not_found(new_fd);
-    } else {
-        fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(db));
-        return server_error(new_fd, sqlite3_errmsg(db));
+    } else if (rc != STORAGE_OK) {
+        return server_error(new_fd, storage->errmsg());
     }
 
-    // Cleanup
-    sqlite3_finalize(stmt);
-    
+    cJSON_AddItemToObject(res, "movie", movie_to_json(&movie, true));
+
     successful_query_one(new_fd, res);
 
     return ;
 }
 
 // DELETE
-void delete_one(int new_fd, JsonRequest req, sqlite3* db){
-    char *zErrMsg = 0;
-    int rc;
-    char *sql;
-    sqlite3_stmt *stmt;
-    cJSON *res = cJSON_CreateObject();
+void delete_one(int new_fd, JsonRequest req){
+    StorageWrite write = { .type = WRITE_REMOVE };
 
     // Extract the movie ID from the URL
-    int movie_id = atoi(req.resource + 8); // Skip "/movies/"
+    write.movie.id = atoi(req.resource + 8); // Skip "/movies/"
 
-    /* Open database */
-    rc = sqlite3_open("test.db", &db);
+    return submit_write(new_fd, &write);
+}
 
-    if( rc ) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-        return ;
-    }
+// PUT
+void update_one(int new_fd, JsonRequest req){
+    StorageWrite write = { .type = WRITE_UPDATE };
 
-    // DELETE MOVIE GENRES BY MOVIE ID
+    movie_from_request(&req, &write.movie);
 
-    sql = "DELETE FROM Movie_Genre WHERE MovieID = ?;";
+    // Extract the movie ID from the URL
+    write.movie.id = atoi(req.resource + 8); // Skip "/movies/"
 
-    // Prepare the SQL statement
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-        return;
-    }
+    return submit_write(new_fd, &write);
+}
 
-    sqlite3_bind_int(stmt, 1, movie_id);
-    rc = sqlite3_step(stmt);
+typedef void (*ReadHandler)(int new_fd, JsonRequest req);
 
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failed to delete movie genres: %s\n", sqlite3_errmsg(db));
+// Key of a list read: every field it depends on, the catalog version and the response encoding
+int read_key(const JsonRequest *req, char *key, size_t size){
+    int n = snprintf(key, size, "%s %s %lld|%s|%d|%d|%d|%d|%d|%d|%d|%lld|%d|%d|", req->method, req->resource,
+                     storage->catalog_version(), req->query, req->limit, req->prefix, req->match_all,
+                     req->year_from, req->year_to, req->sort,
+                     req->has_if_version, req->if_version, deflate_accepted, keep_alive);
+    for (int i = 0; i < req->num_genres && n >= 0 && (size_t)n < size; i++) {
+        n += snprintf(key + n, size - n, "%s\x1f", req->genre[i]);
     }
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
 
-    // Cleanup
-    sqlite3_finalize(stmt);
-
-    // DELETE MOVIE BY MOVIE ID
+// Run a list read, or answer with the response of the identical read already run in this pass
+void coalesce_read(int new_fd, JsonRequest req, ReadHandler handler){
+    Connection *conn = current_conn;
+    char key[COALESCE_KEY_SIZE];
 
-    sql = "DELETE FROM Movie WHERE ID = ?;";
+    if (conn == NULL || read_key(&req, key, sizeof(key)) != 0) return handler(new_fd, req);
 
-    // Prepare the SQL statement
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        server_error(new_fd, sqlite3_errmsg(db));
-        return;
+    const Flight *flight = coalesce_join(key);
+    if (flight != NULL) {
+        if (queue_output(new_fd, flight->response, flight->len) == -1) perror("send");
+        return ;
     }
 
-    sqlite3_bind_int(stmt, 1, movie_id);
-    rc = sqlite3_step(stmt);
-
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failed to delete movie genres: %s\n", sqlite3_errmsg(db));
+    // Keep the bytes this read adds to the output for the identical reads coming next
+    size_t start = conn->out_len;
+    handler(new_fd, req);
+    if (coalesce_add(key, req.resource, conn->out + start, conn->out_len - start) != 0) {
+        fprintf(stderr, "Failed to keep response for coalescing\n");
     }
-
-    // Cleanup
-    sqlite3_finalize(stmt);
-
-    return successful_delete(new_fd, res);
 }
 
-// PUT
-void update_one(int new_fd, JsonRequest req, sqlite3* db){
-    int rc;
-    const char *sql;
-    sqlite3_stmt *stmt;
-    cJSON *res = cJSON_CreateObject();
-    
-    /* Open database */
-    rc = sqlite3_open("test.db", &db);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        return;
+// SUBSCRIBE
+// Keep the connection open and stream the changes made after req.since to it, one compact JSON per line
+void subscribe_changes(int new_fd, JsonRequest req, Connection *conn){
+    long long head = changefeed_head();
+
+    conn->subscriber = true;
+    conn->len = 0;
+    conn->sent = 0;
+    conn->cursor = head + 1;
+    if (req.has_since) {
+        // A sequence number the feed never reached comes from before a reset of the data
+        conn->cursor = req.since > head ? -1 : req.since + 1;
     }
 
-    // Extract the movie ID from the URL
-    int movie_id = atoi(req.resource + 8); // Skip "/movies/"
+    cJSON *res = cJSON_CreateObject();
+    cJSON_AddNumberToObject(res, "status", 200);
+    cJSON_AddStringToObject(res, "message", "Subscribed");
+    cJSON_AddNumberToObject(res, "seq", head);
+
+    // Events are delimited by newlines, so is the acknowledgement
+    char *res_string = cJSON_PrintUnformatted(res);
+    if (res_string == NULL) {
+        conn->subscriber = false;
+        return server_error(new_fd, "Out of memory");
+    }
+    // Queued ahead of the events
+    size_t len = strlen(res_string);
+    memcpy(conn->buf, res_string, len);
+    conn->buf[len] = '\n';
+    conn->len = len + 1;
+}
 
-    // Prepare SQL update query for Movie table
-    sql = "UPDATE Movie SET Title = ?, Director = ?, ReleaseYear = ? WHERE ID = ?;";
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        return server_error(new_fd, sqlite3_errmsg(db));
-    }
-
-    // Bind values to the prepared statement
-    sqlite3_bind_text(stmt, 1, req.title, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, req.director, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt, 3, req.release_year);
-    sqlite3_bind_int(stmt, 4, movie_id);
-
-    // Execute the update statement
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failed to update movie: %s\n", sqlite3_errmsg(db));
-        return server_error(new_fd, sqlite3_errmsg(db));
-    }
-    sqlite3_finalize(stmt);
-
-    // Delete old genre associations for the movie
-    sql = "DELETE FROM Movie_Genre WHERE MovieID = ?;";
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    sqlite3_bind_int(stmt, 1, movie_id);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    // Insert new genres
-    sql = "INSERT INTO Movie_Genre (MovieID, GenreID) VALUES (?, (SELECT ID FROM Genre WHERE Name = ?));";
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-
-    for (int i = 0; i < req.num_genres; i++) {
-        char* genre = req.genre[i];
-        sqlite3_bind_int(stmt, 1, movie_id);
-        sqlite3_bind_text(stmt, 2, genre, -1, SQLITE_TRANSIENT);
-        rc = sqlite3_step(stmt);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "Failed to insert genre: %s\n", sqlite3_errmsg(db));
-            return server_error(new_fd, sqlite3_errmsg(db));
-        }
-        sqlite3_reset(stmt);
-    }
-
-    sqlite3_finalize(stmt);
-
-    printf("Movie updated successfully.\n");
-
-    // Retrieve the updated movie
-    sql = "SELECT m.ID, Title, Director, ReleaseYear, GROUP_CONCAT(g.Name, ',') AS Genres "
-          "FROM Movie m "
-          "LEFT JOIN Movie_Genre mg ON m.ID = mg.MovieID "
-          "LEFT JOIN Genre g ON mg.GenreID = g.id "
-          "WHERE m.ID = ? "
-          "GROUP BY m.ID;";
-          
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    sqlite3_bind_int(stmt, 1, movie_id);
-
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        cJSON *movie_obj = cJSON_CreateObject();
-
-        cJSON_AddNumberToObject(movie_obj, "id", sqlite3_column_int(stmt, 0));
-        cJSON_AddStringToObject(movie_obj, "title", (const char*)sqlite3_column_text(stmt, 1));
-        cJSON_AddStringToObject(movie_obj, "director", (const char*)sqlite3_column_text(stmt, 2));
-        cJSON_AddNumberToObject(movie_obj, "release_year", sqlite3_column_int(stmt, 3));
-
-        // Parse genres
-        cJSON *genres_array = cJSON_CreateArray();
-        const char *genres_str = (const char*)sqlite3_column_text(stmt, 4);
-        if (genres_str != NULL) {
-            char *genres_copy = strdup(genres_str);
-            char *token = strtok(genres_copy, ",");
-            while (token != NULL) {
-                cJSON_AddItemToArray(genres_array, cJSON_CreateString(token));
-                token = strtok(NULL, ",");
+// Queue the changes a subscriber has not seen yet and send what its socket takes without blocking.
+// Returns -1 when the subscriber is gone, 1 when queued bytes wait for the socket, 0 otherwise.
+int pump_subscriber(int fd, Connection *conn){
+    long long head = changefeed_head();
+
+    // Responses to requests before the subscription go out first
+    if (flush_output(fd, conn) == -1) return -1;
+    if (output_pending(conn)) return 1;
+
+    while (1) {
+        // Refill the queue once it is flushed
+        if (conn->sent == conn->len) {
+            conn->len = 0;
+            conn->sent = 0;
+            while (conn->cursor <= head && MAXDATASIZE - conn->len >= CHANGE_LINE_SIZE) {
+                size_t line_len;
+                const char *line = changefeed_line(conn->cursor, &line_len);
+                if (line == NULL) {
+                    // Lagged behind the ring: the missed changes are gone, the client reloads the catalog
+                    conn->len += changefeed_reset_line(head, conn->buf + conn->len, MAXDATASIZE - conn->len);
+                    conn->cursor = head + 1;
+                    break;
+                }
+                memcpy(conn->buf + conn->len, line, line_len);
+                conn->len += line_len;
+                conn->cursor++;
             }
-            free(genres_copy);
+            if (conn->len == 0) return 0;
         }
 
-        cJSON_AddItemToObject(movie_obj, "genre", genres_array);
-        cJSON_AddItemToObject(res, "movie", movie_obj);
+        ssize_t nbytes = send(fd, conn->buf + conn->sent, conn->len - conn->sent, 0);
+        if (nbytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        conn->sent += nbytes;
+        conn->progressed = true;
     }
+}
 
-    sqlite3_finalize(stmt);
+// Length of the first whole JSON request in the buffered bytes (its top level object is closed),
+// 0 while it is incomplete
+size_t request_length(const char *buf, size_t len){
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = buf[i];
+        if (in_string) {
+            if (escaped) escaped = false;
+            else if (c == '\\') escaped = true;
+            else if (c == '"') in_string = false;
+            continue;
+        }
+        if (c == '"') in_string = true;
+        else if (c == '{' || c == '[') depth++;
+        else if (c == '}' || c == ']') {
+            if (--depth <= 0) return i + 1;
+        }
+        // Anything else than an object at top level is not a request, let the parser reject it
+        else if (depth == 0 && c != ' ' && c != '\t' && c != '\r' && c != '\n') return len;
+    }
 
-    return successful_update_one(new_fd, res);
+    // A full buffer will never complete, hand it over as is
+    return len >= MAXDATASIZE - 1 ? len : 0;
 }
 
-void handle_request(int new_fd, sqlite3* db){
-    char res_string[MAXDATASIZE];
-    char req_string[MAXDATASIZE];
+// Check if the accept_encoding field of a request lists the encoding
+bool accepts_encoding(const cJSON *accept_encoding, const char *encoding){
+    const cJSON *item;
+
+    if (cJSON_IsString(accept_encoding)) {
+        return strcmp(accept_encoding->valuestring, encoding) == 0;
+    }
+    if (!cJSON_IsArray(accept_encoding)) return false;
+    cJSON_ArrayForEach(item, accept_encoding) {
+        if (cJSON_IsString(item) && strcmp(item->valuestring, encoding) == 0) return true;
+    }
+    return false;
+}
 
-    memset(req_string, 0, MAXDATASIZE);
-    recv(new_fd, req_string, MAXDATASIZE, 0);
+void handle_request(int new_fd, const char *req_string, Connection *conn){
     // Debug request string:
     // printf("Server received JSON:\n%s\n", req_string);
 
@@ -821,12 +1026,16 @@ void handle_request(int new_fd, sqlite3* db){
             if (error_ptr != NULL) { 
                 printf("Error: %s\n", error_ptr); 
             } 
-            cJSON_Delete(json); 
         }
 
         cJSON *method = cJSON_GetObjectItemCaseSensitive(json, "method");
         cJSON *resource = cJSON_GetObjectItemCaseSensitive(json, "resource");
         cJSON *body = cJSON_GetObjectItemCaseSensitive(json, "body");
+
+        // Response encodings accepted by the client, as one name or a list of names
+        deflate_accepted = accepts_encoding(cJSON_GetObjectItemCaseSensitive(json, "accept_encoding"), ENCODING_DEFLATE);
+        // Clients sending several requests on one connection ask to keep it open
+        keep_alive = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "keep_alive"));
         if (cJSON_IsString(method) && (method->valuestring != NULL)) { 
             strncpy(req.method, method->valuestring, sizeof(req.method) - 1);
         } else return invalid_request(new_fd, "method");
@@ -836,7 +1045,7 @@ void handle_request(int new_fd, sqlite3* db){
         
         // DELETE
         if(strcmp(req.method, "DELETE") == 0){
-            return delete_one(new_fd, req, db);
+            return delete_one(new_fd, req);
         }
 
         // POST & PUT
@@ -872,32 +1081,155 @@ void handle_request(int new_fd, sqlite3* db){
             } else return invalid_request(new_fd, "body.genre");
 
             if(strcmp(req.method,"POST") == 0){
-                return post_movie(new_fd, req, db);
+                return post_movie(new_fd, req);
             } else {
-                return update_one(new_fd, req, db);
+                return update_one(new_fd, req);
             }
             
         }
 
+        // SUBSCRIBE
+        if (strcmp(req.method, "SUBSCRIBE") == 0 && strcmp(req.resource, "/movies/changes") == 0) {
+            cJSON *since = cJSON_GetObjectItem(body, "since");
+            if (cJSON_IsNumber(since) && since->valuedouble >= 0) {
+                req.has_since = true;
+                req.since = (long long)since->valuedouble;
+            } else if (since != NULL) return invalid_request(new_fd, "body.since");
+            return subscribe_changes(new_fd, req, conn);
+        }
+
         // GET
+        if (strcmp(req.method, "GET") == 0) {
+            cJSON *if_version = cJSON_GetObjectItem(body, "if_version");
+            if (cJSON_IsNumber(if_version)) {
+                req.has_if_version = true;
+                req.if_version = (long long)if_version->valuedouble;
+            } else if (if_version != NULL) return invalid_request(new_fd, "body.if_version");
+        }
         if(strcmp(req.method, "GET") == 0 && strcmp(req.resource, "/movies") == 0){
-            return get_all(new_fd, req, db, false);
+            cJSON *year_from = cJSON_GetObjectItem(body, "year_from");
+            cJSON *year_to = cJSON_GetObjectItem(body, "year_to");
+            cJSON *genre = cJSON_GetObjectItem(body, "genre");
+            cJSON *sort = cJSON_GetObjectItem(body, "sort");
+            cJSON *limit = cJSON_GetObjectItem(body, "limit");
+
+            // Without a filter, order or limit the whole catalog is listed in summary
+            if (year_from == NULL && year_to == NULL && genre == NULL && sort == NULL && limit == NULL) {
+                return coalesce_read(new_fd, req, get_all_summary);
+            }
+
+            req.year_from = INT_MIN;
+            req.year_to = INT_MAX;
+            if (cJSON_IsNumber(year_from)) {
+                req.year_from = year_from->valueint;
+            } else if (year_from != NULL) return invalid_request(new_fd, "body.year_from");
+            if (cJSON_IsNumber(year_to)) {
+                req.year_to = year_to->valueint;
+            } else if (year_to != NULL) return invalid_request(new_fd, "body.year_to");
+            if (req.year_from > req.year_to) return invalid_request(new_fd, "body.year_to");
+
+            if (cJSON_IsString(genre) && genre->valuestring != NULL && genre->valuestring[0] != '\0') {
+                strncpy(req.genre[0], genre->valuestring, sizeof(req.genre[0]) - 1);
+                req.num_genres = 1;
+            } else if (genre != NULL) return invalid_request(new_fd, "body.genre");
+
+            req.sort = SORT_ID;
+            if (cJSON_IsString(sort) && strcmp(sort->valuestring, "year") == 0) {
+                req.sort = SORT_YEAR;
+            } else if (cJSON_IsString(sort) && strcmp(sort->valuestring, "title") == 0) {
+                req.sort = SORT_TITLE;
+            } else if (sort != NULL && !(cJSON_IsString(sort) && strcmp(sort->valuestring, "id") == 0)) {
+                return invalid_request(new_fd, "body.sort");
+            }
+
+            req.limit = -1;
+            if (cJSON_IsNumber(limit) && limit->valueint >= 1) {
+                req.limit = limit->valueint;
+            } else if (limit != NULL) return invalid_request(new_fd, "body.limit");
+            return coalesce_read(new_fd, req, list_movies);
         }
         if(strcmp(req.method, "GET") == 0 && strcmp(req.resource, "/movies/detail") == 0){
-            return get_all(new_fd, req, db, true);
+            return coalesce_read(new_fd, req, get_all_detail);
         }
         if(strcmp(req.method, "GET") == 0 && strcmp(req.resource, "/movies/genre") == 0){
             cJSON *query = cJSON_GetObjectItem(body, "query");
+            cJSON *genres = cJSON_GetObjectItem(body, "genres");
+            cJSON *match = cJSON_GetObjectItem(body, "match");
+
+            req.match_all = true;
             if (cJSON_IsString(query) && (query->valuestring != NULL)) { 
+                // Single genre filter
                 strncpy(req.query, query->valuestring, sizeof(req.query) - 1);
+                strncpy(req.genre[0], query->valuestring, sizeof(req.genre[0]) - 1);
+                req.num_genres = 1;
+            } else if (cJSON_IsArray(genres)) {
+                // List of genres combined with "all" (AND) or "any" (OR)
+                int count = 0;
+                cJSON *genre;
+                cJSON_ArrayForEach(genre, genres) {
+                    if (!cJSON_IsString(genre) || genre->valuestring == NULL) return invalid_request(new_fd, "body.genres");
+                    if (count >= MAX_GENRES) return invalid_request(new_fd, "body.genres");
+                    strncpy(req.genre[count], genre->valuestring, sizeof(req.genre[count]) - 1);
+                    count++;
+                }
+                if (count == 0) return invalid_request(new_fd, "body.genres");
+                req.num_genres = count;
+
+                if (cJSON_IsString(match) && strcmp(match->valuestring, "any") == 0) {
+                    req.match_all = false;
+                } else if (match != NULL && !(cJSON_IsString(match) && strcmp(match->valuestring, "all") == 0)) {
+                    return invalid_request(new_fd, "body.match");
+                }
             } else return invalid_request(new_fd, "body.query");
-            return get_by_genre(new_fd, req, db);
+            return coalesce_read(new_fd, req, get_by_genre);
+        }
+        if(strcmp(req.method, "GET") == 0 && strcmp(req.resource, "/movies/search") == 0){
+            cJSON *query = cJSON_GetObjectItem(body, "query");
+            cJSON *limit = cJSON_GetObjectItem(body, "limit");
+            cJSON *prefix = cJSON_GetObjectItem(body, "prefix");
+            if (cJSON_IsString(query) && (query->valuestring != NULL)) { 
+                strncpy(req.query, query->valuestring, sizeof(req.query) - 1);
+            } else return invalid_request(new_fd, "body.query");
+            if (strspn(req.query, " \t") == strlen(req.query)) return invalid_request(new_fd, "body.query");
+
+            req.limit = SEARCH_DEFAULT_LIMIT;
+            if (cJSON_IsNumber(limit)) {
+                req.limit = limit->valueint;
+            } else if (limit != NULL) return invalid_request(new_fd, "body.limit");
+            if (req.limit < 1 || req.limit > SEARCH_MAX_LIMIT) return invalid_request(new_fd, "body.limit");
+
+            req.prefix = true;
+            if (cJSON_IsBool(prefix)) {
+                req.prefix = cJSON_IsTrue(prefix);
+            } else if (prefix != NULL) return invalid_request(new_fd, "body.prefix");
+            return coalesce_read(new_fd, req, search_movies);
+        }
+        if(strcmp(req.method, "GET") == 0 && strcmp(req.resource, "/movies/stats") == 0){
+            return coalesce_read(new_fd, req, get_stats);
+        }
+        if(strcmp(req.method, "GET") == 0 && strcmp(req.resource, "/movies/batch") == 0){
+            cJSON *ids = cJSON_GetObjectItem(body, "ids");
+            cJSON *id;
+            if (!cJSON_IsArray(ids)) return invalid_request(new_fd, "body.ids");
+            cJSON_ArrayForEach(id, ids) {
+                if (!cJSON_IsNumber(id) || id->valuedouble != id->valueint || id->valueint < 1
+                        || req.num_ids == BATCH_MAX_IDS) {
+                    return invalid_request(new_fd, "body.ids");
+                }
+                req.ids[req.num_ids++] = id->valueint;
+            }
+            if (req.num_ids == 0) return invalid_request(new_fd, "body.ids");
+            return get_batch(new_fd, req);
+        }
+        if(strcmp(req.method, "GET") == 0 && strcmp(req.resource, "/movies/export") == 0){
+            return export_catalog(new_fd, req, conn);
+        }
+        if(strcmp(req.method, "GET") == 0 && strcmp(req.resource, "/server/statements") == 0){
+            return get_statement_stats(new_fd, req);
         }
         else{
-            return get_one(new_fd, req, db);
+            return get_one(new_fd, req);
         }
-
-        cJSON_Delete(json);
     }
     
 
@@ -905,7 +1237,434 @@ void handle_request(int new_fd, sqlite3* db){
         perror("send");
 }
 
-int main(void)
+// Make a socket non-blocking, returns -1 on error
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Add a new file descriptor to the poll set
+void add_to_pfds(struct pollfd pfds[], Connection conns[], int newfd, int *fd_count)
+{
+    pfds[*fd_count].fd = newfd;
+    pfds[*fd_count].events = POLLIN; // check ready-to-read
+    pfds[*fd_count].revents = 0;
+    conns[*fd_count].len = 0;
+    conns[*fd_count].subscriber = false;
+    conns[*fd_count].pending = false;
+    conns[*fd_count].closing = false;
+    conns[*fd_count].served = false;
+    conns[*fd_count].out = NULL;
+    conns[*fd_count].out_len = conns[*fd_count].out_sent = conns[*fd_count].out_size = 0;
+    conns[*fd_count].close_after_write = false;
+    conns[*fd_count].export = NULL;
+    conns[*fd_count].progressed = false;
+    conns[*fd_count].deadline = DEADLINE_NONE;
+    timer_init(&conns[*fd_count].timer);
+
+    (*fd_count)++;
+}
+
+// Remove an index from the poll set, moving the last one into its place
+void del_from_pfds(struct pollfd pfds[], Connection conns[], int i, int *fd_count)
+{
+    timer_cancel(&wheel, &conns[i].timer);
+    free(conns[i].out);
+    if (conns[i].export != NULL) export_release(conns[i].export);
+
+    pfds[i] = pfds[*fd_count - 1];
+    conns[i] = conns[*fd_count - 1];
+    timer_moved(&conns[i].timer);
+
+    (*fd_count)--;
+}
+
+// Current time in timer ticks
+uint64_t now_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+// A connection missed its deadline: a stalled or half-open client, reaped at the end of the pass
+void connection_expired(Timer *timer, void *ctx){
+    static const char *names[] = {
+        [DEADLINE_READ] = "read",
+        [DEADLINE_IDLE] = "idle",
+        [DEADLINE_WRITE] = "write",
+    };
+    Connection *conn = (Connection *)((char *)timer - offsetof(Connection, timer));
+    (void)ctx;
+
+    printf("server: %s timeout, closing connection\n", names[conn->deadline]);
+    conn->closing = true;
+    conn->deadline = DEADLINE_NONE;
+}
+
+// Arm the timer of a connection for the deadline of what it is waiting on. A deadline runs from
+// the moment the connection starts waiting, except writes which get a new one on every progress.
+void update_deadline(Connection *conn){
+    bool writing = output_pending(conn) || (conn->subscriber && conn->sent < conn->len);
+    Deadline deadline;
+    int timeout;
+
+    if (writing) {
+        deadline = DEADLINE_WRITE;
+        timeout = write_timeout;
+    } else if (conn->subscriber || conn->pending) {
+        // Subscribers wait on the feed and queued requests on the server, neither on the client
+        deadline = DEADLINE_NONE;
+        timeout = 0;
+    } else if (conn->len > 0 || !conn->served) {
+        deadline = DEADLINE_READ;
+        timeout = read_timeout;
+    } else {
+        deadline = DEADLINE_IDLE;
+        timeout = idle_timeout;
+    }
+
+    if (deadline == DEADLINE_NONE) {
+        timer_cancel(&wheel, &conn->timer);
+    } else if (deadline != conn->deadline || (deadline == DEADLINE_WRITE && conn->progressed)) {
+        timer_arm(&wheel, &conn->timer, now_ticks() + (uint64_t)timeout * 1000 / TIMER_TICK_MS);
+    }
+    conn->deadline = deadline;
+    conn->progressed = false;
+}
+
+// Too much unsent output: the client doesn't read its responses, its next requests wait.
+// So do the requests after an export, their responses can't be queued behind the file.
+bool output_backlogged(const Connection *conn){
+    return conn->out_len - conn->out_sent > OUTPUT_HIGH_WATER || conn->export != NULL;
+}
+
+// Check if the value after a key, at the start of buf, is the method of a write
+bool is_write_method(const char *buf, size_t len){
+    size_t i = 0;
+
+    while (i < len && isspace((unsigned char)buf[i])) i++;
+    if (i == len || buf[i++] != ':') return false;
+    while (i < len && isspace((unsigned char)buf[i])) i++;
+
+    const char *methods[] = { "\"POST\"", "\"PUT\"", "\"DELETE\"" };
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        size_t n = strlen(methods[m]);
+        if (len - i >= n && strncmp(buf + i, methods[m], n) == 0) return true;
+    }
+    return false;
+}
+
+// Check if a buffered request of len bytes changes the catalog, from its method alone without
+// parsing it. Only a "method" key of the top level object counts, as for the parser the first one.
+bool is_write_request(const char *buf, size_t len){
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+    bool at_key = false;    // a string starting here is a key of the top level object
+    size_t key_start = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = buf[i];
+        if (in_string) {
+            if (escaped) escaped = false;
+            else if (c == '\\') escaped = true;
+            else if (c == '"') {
+                in_string = false;
+                if (at_key && i - key_start == strlen("method") && strncmp(buf + key_start, "method", i - key_start) == 0) {
+                    return is_write_method(buf + i + 1, len - i - 1);
+                }
+            }
+            continue;
+        }
+        if (c == '"') {
+            in_string = true;
+            key_start = i + 1;
+        } else if (c == '{' || c == '[') {
+            at_key = ++depth == 1 && c == '{';
+        } else if (c == '}' || c == ']') {
+            depth--;
+            at_key = false;
+        } else if (c == ',') {
+            at_key = depth == 1;
+        } else if (c == ':') {
+            at_key = false;
+        }
+    }
+    return false;
+}
+
+// Queue the connection when a whole request is buffered
+void mark_pending(Connection *conn){
+    if (conn->pending || conn->subscriber || conn->close_after_write) return;
+    size_t req_len = request_length(conn->buf, conn->len);
+    if (req_len == 0) return;
+
+    conn->pending = true;
+    conn->is_write = is_write_request(conn->buf, req_len);
+    conn->arrival = arrivals++;
+}
+
+// Order of the queue: arrival, with every read ahead of the writes when reads are prioritized
+int compare_ready(const void *a, const void *b){
+    const ReadyRequest *x = a, *y = b;
+
+    if (prioritize_reads && x->is_write != y->is_write) return x->is_write ? 1 : -1;
+    return x->arrival < y->arrival ? -1 : x->arrival > y->arrival;
+}
+
+// Answer a request with "overloaded", it is parsed only for how the client wants its responses
+void reject_request(int new_fd, const char *req_string){
+    cJSON *json = cJSON_Parse(req_string);
+
+    deflate_accepted = false;
+    keep_alive = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "keep_alive"));
+
+    overloaded(new_fd);
+}
+
+// Turn down a connection over the limit right away, in the backlog it would only time out
+void reject_connection(int new_fd){
+    deflate_accepted = false;
+    keep_alive = false;
+    overloaded(new_fd);
+    arena_reset(&request_arena);
+    close(new_fd);
+}
+
+// Take the first buffered request of a connection out of the queue, as a string ending at the
+// returned length. The byte it overwrote is kept in next.
+size_t start_request(Connection *conn, char *next){
+    size_t req_len = request_length(conn->buf, conn->len);
+
+    *next = conn->buf[req_len];
+    conn->buf[req_len] = '\0';
+    conn->pending = false;
+    conn->served = true;
+    keep_alive = false;
+    current_conn = conn;
+    return req_len;
+}
+
+// Done answering a request: the connection stays queued while more whole requests are buffered
+// and is marked for closing once done with
+void finish_request(struct pollfd *pfd, Connection *conn, size_t req_len, char next){
+    current_conn = NULL;
+    arena_reset(&request_arena);
+
+    if (conn->subscriber) {
+        // A slow subscriber must not hold megabytes of socket buffers
+        int sndbuf = SUBSCRIBER_SNDBUF;
+        setsockopt(pfd->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+        if (pump_subscriber(pfd->fd, conn) == -1) conn->closing = true;
+        return;
+    }
+
+    // Most responses fit in the socket buffer, the rest is written as the client reads
+    if (flush_output(pfd->fd, conn) == -1) {
+        conn->closing = true;
+        return;
+    }
+
+    // Done with the connection unless kept alive
+    if (!keep_alive) {
+        if (output_pending(conn)) conn->close_after_write = true;
+        else conn->closing = true;
+        return;
+    }
+
+    conn->buf[req_len] = next;
+    memmove(conn->buf, conn->buf + req_len, conn->len - req_len + 1);
+    conn->len -= req_len;
+    mark_pending(conn);
+}
+
+// Answer (or shed) the first buffered request of a connection
+void serve_request(struct pollfd *pfd, Connection *conn, bool shed){
+    char next;
+    size_t req_len = start_request(conn, &next);
+
+    if (shed) {
+        reject_request(pfd->fd, conn->buf);
+    } else {
+        handle_request(pfd->fd, conn->buf, conn);
+    }
+    finish_request(pfd, conn, req_len, next);
+}
+
+// Answer writes following each other in the queue. Their requests are read first and their writes
+// run together, so that a backend writing to several databases writes to them at once. Then they
+// are answered in order.
+void serve_writes(struct pollfd pfds[], Connection conns[], const ReadyRequest *writes, int num_writes){
+    num_queued = 0;
+    queueing_writes = true;
+    for (int k = 0; k < num_writes; k++) {
+        int i = writes[k].slot;
+        int queued = num_queued;
+        char next;
+        size_t req_len = start_request(&conns[i], &next);
+
+        handle_request(pfds[i].fd, conns[i].buf, &conns[i]);
+        if (num_queued == queued) {
+            // Answered already, as an invalid request
+            finish_request(&pfds[i], &conns[i], req_len, next);
+            continue;
+        }
+        queued_writes[queued].slot = i;
+        queued_writes[queued].req_len = req_len;
+        queued_writes[queued].next = next;
+        current_conn = NULL;
+        arena_reset(&request_arena);
+    }
+    queueing_writes = false;
+
+    storage_write_batch(storage, pass_writes, num_queued);
+
+    for (int q = 0; q < num_queued; q++) {
+        QueuedWrite *queued = &queued_writes[q];
+        int i = queued->slot;
+
+        current_conn = &conns[i];
+        keep_alive = queued->keep_alive;
+        deflate_accepted = queued->deflate_accepted;
+        answer_write(pfds[i].fd, &pass_writes[q]);
+        finish_request(&pfds[i], &conns[i], queued->req_len, queued->next);
+    }
+}
+
+// Export being written
+typedef struct {
+    FILE *file;
+    bool failed;
+} ExportWriter;
+
+// Storage visitor writing each movie as a line of the export
+static int export_movie(const Movie *movie, void *ctx){
+    ExportWriter *writer = ctx;
+    char *line = cJSON_PrintUnformatted(movie_to_json(movie, true));
+
+    writer->failed = line == NULL || fprintf(writer->file, "%s\n", line) < 0;
+    // Exports are written between requests, one movie at a time
+    arena_reset(&request_arena);
+    return writer->failed;
+}
+
+// Write a new export of the whole catalog, connections sending the previous one finish it
+void rebuild_export(void){
+    long long version = storage->catalog_version();
+    ExportWriter writer = { export_begin(), false };
+
+    if (writer.file == NULL) {
+        perror("server: export");
+        return;
+    }
+    fprintf(writer.file, "{\"status\":200,\"message\":\"Successfully exported movies\",\"version\":%lld}\n", version);
+    if (storage->scan(true, export_movie, &writer) != STORAGE_OK || writer.failed) {
+        fprintf(stderr, "server: can't write export: %s\n", writer.failed ? "write failed" : storage->errmsg());
+        export_abort(writer.file);
+        return;
+    }
+    if (export_commit(writer.file, version) != 0) {
+        perror("server: export");
+        return;
+    }
+    printf("server: exported catalog version %lld\n", version);
+}
+
+// Writes make the export stale: it is rebuilt once they pause, or after a while of steady writes
+void schedule_export(void){
+    uint64_t now = now_ticks();
+    if (!timer_armed(&export_timer)) export_stale_since = now;
+
+    uint64_t quiet = now + EXPORT_DEBOUNCE_MS / TIMER_TICK_MS;
+    uint64_t latest = export_stale_since + EXPORT_MAX_DELAY_MS / TIMER_TICK_MS;
+    timer_arm(&wheel, &export_timer, quiet < latest ? quiet : latest);
+}
+
+// Due timers: connection deadlines and the export rebuild
+void timer_expired(Timer *timer, void *ctx){
+    if (timer == &export_timer) return rebuild_export();
+    connection_expired(timer, ctx);
+}
+
+// Save the caches built from the catalog for the server taking over, valid for the current catalog version
+int save_warm_caches(const char *path){
+    char tmp_path[PATH_MAX];
+    int64_t version = storage->catalog_version();
+    int rc = 0;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) return -1;
+
+    if (fwrite(WARM_MAGIC, strlen(WARM_MAGIC), 1, file) != 1 || fwrite(&version, sizeof(version), 1, file) != 1
+            || genre_index_save(file) != 0 || catalog_stats_save(file) != 0 || changefeed_save(file) != 0) {
+        rc = -1;
+    }
+    if (fclose(file) != 0) rc = -1;
+
+    // Renamed once whole, a server never loads half a file
+    if (rc != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Load the caches saved by the server handed over from, they are used once and only if the catalog
+// didn't change since. Returns 0 on success, the caches are left empty otherwise.
+int load_warm_caches(const char *path){
+    char magic[sizeof(WARM_MAGIC) - 1];
+    int64_t version;
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return -1;
+
+    bool loaded = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, WARM_MAGIC, sizeof(magic)) == 0
+        && fread(&version, sizeof(version), 1, file) == 1 && version == storage->catalog_version()
+        && genre_index_load(file) == 0 && catalog_stats_load(file) == 0 && changefeed_load(file) == 0;
+    fclose(file);
+    remove(path);
+
+    if (!loaded) {
+        genre_index_clear();
+        catalog_stats_clear();
+        return -1;
+    }
+    return 0;
+}
+
+// Build the caches from the stored movies, returns 0 on success
+int build_caches(void){
+    if (storage->scan(true, index_movie_visitor, NULL) != STORAGE_OK) return -1;
+
+    // Changes are numbered after the catalog version, a subscriber may resume from one it saw before a restart
+    changefeed_init(storage->catalog_version());
+    return 0;
+}
+
+// Profile the statements run by the storage, those slower than the threshold go to the slow query log.
+// Serving goes on without the log when it can't be opened.
+void profile_storage(const char *slow_log_path){
+    if (storage->profile != NULL && storage->profile(slow_log_path, slow_query_ms) != STORAGE_OK) {
+        fprintf(stderr, "server: can't profile %s storage, slow queries aren't logged\n", storage->name);
+    }
+}
+
+// Hot restart asked for: stop accepting, subscribers resume on the next server. Idle connections
+// are closed, the others once their requests are answered.
+void drain_connection(Connection *conn){
+    if (conn->subscriber) {
+        conn->closing = true;
+    } else if (!conn->pending && conn->len == 0) {
+        if (output_pending(conn)) conn->close_after_write = true;
+        else conn->closing = true;
+    }
+}
+
+int main(int argc, char *argv[])
 {
     int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
     struct addrinfo hints, *servinfo, *p;
@@ -916,9 +1675,192 @@ int main(void)
     char s[INET6_ADDRSTRLEN];
     int rv;
 
-    sqlite3* db;
+    // Every client is served by this process, the listener is always pfds[0] and the control socket pfds[1]
+    struct pollfd *pfds;
+    Connection *conns;
+    ReadyRequest *ready;    // queue of whole requests of one pass
+    int fd_count = 0;
+    int num_pending = 0;    // requests left queued by the last pass
+    long long pumped_head;  // last change sent to the subscribers
+    struct rlimit nofile;
+
+    const char *data_path = NULL;
+    bool keep_data = false;
+    bool takeover = false;            // started to replace a running server
+    const char *control_path = NULL;  // where a server replacing this one asks for the listener
+    char default_control_path[PATH_MAX], warm_path[PATH_MAX], export_path[PATH_MAX], slow_log_path[PATH_MAX];
+    long long exported_version;  // catalog version the export was last scheduled for
+    int takeover_fd = -1;   // control connection of the server taking over
+    bool draining = false;  // finishing the requests received before handing the listener over
+    bool handed_off = false;
+    int opt;
+
+    static const struct option long_options[] = {
+        {"storage", required_argument, NULL, 's'},
+        {"data", required_argument, NULL, 'd'},
+        {"keep-data", no_argument, NULL, 'k'},
+        {"compress-threshold", required_argument, NULL, 'c'},
+        {"max-connections", required_argument, NULL, 'm'},
+        {"max-inflight", required_argument, NULL, 'i'},
+        {"max-queue", required_argument, NULL, 'q'},
+        {"prioritize-reads", no_argument, NULL, 'r'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"read-timeout", required_argument, NULL, 'R'},
+        {"write-timeout", required_argument, NULL, 'W'},
+        {"takeover", no_argument, NULL, 'T'},
+        {"control", required_argument, NULL, 'C'},
+        {"slow-query-ms", required_argument, NULL, 'S'},
+        {"shards", required_argument, NULL, 'N'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "s:d:kc:m:i:q:rI:R:W:TC:S:N:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            storage = storage_find(optarg);
+            if (storage == NULL) {
+                fprintf(stderr, "server: unknown storage backend '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            data_path = optarg;
+            break;
+        case 'k':
+            keep_data = true;
+            break;
+        case 'c':
+            compression_threshold = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_connections = atoi(optarg);
+            break;
+        case 'i':
+            max_inflight = atoi(optarg);
+            break;
+        case 'q':
+            max_queue = atoi(optarg);
+            break;
+        case 'r':
+            prioritize_reads = true;
+            break;
+        case 'I':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'R':
+            read_timeout = atoi(optarg);
+            break;
+        case 'W':
+            write_timeout = atoi(optarg);
+            break;
+        case 'T':
+            // The data is the running server's, it is never dropped
+            takeover = true;
+            keep_data = true;
+            break;
+        case 'C':
+            control_path = optarg;
+            break;
+        case 'S':
+            slow_query_ms = atof(optarg);
+            break;
+        case 'N':
+            if (sharded_storage_set_shards(atoi(optarg)) != STORAGE_OK) {
+                fprintf(stderr, "server: the number of shards must be from 1 to %d\n", MAX_SHARDS);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: server [--storage sqlite|memory|sharded] [--data path] [--keep-data] [--compress-threshold bytes]\n"
+                            "              [--max-connections n] [--max-inflight n] [--max-queue n] [--prioritize-reads]\n"
+                            "              [--idle-timeout s] [--read-timeout s] [--write-timeout s]\n"
+                            "              [--takeover] [--control path] [--slow-query-ms ms] [--shards n]\n");
+            return 1;
+        }
+    }
+    if (data_path == NULL) {
+        data_path = storage == &sqlite_storage ? "test.db" : storage == &sharded_storage ? "sharded.db" : "movies";
+    }
+    if (control_path == NULL) {
+        snprintf(default_control_path, sizeof(default_control_path), "%s.ctl", data_path);
+        control_path = default_control_path;
+    }
+    snprintf(warm_path, sizeof(warm_path), "%s.warm", data_path);
+    snprintf(export_path, sizeof(export_path), "%s.export", data_path);
+    snprintf(slow_log_path, sizeof(slow_log_path), "%s.slow.log", data_path);
+    if (max_connections < 1 || max_inflight < 1 || max_queue < 0) {
+        fprintf(stderr, "server: connection and in-flight limits must be positive, the queue depth not negative\n");
+        return 1;
+    }
+    if (idle_timeout < 1 || read_timeout < 1 || write_timeout < 1) {
+        fprintf(stderr, "server: timeouts must be at least a second\n");
+        return 1;
+    }
+    if (slow_query_ms < 0) {
+        fprintf(stderr, "server: the slow query threshold must not be negative\n");
+        return 1;
+    }
+    timer_wheel_init(&wheel, now_ticks());
+    arena_init(&request_arena, REQUEST_ARENA_RETAIN);
+    cJSON_InitHooks(&(cJSON_Hooks){ .malloc_fn = json_alloc, .free_fn = json_free });
+
+    pfds = calloc(max_connections + FIRST_CONN, sizeof(struct pollfd));
+    conns = calloc(max_connections + FIRST_CONN, sizeof(Connection));
+    ready = calloc(max_connections, sizeof(ReadyRequest));
+    pass_writes = calloc(max_connections, sizeof(StorageWrite));
+    queued_writes = calloc(max_connections, sizeof(QueuedWrite));
+    if (pfds == NULL || conns == NULL || ready == NULL || pass_writes == NULL || queued_writes == NULL) {
+        fprintf(stderr, "server: can't allocate %d connections\n", max_connections);
+        return 1;
+    }
 
-    initialize_db(db);
+    // The running server hands its listener over once done with its requests and the storage
+    sockfd = -1;
+    if (takeover) {
+        int control_fd = hot_restart_request(control_path);
+        if (control_fd == -1) {
+            fprintf(stderr, "server: no server to take over from at %s, starting anew\n", control_path);
+        } else {
+            printf("server: waiting for the running server to hand over\n");
+            sockfd = hot_restart_receive_listener(control_fd);
+            close(control_fd);
+            if (sockfd == -1) {
+                fprintf(stderr, "server: the running server didn't hand over its listener\n");
+                return 1;
+            }
+        }
+    }
+
+    /* Open storage, shared by all requests. Existing data is dropped unless asked to keep it. */
+    if (storage->open(data_path, !keep_data) != STORAGE_OK) {
+        fprintf(stderr, "server: can't open %s storage at %s\n", storage->name, data_path);
+        return 1;
+    }
+    printf("server: using %s storage at %s\n", storage->name, data_path);
+    profile_storage(slow_log_path);
+
+    // Warm caches left by the server handed over from save scanning the whole catalog
+    if (keep_data && load_warm_caches(warm_path) == 0) {
+        printf("server: loaded warm caches from %s\n", warm_path);
+    } else if (build_caches() != 0) {
+        fprintf(stderr, "server: can't build genre index: %s\n", storage->errmsg());
+        return 1;
+    }
+    pumped_head = changefeed_head();
+
+    // Full catalog pulls are served from a file, the one of a server handed over from may still be current
+    timer_init(&export_timer);
+    export_init(export_path);
+    exported_version = storage->catalog_version();
+    if (!keep_data || export_load(exported_version) != 0) rebuild_export();
+
+    // Long-lived subscriptions need far more descriptors than the usual soft limit
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+
+    if (sockfd != -1) goto listening;
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
@@ -965,37 +1907,256 @@ int main(void)
         exit(1);
     }
 
-    sa.sa_handler = sigchld_handler; // reap all dead processes
+listening:
+    if (set_nonblocking(sockfd) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+
+    // A client closing its socket early must not kill the whole server
+    sa.sa_handler = SIG_IGN;
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+    sa.sa_flags = 0;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
         perror("sigaction");
         exit(1);
     }
 
+    add_to_pfds(pfds, conns, sockfd, &fd_count);
+    // Without a control socket the server still runs, it can't be hot restarted (poll skips fd -1)
+    add_to_pfds(pfds, conns, hot_restart_listen(control_path), &fd_count);
+
     printf("server: waiting for connections...\n");
 
-    while(1) {  // main accept() loop
-        sin_size = sizeof their_addr;
-        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (new_fd == -1) {
-            perror("accept");
-            continue;
+    while(1) {  // main poll() loop
+        // Requests left queued by the last pass are served without waiting, otherwise
+        // the wait ends in time for the next deadline
+        long ticks = timer_wheel_next(&wheel);
+        int timeout = num_pending > 0 ? 0 : ticks < 0 ? -1 : (int)(ticks * TIMER_TICK_MS);
+        if (poll(pfds, fd_count, timeout) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            exit(1);
+        }
+
+        // Stalled clients are marked for closing
+        timer_wheel_advance(&wheel, now_ticks(), timer_expired, NULL);
+
+        // A new server asks for the listener: clients wait in the backlog until it has it
+        if (pfds[1].revents & POLLIN) {
+            takeover_fd = accept(pfds[1].fd, NULL, NULL);
+            if (takeover_fd != -1) {
+                printf("server: hot restart, draining connections\n");
+                draining = true;
+                pfds[0].events = 0;
+                close(pfds[1].fd);
+                unlink(control_path);
+                pfds[1].fd = -1;
+            }
+        }
+
+        // Read from the clients first: the listener may append new ones at the end of the set
+        for (int i = FIRST_CONN; i < fd_count; i++) {
+            Connection *conn = &conns[i];
+
+            if (conn->closing) continue;
+
+            if (conn->subscriber) {
+                // Subscribers have nothing more to say, reading only tells when they leave
+                if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    char discard[256];
+                    ssize_t nbytes = recv(pfds[i].fd, discard, sizeof discard, 0);
+                    if (nbytes == 0 || (nbytes == -1 && errno != EAGAIN && errno != EINTR)) conn->closing = true;
+                }
+                if (!conn->closing && (pfds[i].revents & POLLOUT) && pump_subscriber(pfds[i].fd, conn) == -1) {
+                    conn->closing = true;
+                }
+                continue;
+            }
+
+            if (pfds[i].revents & POLLOUT) {
+                if (flush_output(pfds[i].fd, conn) == -1) {
+                    conn->closing = true;
+                    continue;
+                }
+                if (conn->close_after_write && !output_pending(conn)) {
+                    conn->closing = true;
+                    continue;
+                }
+            }
+
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            // A full buffer is a request already, the rest waits in the socket
+            if (conn->len >= MAXDATASIZE - 1) continue;
+
+            ssize_t nbytes = recv(pfds[i].fd, conn->buf + conn->len, MAXDATASIZE - 1 - conn->len, 0);
+            if (nbytes > 0) {
+                conn->len += nbytes;
+                conn->buf[conn->len] = '\0';
+                mark_pending(conn);
+            } else if (nbytes == -1 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            } else {
+                if (nbytes == -1) perror("recv");
+                conn->closing = true; // hung up
+            }
         }
 
-        inet_ntop(their_addr.ss_family,
-            get_in_addr((struct sockaddr *)&their_addr),
-            s, sizeof s);
-        printf("server: got connection from %s\n", s);
+        // Serve the whole requests received so far, up to max_inflight in this pass. More than
+        // max_queue left waiting means the server can't keep up: the excess is turned down at once,
+        // so the requests that are served still answer in time.
+        int num_ready = 0;
+        for (int i = FIRST_CONN; i < fd_count; i++) {
+            if (!conns[i].pending || conns[i].closing || output_backlogged(&conns[i])) continue;
+            ready[num_ready].slot = i;
+            ready[num_ready].is_write = conns[i].is_write;
+            ready[num_ready].arrival = conns[i].arrival;
+            num_ready++;
+        }
+        if (num_ready > 1) qsort(ready, num_ready, sizeof(ReadyRequest), compare_ready);
+
+        for (int k = 0; k < num_ready; k++) {
+            int i = ready[k].slot;
+            if (k < max_inflight && ready[k].is_write) {
+                // Writes in a row are served together, a read after them sees them all
+                int run = 1;
+                while (k + run < num_ready && k + run < max_inflight && ready[k + run].is_write) run++;
+                serve_writes(pfds, conns, ready + k, run);
+                k += run - 1;
+            } else if (k < max_inflight) {
+                serve_request(&pfds[i], &conns[i], false);
+            } else if (k >= max_inflight + max_queue) {
+                serve_request(&pfds[i], &conns[i], true);
+            }
+        }
+        // Reads of the next pass run again, they may come after writes
+        coalesce_clear();
+        // Once handed over, the storage is closed and the export files belong to the new server
+        if (!handed_off && storage->catalog_version() != exported_version) {
+            exported_version = storage->catalog_version();
+            schedule_export();
+        }
+
+        // Fan the changes published by this pass out to the subscribers that are not waiting on their socket
+        if (changefeed_head() != pumped_head) {
+            pumped_head = changefeed_head();
+            for (int i = FIRST_CONN; i < fd_count; i++) {
+                Connection *conn = &conns[i];
+                if (!conn->subscriber || conn->closing || conn->sent < conn->len) continue;
+
+                if (pump_subscriber(pfds[i].fd, conn) == -1) conn->closing = true;
+            }
+        }
+
+        // Close the connections done with, set the deadlines and events of the others
+        // and count the requests still queued
+        num_pending = 0;
+        for (int i = FIRST_CONN; i < fd_count; i++) {
+            Connection *conn = &conns[i];
+            if (conn->closing) {
+                close(pfds[i].fd);
+                del_from_pfds(pfds, conns, i, &fd_count);
+                i--; // the last connection was moved to this slot
+                continue;
+            }
+
+            if (draining) {
+                drain_connection(conn);
+                if (conn->closing) {
+                    close(pfds[i].fd);
+                    del_from_pfds(pfds, conns, i, &fd_count);
+                    i--;
+                    continue;
+                }
+            }
+
+            update_deadline(conn);
+            bool writing = output_pending(conn) || (conn->subscriber && conn->sent < conn->len);
+            pfds[i].events = writing ? POLLIN | POLLOUT : POLLIN;
+            if (conn->pending && !output_backlogged(conn)) num_pending++;
+        }
 
-        if (!fork()) { // this is the child process
-            close(sockfd); // child doesn't need the listener
-            handle_request(new_fd, db);
-            close(new_fd);
-            exit(0);
+        // Drained: the listener goes to the new server once the caches are saved and the storage is closed.
+        // Responses still being written are finished before exiting.
+        if (draining && !handed_off) {
+            bool busy = false;
+            for (int i = FIRST_CONN; i < fd_count; i++) {
+                if ((conns[i].pending || conns[i].len > 0) && !conns[i].close_after_write) busy = true;
+            }
+            if (!busy) {
+                if (save_warm_caches(warm_path) != 0) {
+                    fprintf(stderr, "server: can't save warm caches to %s\n", warm_path);
+                }
+                // A stale export is rebuilt while the storage is open, its files are the new server's after that
+                if (timer_armed(&export_timer)) {
+                    timer_cancel(&wheel, &export_timer);
+                    rebuild_export();
+                }
+                storage->close();
+                if (hot_restart_send_listener(takeover_fd, sockfd) == 0) {
+                    printf("server: handed the listener over\n");
+                    close(sockfd);
+                    pfds[0].fd = -1;
+                    handed_off = true;
+                } else if (storage->open(data_path, false) == STORAGE_OK) {
+                    // The new server is gone, this one goes on serving
+                    fprintf(stderr, "server: hot restart failed, serving again\n");
+                    profile_storage(slow_log_path);
+                    remove(warm_path);
+                    pfds[0].events = POLLIN;
+                    pfds[1].fd = hot_restart_listen(control_path);
+                    draining = false;
+                } else {
+                    fprintf(stderr, "server: can't reopen %s storage at %s\n", storage->name, data_path);
+                    exit(1);
+                }
+                close(takeover_fd);
+                takeover_fd = -1;
+            }
+        }
+        if (handed_off && fd_count == FIRST_CONN) {
+            printf("server: hot restart done, exiting\n");
+            free(pfds);
+            free(conns);
+            free(ready);
+            free(pass_writes);
+            free(queued_writes);
+            arena_destroy(&request_arena);
+            return 0;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            while (1) {
+                sin_size = sizeof their_addr;
+                new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+                if (new_fd == -1) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+                    break;
+                }
+
+                // Over the connection limit the client gets "overloaded" instead of waiting in the backlog
+                if (fd_count >= max_connections + FIRST_CONN) {
+                    reject_connection(new_fd);
+                    continue;
+                }
+
+                inet_ntop(their_addr.ss_family,
+                    get_in_addr((struct sockaddr *)&their_addr),
+                    s, sizeof s);
+                printf("server: got connection from %s\n", s);
+
+                // Responses are written without blocking, a slow client must not stall the others
+                if (set_nonblocking(new_fd) == -1) {
+                    perror("fcntl");
+                    close(new_fd);
+                    continue;
+                }
+                add_to_pfds(pfds, conns, new_fd, &fd_count);
+                update_deadline(&conns[fd_count - 1]);
+            }
         }
-        close(new_fd);  // parent doesn't need this
     }
 
+    arena_destroy(&request_arena);
     return 0;
 }
@@ -0,0 +1,253 @@
+/*
+** sqlite_profile.c -- execution profile of the SQL statements of a connection
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sqlite_profile.h"
+
+#define PLAN_MAX_DEPTH 64 // plan lines indented deeper are written at this depth
+#define MAX_RUNNING 256   // most statements timed at once, nested ones and those of other threads included
+
+typedef struct {
+    StatementStats stats;
+    uint32_t hash;
+} ProfileEntry;
+
+// Connections may be used by several threads, their trace callbacks take the lock
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static sqlite3 **profiled_dbs = NULL;
+static int num_profiled = 0, profiled_capacity = 0;
+static FILE *slow_log = NULL;
+static int64_t slow_ns;
+static _Thread_local bool explaining = false; // the plan of a slow statement is being read, its own run is not profiled
+
+static ProfileEntry *entries = NULL;
+static int num_entries = 0, entries_capacity = 0;
+
+// Statements started and not yet reset, with the time they started at
+static struct {
+    sqlite3_stmt *stmt;
+    int64_t start_ns;
+} running[MAX_RUNNING];
+static int num_running = 0;
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Time a statement from its first step, a trigger program it runs doesn't start it again
+static void statement_started(sqlite3_stmt *stmt)
+{
+    for (int i = 0; i < num_running; i++) {
+        if (running[i].stmt == stmt) return;
+    }
+    if (num_running == MAX_RUNNING) return;
+    running[num_running].stmt = stmt;
+    running[num_running].start_ns = monotonic_ns();
+    num_running++;
+}
+
+// Run time of a statement done with, -1 when it wasn't seen starting
+static int64_t statement_done(sqlite3_stmt *stmt)
+{
+    for (int i = 0; i < num_running; i++) {
+        if (running[i].stmt == stmt) {
+            int64_t ns = monotonic_ns() - running[i].start_ns;
+            running[i] = running[--num_running];
+            return ns;
+        }
+    }
+    return -1;
+}
+
+static uint32_t hash_sql(const char *sql)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *sql != '\0'; sql++) {
+        hash ^= (unsigned char)*sql;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Entry of a SQL text, added on its first run. There are a few dozen of them, a linear search does.
+static ProfileEntry *find_entry(const char *sql)
+{
+    uint32_t hash = hash_sql(sql);
+
+    for (int i = 0; i < num_entries; i++) {
+        if (entries[i].hash == hash && strcmp(entries[i].stats.sql, sql) == 0) return &entries[i];
+    }
+
+    if (num_entries == entries_capacity) {
+        int capacity = entries_capacity ? entries_capacity * 2 : 64;
+        ProfileEntry *grown = realloc(entries, capacity * sizeof(ProfileEntry));
+        if (grown == NULL) return NULL;
+        entries = grown;
+        entries_capacity = capacity;
+    }
+
+    char *copy = strdup(sql);
+    if (copy == NULL) return NULL;
+
+    ProfileEntry *entry = &entries[num_entries++];
+    memset(entry, 0, sizeof(ProfileEntry));
+    entry->stats.sql = copy;
+    entry->hash = hash;
+    return entry;
+}
+
+// Write the query plan of a statement, each step indented under its parent
+static void write_plan(sqlite3_stmt *stmt_of_plan)
+{
+    const char *sql = sqlite3_sql(stmt_of_plan);
+    struct { int id, depth; } steps[PLAN_MAX_DEPTH];
+    int num_steps = 0;
+    sqlite3_stmt *stmt;
+    char *explain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+
+    if (explain == NULL) return;
+    explaining = true;
+    if (sqlite3_prepare_v2(sqlite3_db_handle(stmt_of_plan), explain, -1, &stmt, NULL) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int id = sqlite3_column_int(stmt, 0);
+            int parent = sqlite3_column_int(stmt, 1);
+            const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+            int depth = 1;
+
+            for (int i = num_steps - 1; i >= 0; i--) {
+                if (steps[i].id == parent) {
+                    depth = steps[i].depth + 1;
+                    break;
+                }
+            }
+            if (num_steps < PLAN_MAX_DEPTH) {
+                steps[num_steps].id = id;
+                steps[num_steps].depth = depth;
+                num_steps++;
+            }
+            fprintf(slow_log, "%*s%s\n", 4 * (depth < PLAN_MAX_DEPTH ? depth : PLAN_MAX_DEPTH), "", detail ? detail : "");
+        }
+        sqlite3_finalize(stmt);
+    }
+    explaining = false;
+    sqlite3_free(explain);
+}
+
+static void log_slow(sqlite3_stmt *stmt, int64_t ns)
+{
+    char when[32];
+    time_t now = time(NULL);
+    char *expanded = sqlite3_expanded_sql(stmt);
+
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(slow_log, "%s %.3f ms: %s\n", when, ns / 1e6, expanded ? expanded : sqlite3_sql(stmt));
+    sqlite3_free(expanded);
+
+    write_plan(stmt);
+    fflush(slow_log);
+}
+
+// SQLITE_TRACE_STMT: a statement started running. SQLITE_TRACE_PROFILE: it was reset, the time it
+// comes with is only as precise as a millisecond, so it is measured here.
+static int trace_profile(unsigned type, void *ctx, void *p, void *x)
+{
+    sqlite3_stmt *stmt = p;
+    (void)ctx;
+    if (explaining) return 0;
+    if (type == SQLITE_TRACE_STMT) {
+        pthread_mutex_lock(&profile_lock);
+        statement_started(stmt);
+        pthread_mutex_unlock(&profile_lock);
+        return 0;
+    }
+
+    const char *sql = sqlite3_sql(stmt);
+    if (sql == NULL) return 0;
+
+    pthread_mutex_lock(&profile_lock);
+    int64_t ns = statement_done(stmt);
+    if (ns < 0) ns = *(int64_t *)x;
+
+    ProfileEntry *entry = find_entry(sql);
+    if (entry != NULL) {
+        StatementStats *stats = &entry->stats;
+        double ms = ns / 1e6;
+
+        stats->runs++;
+        stats->total_ms += ms;
+        if (ms > stats->max_ms) stats->max_ms = ms;
+        // The counters are reset so that every run is counted once
+        stats->fullscan_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        stats->sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+        stats->autoindexes += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+        stats->vm_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+    }
+
+    if (slow_log != NULL && ns >= slow_ns) log_slow(stmt, ns);
+    pthread_mutex_unlock(&profile_lock);
+    return 0;
+}
+
+int sqlite_profile_start(sqlite3 *db, const char *slow_log_path, double slow_ms)
+{
+    if (num_profiled == profiled_capacity) {
+        int capacity = profiled_capacity ? profiled_capacity * 2 : 8;
+        sqlite3 **grown = realloc(profiled_dbs, capacity * sizeof(sqlite3 *));
+        if (grown == NULL) return -1;
+        profiled_dbs = grown;
+        profiled_capacity = capacity;
+    }
+
+    slow_ns = (int64_t)(slow_ms * 1e6);
+    if (slow_log_path != NULL && slow_log == NULL) {
+        slow_log = fopen(slow_log_path, "a");
+        if (slow_log == NULL) {
+            perror("Can't open slow query log");
+            return -1;
+        }
+    }
+    if (sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, trace_profile, NULL) != SQLITE_OK) return -1;
+    profiled_dbs[num_profiled++] = db;
+    return 0;
+}
+
+void sqlite_profile_stop(void)
+{
+    for (int i = 0; i < num_profiled; i++) sqlite3_trace_v2(profiled_dbs[i], 0, NULL, NULL);
+    num_profiled = 0;
+    num_running = 0;
+}
+
+static int compare_total(const void *a, const void *b)
+{
+    const ProfileEntry *x = *(const ProfileEntry *const *)a, *y = *(const ProfileEntry *const *)b;
+    return x->stats.total_ms < y->stats.total_ms ? 1 : x->stats.total_ms > y->stats.total_ms ? -1 : 0;
+}
+
+void sqlite_profile_visit(StatementStatsVisitor visit, void *ctx)
+{
+    pthread_mutex_lock(&profile_lock);
+    const ProfileEntry **order = malloc(num_entries * sizeof(ProfileEntry *) + 1);
+    if (order == NULL) {
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+
+    for (int i = 0; i < num_entries; i++) order[i] = &entries[i];
+    qsort(order, num_entries, sizeof(ProfileEntry *), compare_total);
+    for (int i = 0; i < num_entries; i++) visit(&order[i]->stats, ctx);
+    pthread_mutex_unlock(&profile_lock);
+    free(order);
+}
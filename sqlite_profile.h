@@ -0,0 +1,28 @@
+/*
+** sqlite_profile.h -- execution profile of the SQL statements of a connection
+**
+** A trace callback sees every statement start (SQLITE_TRACE_STMT) and
+** complete (SQLITE_TRACE_PROFILE); its run time goes from its first step to
+** its reset, rows being handled by the caller in between included. Runs are
+** summed per SQL text along with the statement counters of the run (full
+** scan steps, sorts, automatic indexes, VM steps). A run over the slow
+** threshold is written to the slow query log with its bound parameters and
+** query plan. Statements of the same SQL text run on several connections,
+** from any thread, are summed together.
+*/
+
+#ifndef SQLITE_PROFILE_H
+#define SQLITE_PROFILE_H
+
+#include <sqlite3.h>
+
+#include "storage.h"
+
+// Profile the statements of db too, returns 0 on success
+int sqlite_profile_start(sqlite3 *db, const char *slow_log, double slow_ms);
+// Stop profiling every connection before they are closed, the profile is kept
+void sqlite_profile_stop(void);
+// Visit the profile of every statement, slowest in total first
+void sqlite_profile_visit(StatementStatsVisitor visit, void *ctx);
+
+#endif
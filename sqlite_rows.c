@@ -0,0 +1,88 @@
+/*
+** sqlite_rows.c -- movies as stored in the rows of the SQLite backends
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sqlite_rows.h"
+
+int append_genre(unsigned char *blob, int len, const char *name)
+{
+    size_t name_len = strnlen(name, GENRE_NAME_SIZE - 1);
+
+    blob[len++] = (unsigned char)name_len;
+    memcpy(blob + len, name, name_len);
+    return len + (int)name_len;
+}
+
+int encode_genres(const Movie *movie, unsigned char *blob)
+{
+    int len = 0;
+    for (int i = 0; i < movie->num_genres; i++) {
+        len = append_genre(blob, len, movie->genre[i]);
+    }
+    return len;
+}
+
+void decode_genres(const unsigned char *blob, int len, Movie *movie)
+{
+    int pos = 0;
+
+    movie->num_genres = 0;
+    while (blob != NULL && pos < len && movie->num_genres < MAX_GENRES) {
+        int name_len = blob[pos++];
+        if (name_len > len - pos || name_len >= GENRE_NAME_SIZE) break;
+
+        memcpy(movie->genre[movie->num_genres], blob + pos, name_len);
+        movie->genre[movie->num_genres][name_len] = '\0';
+        movie->num_genres++;
+        pos += name_len;
+    }
+}
+
+void column_string(sqlite3_stmt *stmt, int col, char *out, size_t out_size)
+{
+    const char *text = (const char *)sqlite3_column_text(stmt, col);
+    snprintf(out, out_size, "%s", text ? text : "");
+}
+
+void read_movie(sqlite3_stmt *stmt, Movie *movie)
+{
+    memset(movie, 0, sizeof(Movie));
+    movie->id = sqlite3_column_int(stmt, 0);
+    column_string(stmt, 1, movie->title, sizeof(movie->title));
+    column_string(stmt, 2, movie->director, sizeof(movie->director));
+    movie->release_year = sqlite3_column_int(stmt, 3);
+    decode_genres(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4), movie);
+    movie->version = sqlite3_column_int(stmt, 5);
+}
+
+int build_match_expr(const char *query, bool prefix, char *out, size_t out_size)
+{
+    size_t len = 0;
+    int terms = 0;
+
+    out[0] = '\0';
+    while (*query != '\0') {
+        // Skip separators between words
+        while (*query == ' ' || *query == '\t') query++;
+        if (*query == '\0') break;
+
+        // Reserve room for the opening quote, closing quote, '*', separator and terminator
+        if (len + 5 >= out_size) break;
+        if (terms > 0) out[len++] = ' ';
+        out[len++] = '"';
+        while (*query != '\0' && *query != ' ' && *query != '\t' && len + 4 < out_size) {
+            // Double quotes inside an FTS5 string are escaped by doubling them
+            if (*query == '"') out[len++] = '"';
+            out[len++] = *query++;
+        }
+        out[len++] = '"';
+        if (prefix) out[len++] = '*';
+        out[len] = '\0';
+        terms++;
+    }
+
+    return terms;
+}
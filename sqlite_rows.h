@@ -0,0 +1,52 @@
+/*
+** sqlite_rows.h -- movies as stored in the rows of the SQLite backends
+**
+** A movie row holds its genre names in Movie.Genres, each one prefixed by
+** its length in one byte, so it is read without joining Movie_Genre.
+*/
+
+#ifndef SQLITE_ROWS_H
+#define SQLITE_ROWS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sqlite3.h>
+
+#include "storage.h"
+
+#define GENRES_BLOB_SIZE (MAX_GENRES * GENRE_NAME_SIZE)
+
+// Full-text index over Title and Director, kept in sync with Movie by triggers
+#define MOVIE_SEARCH_SCHEMA \
+    "CREATE VIRTUAL TABLE IF NOT EXISTS Movie_Search USING fts5(" \
+        "Title, Director, content='Movie', content_rowid='ID', prefix='2 3');" \
+    "CREATE TRIGGER IF NOT EXISTS Movie_Search_Insert AFTER INSERT ON Movie BEGIN " \
+        "INSERT INTO Movie_Search(rowid, Title, Director) VALUES (new.ID, new.Title, new.Director);" \
+    "END;" \
+    "CREATE TRIGGER IF NOT EXISTS Movie_Search_Delete AFTER DELETE ON Movie BEGIN " \
+        "INSERT INTO Movie_Search(Movie_Search, rowid, Title, Director) VALUES ('delete', old.ID, old.Title, old.Director);" \
+    "END;" \
+    "CREATE TRIGGER IF NOT EXISTS Movie_Search_Update AFTER UPDATE ON Movie BEGIN " \
+        "INSERT INTO Movie_Search(Movie_Search, rowid, Title, Director) VALUES ('delete', old.ID, old.Title, old.Director);" \
+        "INSERT INTO Movie_Search(rowid, Title, Director) VALUES (new.ID, new.Title, new.Director);" \
+    "END;"
+
+// Append a genre name to a Genres blob, returns the new length of the blob
+int append_genre(unsigned char *blob, int len, const char *name);
+// Encode the genres of a movie as stored in Movie.Genres, returns the length of the blob
+int encode_genres(const Movie *movie, unsigned char *blob);
+// Decode a Genres blob into the genres of a movie
+void decode_genres(const unsigned char *blob, int len, Movie *movie);
+
+// Copy a column as text, NULL becomes an empty string
+void column_string(sqlite3_stmt *stmt, int col, char *out, size_t out_size);
+// Read a row of (ID, Title, Director, ReleaseYear, Genres, Version) into a movie
+void read_movie(sqlite3_stmt *stmt, Movie *movie);
+
+// Turn the free text of a search request into an FTS5 MATCH expression.
+// Every word becomes a quoted term (so FTS5 operators in user input are not interpreted),
+// optionally matched as a prefix. Returns the number of terms written.
+int build_match_expr(const char *query, bool prefix, char *out, size_t out_size);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+** storage.c -- registry of the available storage backends
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "storage.h"
+
+static const Storage *backends[] = {
+    &sqlite_storage,
+    &memory_storage,
+    &sharded_storage,
+};
+
+const Storage *storage_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) return backends[i];
+    }
+    return NULL;
+}
+
+// Run a write with the single write operations of a backend
+static void write_one(const Storage *backend, StorageWrite *write)
+{
+    switch (write->type) {
+    case WRITE_CREATE:
+        write->status = backend->create(&write->movie);
+        break;
+    case WRITE_UPDATE:
+        write->status = backend->update(&write->movie, &write->previous);
+        write->movie.version = write->previous.version + 1;
+        break;
+    case WRITE_REMOVE:
+        write->status = backend->remove(write->movie.id, &write->previous);
+        break;
+    }
+    if (write->status == STORAGE_ERROR) snprintf(write->error, sizeof(write->error), "%s", backend->errmsg());
+    write->catalog_version = backend->catalog_version();
+}
+
+void storage_write_batch(const Storage *backend, StorageWrite *writes, int num_writes)
+{
+    if (backend->write_batch != NULL) {
+        backend->write_batch(writes, num_writes);
+        return;
+    }
+    for (int i = 0; i < num_writes; i++) write_one(backend, &writes[i]);
+}
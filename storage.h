@@ -0,0 +1,137 @@
+/*
+** storage.h -- storage backends for the movie catalog
+**
+** Request handlers only talk to a Storage: a table of operations that a
+** backend (SQLite, in-memory, ...) fills in. Operations return one of the
+** STORAGE_* codes, details of the last error come from errmsg().
+*/
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdbool.h>
+
+#define MAX_GENRES 10       // Max number of genres in a single movie
+#define TITLE_SIZE 128
+#define DIRECTOR_SIZE 128
+#define GENRE_NAME_SIZE 64
+#define MAX_SHARDS 64       // Max number of database files of the sharded backend
+
+// Status codes of storage operations
+#define STORAGE_OK 0
+#define STORAGE_NOT_FOUND 1
+#define STORAGE_ERROR -1
+
+typedef struct {
+    int id;
+    int version;        // starts at 1 and is bumped by every update
+    char title[TITLE_SIZE];
+    char director[DIRECTOR_SIZE];
+    int release_year;
+    char genre[MAX_GENRES][GENRE_NAME_SIZE];
+    int num_genres;
+} Movie;
+
+// Called for every movie found by a scan or search, a non-zero return stops it
+typedef int (*MovieVisitor)(const Movie *movie, void *ctx);
+
+// Execution profile of one SQL statement, summed over its runs
+typedef struct {
+    const char *sql;
+    long long runs;
+    double total_ms, max_ms;    // from the first step to the end, rows handled by the caller included
+    long long fullscan_steps;   // rows read by full table scans
+    long long sorts;
+    long long autoindexes;      // rows put in indexes built on the fly
+    long long vm_steps;
+} StatementStats;
+
+typedef void (*StatementStatsVisitor)(const StatementStats *stats, void *ctx);
+
+typedef enum {
+    WRITE_CREATE,
+    WRITE_UPDATE,
+    WRITE_REMOVE,
+} WriteType;
+
+// A write of a batch and, once run, what came of it
+typedef struct {
+    WriteType type;
+    Movie movie;                // a create gets its ID and an update its new version, a remove only needs the ID
+    Movie previous;             // the movie an update or remove replaced
+    int status;                 // STORAGE_* code
+    long long catalog_version;  // version the write brought the catalog to
+    char error[256];            // errmsg() of a failed write
+} StorageWrite;
+
+// Order of the movies of a listing, ties are broken by ID
+typedef enum {
+    SORT_ID,
+    SORT_YEAR,
+    SORT_TITLE,
+} MovieSort;
+
+// Movies released from year_from to year_to (both included), having genre unless it is empty
+typedef struct {
+    int year_from, year_to;
+    char genre[GENRE_NAME_SIZE];
+    MovieSort sort;
+    int limit;          // -1 for no limit
+} MovieQuery;
+
+typedef struct {
+    const char *name;
+
+    // Open the backend at path, dropping any existing data when reset is set
+    int (*open)(const char *path, bool reset);
+    void (*close)(void);
+
+    // Insert a new movie, its new ID and version are written to movie
+    int (*create)(Movie *movie);
+    int (*get)(int id, Movie *movie);
+    // Visit the movies among ids that exist, in no particular order. A repeated ID may be visited more than once.
+    int (*get_many)(const int *ids, int num_ids, MovieVisitor visit, void *ctx);
+    // Replace the movie with the same ID and bump its version, STORAGE_NOT_FOUND when it does not exist.
+    // The movie as it was before the write is stored in previous unless it is NULL, as by remove.
+    int (*update)(const Movie *movie, Movie *previous);
+    int (*remove)(int id, Movie *previous);
+    // Run writes with the same outcome as one at a time in order, each succeeding or failing on its own.
+    // NULL for backends that only write one at a time, see storage_write_batch().
+    void (*write_batch)(StorageWrite *writes, int num_writes);
+
+    // Current version of a movie, without reading the rest of it
+    int (*version)(int id, int *version);
+    // Version of the whole catalog, bumped by every write
+    long long (*catalog_version)(void);
+
+    // Visit every movie in ID order. Without detail only id and title are filled.
+    int (*scan)(bool detail, MovieVisitor visit, void *ctx);
+    // Visit up to limit movies whose title or director match the words of query, best first
+    int (*search)(const char *query, bool prefix, int limit, MovieVisitor visit, void *ctx);
+    // Visit up to query->limit movies matching the query in its order, using an index rather than a scan
+    int (*query)(const MovieQuery *query, MovieVisitor visit, void *ctx);
+
+    // Profile the statements run from now on, those slower than slow_ms are logged with their plan
+    // to slow_log. Both are NULL for backends without statements.
+    int (*profile)(const char *slow_log, double slow_ms);
+    // Visit the profile of every statement run since profiling started, slowest in total first
+    void (*statement_stats)(StatementStatsVisitor visit, void *ctx);
+
+    const char *(*errmsg)(void);
+} Storage;
+
+extern const Storage sqlite_storage;
+extern const Storage memory_storage;
+extern const Storage sharded_storage;
+
+// Number of shards a new sharded catalog is made with, an existing one keeps its own.
+// Returns STORAGE_ERROR unless it is from 1 to MAX_SHARDS.
+int sharded_storage_set_shards(int count);
+
+// Find a backend by name, NULL if there is none
+const Storage *storage_find(const char *name);
+
+// Run writes on a backend, at once when it can
+void storage_write_batch(const Storage *backend, StorageWrite *writes, int num_writes);
+
+#endif
@@ -0,0 +1,864 @@
+/*
+** storage_memory.c -- in-memory storage backend
+**
+** Movies live in an array indexed by their ID and genres in a dictionary
+** array, so lookups are a single array access. Every write is first
+** appended to an operation log (<path>.log) and synced, then applied in
+** memory. Every SNAPSHOT_INTERVAL operations the whole catalog is written
+** to <path>.snapshot and the log starts over. At startup the snapshot is
+** loaded and the log replayed on top of it. Log records carry the full
+** state of the movie, so replaying a record twice gives the same result.
+** Listings come from two arrays of IDs kept sorted by (year, ID) and by
+** title, built once the catalog is loaded.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "storage.h"
+
+#define SNAPSHOT_INTERVAL 1000 // log records written before the catalog is snapshotted
+#define SNAPSHOT_MAGIC "TCPSNAP1"
+
+// Operations of the log
+#define LOG_CREATE 1
+#define LOG_UPDATE 2
+#define LOG_DELETE 3
+
+typedef struct {
+    int id;                            // 0 when the slot is free
+    int version;
+    int release_year;
+    int num_genres;
+    uint16_t genre_ids[MAX_GENRES];    // indexes in the genre dictionary
+    char title[TITLE_SIZE];
+    char director[DIRECTOR_SIZE];
+} MemoryMovie;
+
+typedef struct {
+    uint32_t op;
+    uint32_t checksum;          // of the record, detects a torn write at the end of the log
+    int64_t catalog_version;    // catalog version once the operation is applied
+    Movie movie;
+} LogRecord;
+
+typedef struct {
+    char magic[8];
+    int32_t next_id;
+    int32_t count;      // Movie records following the header
+    int64_t catalog_version;
+} SnapshotHeader;
+
+static MemoryMovie *movies = NULL;   // slot i holds the movie with ID i
+static int movies_capacity = 0;
+static int next_id = 1;
+static long long catalog_version = 0;
+
+static char (*genre_names)[GENRE_NAME_SIZE] = NULL;
+static int num_genre_names = 0;
+static int genre_names_capacity = 0;
+
+// Open addressing hash table from title to movie ID, keeps titles unique
+static int *title_slots = NULL;      // 0 is empty, TOMBSTONE a removed entry
+static size_t title_capacity = 0;
+static size_t title_used = 0;        // live entries and tombstones
+#define TOMBSTONE -1
+
+// IDs of the movies sorted by (release year, ID) and by title, NULL until built
+static int *by_year = NULL;
+static int *by_title = NULL;
+static int num_sorted = 0;
+static int sorted_capacity = 0;
+
+static int log_fd = -1;
+static int log_records = 0;
+static char log_path[256];
+static char snapshot_path[256];
+static char last_error[256];
+
+static int fail(const char *fmt, const char *detail)
+{
+    snprintf(last_error, sizeof(last_error), fmt, detail);
+    fprintf(stderr, "%s\n", last_error);
+    return STORAGE_ERROR;
+}
+
+static uint32_t hash_bytes(const void *data, size_t len)
+{
+    // FNV-1a
+    const unsigned char *p = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int title_lookup(const char *title)
+{
+    if (title_capacity == 0) return 0;
+
+    size_t mask = title_capacity - 1;
+    for (size_t i = hash_bytes(title, strlen(title)) & mask; title_slots[i] != 0; i = (i + 1) & mask) {
+        int id = title_slots[i];
+        if (id != TOMBSTONE && strcmp(movies[id].title, title) == 0) return id;
+    }
+    return 0;
+}
+
+static void title_insert(int id);
+
+static int title_rehash(size_t capacity)
+{
+    int *old_slots = title_slots;
+    size_t old_capacity = title_capacity;
+
+    title_slots = calloc(capacity, sizeof(int));
+    if (title_slots == NULL) {
+        title_slots = old_slots;
+        return -1;
+    }
+    title_capacity = capacity;
+    title_used = 0;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i] > 0) title_insert(old_slots[i]);
+    }
+    free(old_slots);
+    return 0;
+}
+
+// Make room for one more title, keeping the table at most half full, tombstones included
+static int title_reserve(void)
+{
+    if ((title_used + 1) * 2 <= title_capacity) return 0;
+    return title_rehash(title_capacity ? title_capacity * 2 : 64);
+}
+
+// Add a title, title_reserve made room for it
+static void title_insert(int id)
+{
+    size_t mask = title_capacity - 1;
+    size_t i = hash_bytes(movies[id].title, strlen(movies[id].title)) & mask;
+    while (title_slots[i] > 0) i = (i + 1) & mask;
+    if (title_slots[i] == 0) title_used++;
+    title_slots[i] = id;
+}
+
+static void title_remove(int id)
+{
+    if (title_capacity == 0) return;
+
+    size_t mask = title_capacity - 1;
+    for (size_t i = hash_bytes(movies[id].title, strlen(movies[id].title)) & mask; title_slots[i] != 0; i = (i + 1) & mask) {
+        if (title_slots[i] == id) {
+            title_slots[i] = TOMBSTONE;
+            return;
+        }
+    }
+}
+
+static int genre_lookup_or_add(const char *name)
+{
+    for (int i = 0; i < num_genre_names; i++) {
+        if (strcmp(genre_names[i], name) == 0) return i;
+    }
+
+    if (num_genre_names == UINT16_MAX) return -1;
+    if (num_genre_names == genre_names_capacity) {
+        int capacity = genre_names_capacity ? genre_names_capacity * 2 : 32;
+        char (*grown)[GENRE_NAME_SIZE] = realloc(genre_names, capacity * sizeof(*genre_names));
+        if (grown == NULL) return -1;
+        genre_names = grown;
+        genre_names_capacity = capacity;
+    }
+
+    snprintf(genre_names[num_genre_names], GENRE_NAME_SIZE, "%s", name);
+    return num_genre_names++;
+}
+
+static int compare_year(int a, int b)
+{
+    if (movies[a].release_year != movies[b].release_year) return movies[a].release_year < movies[b].release_year ? -1 : 1;
+    return a < b ? -1 : a > b;
+}
+
+static int compare_title(int a, int b)
+{
+    int c = strcmp(movies[a].title, movies[b].title);
+    return c != 0 ? c : (a < b ? -1 : a > b);
+}
+
+static int qsort_year(const void *a, const void *b)
+{
+    return compare_year(*(const int *)a, *(const int *)b);
+}
+
+static int qsort_title(const void *a, const void *b)
+{
+    return compare_title(*(const int *)a, *(const int *)b);
+}
+
+static int qsort_id(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Position of id in a sorted index, or where it goes
+static int sorted_position(const int *index, int id, int (*compare)(int, int))
+{
+    int lo = 0, hi = num_sorted;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (compare(index[mid], id) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Make room for one more movie in the sorted indexes, once they are built
+static int sorted_reserve(void)
+{
+    if (by_year == NULL || num_sorted < sorted_capacity) return 0;
+
+    int capacity = sorted_capacity * 2;
+    int *year_grown = realloc(by_year, capacity * sizeof(int));
+    if (year_grown == NULL) return -1;
+    by_year = year_grown;
+    int *title_grown = realloc(by_title, capacity * sizeof(int));
+    if (title_grown == NULL) return -1;
+    by_title = title_grown;
+    sorted_capacity = capacity;
+    return 0;
+}
+
+// Add a stored movie to the sorted indexes, sorted_reserve made room for it
+static void sorted_insert(int id)
+{
+    if (by_year == NULL) return;
+
+    int y = sorted_position(by_year, id, compare_year);
+    int t = sorted_position(by_title, id, compare_title);
+    memmove(by_year + y + 1, by_year + y, (num_sorted - y) * sizeof(int));
+    memmove(by_title + t + 1, by_title + t, (num_sorted - t) * sizeof(int));
+    by_year[y] = by_title[t] = id;
+    num_sorted++;
+}
+
+// Remove a movie from the sorted indexes, before its slot changes
+static void sorted_remove(int id)
+{
+    if (by_year == NULL) return;
+
+    int y = sorted_position(by_year, id, compare_year);
+    int t = sorted_position(by_title, id, compare_title);
+    memmove(by_year + y, by_year + y + 1, (num_sorted - y - 1) * sizeof(int));
+    memmove(by_title + t, by_title + t + 1, (num_sorted - t - 1) * sizeof(int));
+    num_sorted--;
+}
+
+// Sort the loaded catalog once rather than inserting movie by movie
+static int build_sorted(void)
+{
+    int count = 0;
+    for (int id = 1; id < next_id && id < movies_capacity; id++) {
+        if (movies[id].id != 0) count++;
+    }
+
+    sorted_capacity = count > 64 ? count : 64;
+    by_year = malloc(sorted_capacity * sizeof(int));
+    by_title = malloc(sorted_capacity * sizeof(int));
+    if (by_year == NULL || by_title == NULL) return -1;
+
+    num_sorted = 0;
+    for (int id = 1; id < next_id && id < movies_capacity; id++) {
+        if (movies[id].id != 0) by_year[num_sorted++] = id;
+    }
+    memcpy(by_title, by_year, num_sorted * sizeof(int));
+    qsort(by_year, num_sorted, sizeof(int), qsort_year);
+    qsort(by_title, num_sorted, sizeof(int), qsort_title);
+    return 0;
+}
+
+static bool slot_used(int id)
+{
+    return id > 0 && id < movies_capacity && movies[id].id != 0;
+}
+
+static int reserve_slot(int id)
+{
+    if (id < movies_capacity) return 0;
+
+    int capacity = movies_capacity ? movies_capacity : 1024;
+    while (capacity <= id) capacity *= 2;
+
+    MemoryMovie *grown = realloc(movies, capacity * sizeof(MemoryMovie));
+    if (grown == NULL) return -1;
+    memset(grown + movies_capacity, 0, (capacity - movies_capacity) * sizeof(MemoryMovie));
+    movies = grown;
+    movies_capacity = capacity;
+    return 0;
+}
+
+// Make room for a movie and look its genres up: everything that may fail to store it,
+// done before it is logged so that once logged it is surely stored
+static int prepare_put(const Movie *movie, uint16_t genre_ids[], int *num_genres)
+{
+    *num_genres = 0;
+    if (movie->id <= 0 || reserve_slot(movie->id) != 0) return -1;
+    for (int i = 0; i < movie->num_genres && i < MAX_GENRES; i++) {
+        int genre = genre_lookup_or_add(movie->genre[i]);
+        if (genre < 0) return -1;
+        genre_ids[(*num_genres)++] = (uint16_t)genre;
+    }
+    if (title_reserve() != 0 || sorted_reserve() != 0) return -1;
+    return 0;
+}
+
+// Store the full state of a movie in its slot, prepare_put made room for it
+static void store_put(const Movie *movie, const uint16_t genre_ids[], int num_genres)
+{
+    MemoryMovie *slot = &movies[movie->id];
+    if (slot->id != 0) {
+        title_remove(slot->id);
+        sorted_remove(slot->id);
+    }
+
+    memset(slot, 0, sizeof(MemoryMovie));
+    slot->id = movie->id;
+    slot->version = movie->version;
+    slot->release_year = movie->release_year;
+    snprintf(slot->title, sizeof(slot->title), "%s", movie->title);
+    snprintf(slot->director, sizeof(slot->director), "%s", movie->director);
+    memcpy(slot->genre_ids, genre_ids, num_genres * sizeof(uint16_t));
+    slot->num_genres = num_genres;
+
+    if (movie->id >= next_id) next_id = movie->id + 1;
+    sorted_insert(movie->id);
+    title_insert(movie->id);
+}
+
+// Store a movie, on failure the slot and the indexes still hold the previous state
+static int apply_put(const Movie *movie)
+{
+    uint16_t genre_ids[MAX_GENRES];
+    int num_genres;
+
+    if (prepare_put(movie, genre_ids, &num_genres) != 0) return -1;
+    store_put(movie, genre_ids, num_genres);
+    return 0;
+}
+
+static void apply_delete(int id)
+{
+    if (!slot_used(id)) return;
+    title_remove(id);
+    sorted_remove(id);
+    memset(&movies[id], 0, sizeof(MemoryMovie));
+}
+
+static void to_movie(const MemoryMovie *slot, Movie *movie)
+{
+    memset(movie, 0, sizeof(Movie));
+    movie->id = slot->id;
+    movie->version = slot->version;
+    movie->release_year = slot->release_year;
+    memcpy(movie->title, slot->title, sizeof(movie->title));
+    memcpy(movie->director, slot->director, sizeof(movie->director));
+    movie->num_genres = slot->num_genres;
+    for (int i = 0; i < slot->num_genres; i++) {
+        memcpy(movie->genre[i], genre_names[slot->genre_ids[i]], GENRE_NAME_SIZE);
+    }
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_snapshot(void)
+{
+    char tmp_path[sizeof(snapshot_path) + 4];
+    SnapshotHeader header;
+    Movie movie;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return fail("Can't write snapshot: %s", strerror(errno));
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.next_id = next_id;
+    header.catalog_version = catalog_version;
+    for (int id = 1; id < next_id && id < movies_capacity; id++) {
+        if (movies[id].id != 0) header.count++;
+    }
+
+    int rc = write_all(fd, &header, sizeof(header));
+    for (int id = 1; rc == 0 && id < next_id && id < movies_capacity; id++) {
+        if (movies[id].id == 0) continue;
+        to_movie(&movies[id], &movie);
+        rc = write_all(fd, &movie, sizeof(movie));
+    }
+    if (rc == 0) rc = fsync(fd);
+    close(fd);
+
+    // The snapshot replaces the old one atomically, only then the log can start over
+    if (rc != 0 || rename(tmp_path, snapshot_path) != 0) {
+        unlink(tmp_path);
+        return fail("Can't write snapshot: %s", strerror(errno));
+    }
+    if (ftruncate(log_fd, 0) != 0) return fail("Can't truncate log: %s", strerror(errno));
+
+    log_records = 0;
+    return STORAGE_OK;
+}
+
+static uint32_t record_checksum(const LogRecord *record)
+{
+    // Everything after the checksum field
+    const char *start = (const char *)&record->catalog_version;
+    return hash_bytes(start, sizeof(LogRecord) - (start - (const char *)record)) ^ record->op;
+}
+
+// Make an operation durable before it is applied in memory
+static int append_log(uint32_t op, const Movie *movie)
+{
+    LogRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.catalog_version = catalog_version + 1;
+    record.movie = *movie;
+    record.checksum = record_checksum(&record);
+
+    if (write_all(log_fd, &record, sizeof(record)) != 0 || fdatasync(log_fd) != 0) {
+        return fail("Can't append to log: %s", strerror(errno));
+    }
+    log_records++;
+    catalog_version = record.catalog_version;
+    return STORAGE_OK;
+}
+
+// Snapshot once enough operations piled up in the log. A failed snapshot keeps the log as it is.
+static void maybe_snapshot(void)
+{
+    if (log_records >= SNAPSHOT_INTERVAL) write_snapshot();
+}
+
+static int load_snapshot(void)
+{
+    SnapshotHeader header;
+    Movie movie;
+
+    FILE *file = fopen(snapshot_path, "rb");
+    if (file == NULL) return errno == ENOENT ? STORAGE_OK : fail("Can't open snapshot: %s", strerror(errno));
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        fclose(file);
+        return fail("Invalid snapshot %s", snapshot_path);
+    }
+    for (int i = 0; i < header.count; i++) {
+        if (fread(&movie, sizeof(movie), 1, file) != 1 || apply_put(&movie) != 0) {
+            fclose(file);
+            return fail("Invalid snapshot %s", snapshot_path);
+        }
+    }
+    if (header.next_id > next_id) next_id = header.next_id;
+    catalog_version = header.catalog_version;
+
+    fclose(file);
+    return STORAGE_OK;
+}
+
+static int replay_log(void)
+{
+    LogRecord record;
+    off_t good_end = 0;
+    ssize_t n;
+
+    while ((n = pread(log_fd, &record, sizeof(record), good_end)) == sizeof(record)) {
+        if (record.checksum != record_checksum(&record)) break;
+
+        if (record.op == LOG_DELETE) {
+            apply_delete(record.movie.id);
+        } else if (record.op == LOG_CREATE || record.op == LOG_UPDATE) {
+            if (apply_put(&record.movie) != 0) return fail("Can't replay log: %s", "out of memory");
+        } else {
+            break;
+        }
+        catalog_version = record.catalog_version;
+        good_end += sizeof(record);
+        log_records++;
+    }
+
+    // Drop a torn record left by a crash so new records stay aligned
+    if (lseek(log_fd, 0, SEEK_END) != good_end) {
+        fprintf(stderr, "Discarding incomplete record at the end of %s\n", log_path);
+        if (ftruncate(log_fd, good_end) != 0) return fail("Can't truncate log: %s", strerror(errno));
+    }
+    lseek(log_fd, 0, SEEK_END);
+    return STORAGE_OK;
+}
+
+static void memory_free(void)
+{
+    free(movies);
+    free(genre_names);
+    free(title_slots);
+    free(by_year);
+    free(by_title);
+    movies = NULL;
+    genre_names = NULL;
+    title_slots = NULL;
+    by_year = by_title = NULL;
+    num_sorted = sorted_capacity = 0;
+    movies_capacity = genre_names_capacity = num_genre_names = 0;
+    title_capacity = title_used = 0;
+    next_id = 1;
+    catalog_version = 0;
+    log_records = 0;
+}
+
+static void memory_close(void)
+{
+    if (log_fd != -1) {
+        if (log_records > 0) write_snapshot();
+        close(log_fd);
+        log_fd = -1;
+    }
+    memory_free();
+}
+
+static int memory_open(const char *path, bool reset)
+{
+    snprintf(log_path, sizeof(log_path), "%s.log", path);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s.snapshot", path);
+
+    if (reset) {
+        fprintf(stdout, "Initializing in-memory storage...\n");
+        unlink(snapshot_path);
+        unlink(log_path);
+    }
+
+    log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (log_fd == -1) return fail("Can't open log: %s", strerror(errno));
+
+    if (load_snapshot() != STORAGE_OK || replay_log() != STORAGE_OK
+            || (build_sorted() != 0 && fail("Can't sort the catalog: %s", "out of memory"))) {
+        close(log_fd);
+        log_fd = -1;
+        memory_free();
+        return STORAGE_ERROR;
+    }
+
+    fprintf(stdout, "Loaded in-memory storage (%d log records replayed)\n", log_records);
+    maybe_snapshot();
+    return STORAGE_OK;
+}
+
+static int memory_create(Movie *movie)
+{
+    uint16_t genre_ids[MAX_GENRES];
+    int num_genres;
+
+    if (title_lookup(movie->title) != 0) return fail("UNIQUE constraint failed: %s", "Movie.Title");
+
+    movie->id = next_id;
+    movie->version = 1;
+    if (prepare_put(movie, genre_ids, &num_genres) != 0) return fail("Failed to insert movie: %s", "out of memory");
+    if (append_log(LOG_CREATE, movie) != STORAGE_OK) return STORAGE_ERROR;
+    store_put(movie, genre_ids, num_genres);
+
+    maybe_snapshot();
+    return STORAGE_OK;
+}
+
+static int memory_get(int id, Movie *movie)
+{
+    if (!slot_used(id)) return STORAGE_NOT_FOUND;
+    to_movie(&movies[id], movie);
+    return STORAGE_OK;
+}
+
+static int memory_get_many(const int *ids, int num_ids, MovieVisitor visit, void *ctx)
+{
+    Movie movie;
+
+    for (int i = 0; i < num_ids; i++) {
+        if (!slot_used(ids[i])) continue;
+        to_movie(&movies[ids[i]], &movie);
+        if (visit(&movie, ctx) != 0) break;
+    }
+    return STORAGE_OK;
+}
+
+static int memory_update(const Movie *movie, Movie *previous)
+{
+    if (!slot_used(movie->id)) return STORAGE_NOT_FOUND;
+
+    int owner = title_lookup(movie->title);
+    if (owner != 0 && owner != movie->id) return fail("UNIQUE constraint failed: %s", "Movie.Title");
+
+    uint16_t genre_ids[MAX_GENRES];
+    int num_genres;
+    Movie updated = *movie;
+    updated.version = movies[movie->id].version + 1;
+    if (prepare_put(&updated, genre_ids, &num_genres) != 0) return fail("Failed to update movie: %s", "out of memory");
+    if (append_log(LOG_UPDATE, &updated) != STORAGE_OK) return STORAGE_ERROR;
+    if (previous != NULL) to_movie(&movies[movie->id], previous);
+    store_put(&updated, genre_ids, num_genres);
+
+    maybe_snapshot();
+    return STORAGE_OK;
+}
+
+static int memory_remove(int id, Movie *previous)
+{
+    Movie movie;
+
+    if (!slot_used(id)) return STORAGE_NOT_FOUND;
+
+    memset(&movie, 0, sizeof(movie));
+    movie.id = id;
+    if (append_log(LOG_DELETE, &movie) != STORAGE_OK) return STORAGE_ERROR;
+    if (previous != NULL) to_movie(&movies[id], previous);
+    apply_delete(id);
+
+    maybe_snapshot();
+    return STORAGE_OK;
+}
+
+static int memory_version(int id, int *version)
+{
+    if (!slot_used(id)) return STORAGE_NOT_FOUND;
+    *version = movies[id].version;
+    return STORAGE_OK;
+}
+
+static long long memory_catalog_version(void)
+{
+    return catalog_version;
+}
+
+static int memory_scan(bool detail, MovieVisitor visit, void *ctx)
+{
+    Movie movie;
+
+    for (int id = 1; id < next_id && id < movies_capacity; id++) {
+        if (movies[id].id == 0) continue;
+        if (detail) {
+            to_movie(&movies[id], &movie);
+        } else {
+            // Summaries only carry the id and title, the genre names are not copied
+            memset(&movie, 0, sizeof(Movie));
+            movie.id = id;
+            memcpy(movie.title, movies[id].title, sizeof(movie.title));
+        }
+        if (visit(&movie, ctx) != 0) break;
+    }
+    return STORAGE_OK;
+}
+
+// Count the words of text starting with (or equal to) term, ignoring case
+static int count_word_matches(const char *text, const char *term, size_t term_len, bool prefix)
+{
+    int matches = 0;
+
+    while (*text != '\0') {
+        while (*text != '\0' && !isalnum((unsigned char)*text)) text++;
+        const char *word = text;
+        while (isalnum((unsigned char)*text)) text++;
+
+        size_t word_len = text - word;
+        if (word_len >= term_len && strncasecmp(word, term, term_len) == 0 && (prefix || word_len == term_len)) {
+            matches++;
+        }
+    }
+    return matches;
+}
+
+typedef struct {
+    int id;
+    int score;
+} SearchHit;
+
+static int compare_hits(const void *a, const void *b)
+{
+    const SearchHit *ha = a, *hb = b;
+    if (ha->score != hb->score) return hb->score - ha->score;
+    return ha->id - hb->id;
+}
+
+// Every word of the query must match in the title or the director, title matches rank higher
+static int memory_search(const char *query, bool prefix, int limit, MovieVisitor visit, void *ctx)
+{
+    SearchHit *hits = NULL;
+    int num_hits = 0, hits_capacity = 0;
+    Movie movie;
+
+    for (int id = 1; id < next_id && id < movies_capacity; id++) {
+        if (movies[id].id == 0) continue;
+
+        int score = 0;
+        bool all_terms = true;
+        for (const char *q = query; *q != '\0' && all_terms; ) {
+            while (*q != '\0' && !isalnum((unsigned char)*q)) q++;
+            const char *term = q;
+            while (isalnum((unsigned char)*q)) q++;
+            if (q == term) break;
+
+            int title_matches = count_word_matches(movies[id].title, term, q - term, prefix);
+            int director_matches = count_word_matches(movies[id].director, term, q - term, prefix);
+            all_terms = title_matches + director_matches > 0;
+            score += 10 * title_matches + director_matches;
+        }
+        if (!all_terms || score == 0) continue;
+
+        if (num_hits == hits_capacity) {
+            hits_capacity = hits_capacity ? hits_capacity * 2 : 64;
+            SearchHit *grown = realloc(hits, hits_capacity * sizeof(SearchHit));
+            if (grown == NULL) {
+                free(hits);
+                return fail("Search failed: %s", "out of memory");
+            }
+            hits = grown;
+        }
+        hits[num_hits].id = id;
+        hits[num_hits].score = score;
+        num_hits++;
+    }
+
+    qsort(hits, num_hits, sizeof(SearchHit), compare_hits);
+    for (int i = 0; i < num_hits && i < limit; i++) {
+        to_movie(&movies[hits[i].id], &movie);
+        if (visit(&movie, ctx) != 0) break;
+    }
+
+    free(hits);
+    return STORAGE_OK;
+}
+
+static bool has_genre(const MemoryMovie *slot, int genre)
+{
+    for (int i = 0; i < slot->num_genres; i++) {
+        if (slot->genre_ids[i] == genre) return true;
+    }
+    return false;
+}
+
+// Release years of the query come from by_year. Sorted by year they are visited as they are,
+// otherwise either the other order is walked until the limit is met, when the range holds most
+// of the catalog, or the range is collected and sorted.
+static int memory_query(const MovieQuery *query, MovieVisitor visit, void *ctx)
+{
+    int genre = -1;
+    int visited = 0;
+    Movie movie;
+
+    if (query->genre[0] != '\0') {
+        for (int i = 0; i < num_genre_names && genre < 0; i++) {
+            if (strcmp(genre_names[i], query->genre) == 0) genre = i;
+        }
+        if (genre < 0) return STORAGE_OK;
+    }
+
+    // [first, last) of the year range in by_year
+    int lo = 0, hi = num_sorted;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (movies[by_year[mid]].release_year < query->year_from) lo = mid + 1;
+        else hi = mid;
+    }
+    int first = lo;
+    hi = num_sorted;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (movies[by_year[mid]].release_year <= query->year_to) lo = mid + 1;
+        else hi = mid;
+    }
+    int last = lo;
+    int in_range = last - first;
+    if (in_range == 0 || query->limit == 0) return STORAGE_OK;
+
+    const int *order = by_year + first;
+    int num_order = in_range;
+    int *collected = NULL;
+
+    // Walking the whole order reads about limit * catalog / range movies before the limit is met,
+    // collecting sorts the range
+    bool walk = query->limit > 0 && (long long)query->limit * num_sorted < (long long)in_range * in_range;
+    if (query->sort == SORT_TITLE && walk) {
+        order = by_title;
+        num_order = num_sorted;
+    } else if (query->sort != SORT_YEAR && !(query->sort == SORT_ID && walk)) {
+        collected = malloc(in_range * sizeof(int));
+        if (collected == NULL) return fail("Query failed: %s", "out of memory");
+        memcpy(collected, by_year + first, in_range * sizeof(int));
+        qsort(collected, in_range, sizeof(int), query->sort == SORT_TITLE ? qsort_title : qsort_id);
+        order = collected;
+    }
+
+    if (query->sort == SORT_ID && walk) {
+        // The slots are the ID order
+        for (int id = 1; id < next_id && id < movies_capacity; id++) {
+            const MemoryMovie *slot = &movies[id];
+            if (slot->id == 0 || slot->release_year < query->year_from || slot->release_year > query->year_to) continue;
+            if (genre >= 0 && !has_genre(slot, genre)) continue;
+            to_movie(slot, &movie);
+            if (visit(&movie, ctx) != 0 || ++visited == query->limit) break;
+        }
+        return STORAGE_OK;
+    }
+
+    for (int i = 0; i < num_order; i++) {
+        const MemoryMovie *slot = &movies[order[i]];
+        if (slot->release_year < query->year_from || slot->release_year > query->year_to) continue;
+        if (genre >= 0 && !has_genre(slot, genre)) continue;
+        to_movie(slot, &movie);
+        if (visit(&movie, ctx) != 0 || ++visited == query->limit) break;
+    }
+
+    free(collected);
+    return STORAGE_OK;
+}
+
+static const char *memory_errmsg(void)
+{
+    return last_error;
+}
+
+const Storage memory_storage = {
+    .name = "memory",
+    .open = memory_open,
+    .close = memory_close,
+    .create = memory_create,
+    .get = memory_get,
+    .get_many = memory_get_many,
+    .update = memory_update,
+    .remove = memory_remove,
+    .version = memory_version,
+    .catalog_version = memory_catalog_version,
+    .scan = memory_scan,
+    .search = memory_search,
+    .query = memory_query,
+    .errmsg = memory_errmsg,
+};
@@ -0,0 +1,1314 @@
+/*
+** storage_sharded.c -- SQLite storage backend spread over several database files
+**
+** Movies are partitioned by ID over N shards, <path>.shard0 to <path>.shard<N-1>,
+** each with its own connection, journal and lock. The movie with ID i lives in
+** shard (i - 1) mod N. Genre names are kept once, in the dictionary at <path>,
+** and the shards refer to them by ID. The dictionary also keeps the titles,
+** which are unique over the whole catalog. Point reads go to the owning shard
+** only. Scans, searches and listings run on every shard at once, one thread
+** per shard reading ahead, and their rows are merged in order. Writes come in
+** batches: the dictionary claims their titles and genres, then the thread of
+** every shard stores the writes of the shard in one transaction.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#include "storage.h"
+#include "sqlite_profile.h"
+#include "sqlite_rows.h"
+
+#define DEFAULT_SHARDS 4
+#define FANOUT_ROWS 64  // rows a shard reads ahead of the merge
+#define FANOUT_BATCH 16 // rows handed over to the merge at once, fewer wakeups than one at a time
+#define BATCH_CHUNK 256 // IDs looked up by one run of the batch statement on a shard
+
+// Statements prepared on every shard
+enum {
+    INSERT_MOVIE,
+    UPDATE_MOVIE,
+    DELETE_MOVIE,
+    SELECT_MOVIE,
+    SELECT_MOVIES,
+    INSERT_MOVIE_GENRE,
+    SELECT_MOVIE_GENRE_IDS,
+    DELETE_MOVIE_GENRE,
+    SCAN,
+    SCAN_DETAIL,
+    SEARCH,
+    SELECT_VERSION,
+    BUMP_CATALOG,
+    SELECT_CATALOG,
+    QUERY,                              // [genre filter][MovieSort] from here
+    NUM_SHARD_STATEMENTS = QUERY + 6,
+};
+
+#define QUERY_STMT(by_genre, sort) (QUERY + (by_genre) * 3 + (sort))
+
+static const char *shard_sql[NUM_SHARD_STATEMENTS] = {
+    // IDs are handed out by the backend, the shard of an ID is known before it is stored
+    [INSERT_MOVIE] = "INSERT INTO Movie (ID, Title, Director, ReleaseYear, Genres) VALUES (?, ?, ?, ?, ?);",
+    [UPDATE_MOVIE] = "UPDATE Movie SET Title = ?, Director = ?, ReleaseYear = ?, Genres = ?, Version = Version + 1 WHERE ID = ?;",
+    [DELETE_MOVIE] = "DELETE FROM Movie WHERE ID = ?;",
+    [SELECT_MOVIE] = "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie WHERE ID = ?;",
+    [SELECT_MOVIES] =
+        "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie "\
+        "WHERE ID IN (SELECT value FROM json_each(?));",
+    [INSERT_MOVIE_GENRE] = "INSERT OR IGNORE INTO Movie_Genre (MovieID, GenreID) VALUES (?, ?);",
+    [SELECT_MOVIE_GENRE_IDS] = "SELECT GenreID FROM Movie_Genre WHERE MovieID = ?;",
+    [DELETE_MOVIE_GENRE] = "DELETE FROM Movie_Genre WHERE MovieID = ? AND GenreID = ?;",
+    [SCAN] = "SELECT ID, Title FROM Movie ORDER BY ID;",
+    [SCAN_DETAIL] = "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie ORDER BY ID;",
+    // Ranks of different shards are merged as they are, each shard weighs the words by its own movies
+    [SEARCH] =
+        "SELECT m.ID, m.Title, m.Director, m.ReleaseYear, m.Genres, m.Version, bm25(Movie_Search, 10.0, 1.0) AS Rank "\
+        "FROM Movie_Search "\
+        "JOIN Movie m ON m.ID = Movie_Search.rowid "\
+        "WHERE Movie_Search MATCH ? "\
+        "ORDER BY Rank "\
+        "LIMIT ?;",
+    [SELECT_VERSION] = "SELECT Version FROM Movie WHERE ID = ?;",
+    // ?1 is the next ID of the shard after the creates of a batch, 0 without any, ?2 the number of writes
+    [BUMP_CATALOG] = "UPDATE Catalog SET Version = Version + ?2, NextID = max(NextID, ?1) WHERE ID = 1;",
+    [SELECT_CATALOG] = "SELECT Version, NextID FROM Catalog WHERE ID = 1;",
+    // ?1 and ?2 are the years, ?3 the limit and ?4 the genre ID from the dictionary
+    [QUERY_STMT(0, SORT_ID)] =
+        "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie "\
+        "WHERE ReleaseYear BETWEEN ?1 AND ?2 ORDER BY ID LIMIT ?3;",
+    [QUERY_STMT(0, SORT_YEAR)] =
+        "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie "\
+        "WHERE ReleaseYear BETWEEN ?1 AND ?2 ORDER BY ReleaseYear, ID LIMIT ?3;",
+    [QUERY_STMT(0, SORT_TITLE)] =
+        "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie "\
+        "WHERE ReleaseYear BETWEEN ?1 AND ?2 ORDER BY Title LIMIT ?3;",
+    [QUERY_STMT(1, SORT_ID)] =
+        "SELECT m.ID, m.Title, m.Director, m.ReleaseYear, m.Genres, m.Version "\
+        "FROM Movie_Genre mg JOIN Movie m ON m.ID = mg.MovieID "\
+        "WHERE mg.GenreID = ?4 AND m.ReleaseYear BETWEEN ?1 AND ?2 "\
+        "ORDER BY mg.MovieID LIMIT ?3;",
+    [QUERY_STMT(1, SORT_YEAR)] =
+        "SELECT m.ID, m.Title, m.Director, m.ReleaseYear, m.Genres, m.Version "\
+        "FROM Movie_Genre mg JOIN Movie m ON m.ID = mg.MovieID "\
+        "WHERE mg.GenreID = ?4 AND m.ReleaseYear BETWEEN ?1 AND ?2 "\
+        "ORDER BY m.ReleaseYear, m.ID LIMIT ?3;",
+    [QUERY_STMT(1, SORT_TITLE)] =
+        "SELECT m.ID, m.Title, m.Director, m.ReleaseYear, m.Genres, m.Version "\
+        "FROM Movie_Genre mg JOIN Movie m ON m.ID = mg.MovieID "\
+        "WHERE mg.GenreID = ?4 AND m.ReleaseYear BETWEEN ?1 AND ?2 "\
+        "ORDER BY m.Title LIMIT ?3;",
+};
+
+static const char *shard_drop_sql =
+    "DROP TABLE IF EXISTS Movie;"\
+    "DROP TABLE IF EXISTS Movie_Genre;"\
+    "DROP TABLE IF EXISTS Movie_Search;"\
+    "DROP TABLE IF EXISTS Catalog;";
+
+static const char *shard_schema_sql =
+    "CREATE TABLE IF NOT EXISTS Movie("  \
+        "ID INTEGER PRIMARY KEY," \
+        "Title          TEXT    NOT NULL UNIQUE," \
+        "Director       TEXT    NOT NULL, " \
+        "ReleaseYear    INT     NOT NULL," \
+        "Version        INT     NOT NULL DEFAULT 1," \
+        "Genres         BLOB);"
+    /* GenreID is the ID of the genre in the dictionary */
+    "CREATE TABLE IF NOT EXISTS Movie_Genre("\
+        "MovieID INTEGER NOT NULL REFERENCES Movie(ID) ON DELETE CASCADE,"\
+        "GenreID INTEGER NOT NULL,"\
+        "PRIMARY KEY (MovieID, GenreID));"
+    "CREATE INDEX IF NOT EXISTS Movie_Year ON Movie(ReleaseYear);"
+    "CREATE INDEX IF NOT EXISTS Movie_Genre_Genre ON Movie_Genre(GenreID, MovieID);"
+    /* Writes to the shard and the ID of its next movie, 0 before its first one. The catalog
+       version is the sum of the versions of the shards. */
+    "CREATE TABLE IF NOT EXISTS Catalog("\
+        "ID      INTEGER PRIMARY KEY CHECK (ID = 1),"\
+        "Version INT     NOT NULL,"\
+        "NextID  INT     NOT NULL);"
+    "INSERT OR IGNORE INTO Catalog (ID, Version, NextID) VALUES (1, 0, 0);"
+    MOVIE_SEARCH_SCHEMA;
+
+static const char *dictionary_drop_sql =
+    "DROP TABLE IF EXISTS Genre;"\
+    "DROP TABLE IF EXISTS Title;"\
+    "DROP TABLE IF EXISTS Pending;"\
+    "DROP TABLE IF EXISTS Shards;";
+
+static const char *dictionary_schema_sql =
+    "CREATE TABLE IF NOT EXISTS Genre(" \
+        "ID   INTEGER    PRIMARY KEY AUTOINCREMENT,"
+        "Name TEXT                 NOT NULL UNIQUE);"
+    /* Titles are unique over the whole catalog, a shard only holds the constraint for its own movies */
+    "CREATE TABLE IF NOT EXISTS Title("\
+        "MovieID INTEGER PRIMARY KEY,"\
+        "Title   TEXT    NOT NULL UNIQUE);"
+    /* Movies whose title the last batch changed. The dictionary commits before the shards do, these
+       are checked against their shard when a shard may have failed to commit. */
+    "CREATE TABLE IF NOT EXISTS Pending("\
+        "MovieID INTEGER PRIMARY KEY);"
+    /* Number of shards the catalog was made with, its movies are where it puts them */
+    "CREATE TABLE IF NOT EXISTS Shards("\
+        "ID    INTEGER PRIMARY KEY CHECK (ID = 1),"\
+        "Count INT     NOT NULL);";
+
+// A row read ahead by a shard, rank is only set by searches
+typedef struct {
+    Movie movie;
+    double rank;
+} FanoutRow;
+
+typedef struct Shard Shard;
+
+// A write of a batch with what the dictionary said about it
+typedef struct {
+    StorageWrite *write;
+    Shard *shard;                   // shard running the write, NULL when it was turned down
+    int genre_ids[MAX_GENRES];      // distinct dictionary IDs of the genres of the movie
+    int num_genre_ids;
+    bool frees_title;               // freed_title is the title an update or remove gave up
+    char freed_title[TITLE_SIZE];
+} ShardWrite;
+
+struct Shard {
+    sqlite3 *db;
+    sqlite3_stmt *stmts[NUM_SHARD_STATEMENTS];
+    long long version;  // Catalog.Version of the shard
+    int next_id;        // ID of the next movie created on the shard
+
+    // The worker steps the statement handed over by a fan-out and queues its rows for the merge,
+    // or runs the writes of a batch that go to the shard
+    pthread_t worker;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // a statement or writes to run, room for more rows or stopping
+    pthread_cond_t ready;       // rows to merge or the job is done with
+    sqlite3_stmt *job;          // bound statement to run, NULL when idle
+    ShardWrite *batch;          // writes of a batch, those of this shard are run. NULL when idle.
+    int batch_size;
+    bool detail;                // rows are read whole, else only ID and title
+    bool cancelled, finished, failed, stopping;
+    char error[256];
+    FanoutRow rows[FANOUT_ROWS]; // ring of rows read ahead, count of them from head
+    int head, count;
+};
+
+typedef int (*RowOrder)(const FanoutRow *a, const FanoutRow *b);
+
+static sqlite3 *dictionary = NULL;
+static sqlite3_stmt *select_genre_stmt;
+static sqlite3_stmt *insert_genre_stmt;
+static sqlite3_stmt *select_shards_stmt;
+static sqlite3_stmt *insert_shards_stmt;
+static sqlite3_stmt *select_title_stmt;
+static sqlite3_stmt *insert_title_stmt;
+static sqlite3_stmt *rename_title_stmt;
+static sqlite3_stmt *delete_title_stmt;
+static sqlite3_stmt *replace_title_stmt;
+static sqlite3_stmt *any_title_stmt;
+static sqlite3_stmt *insert_pending_stmt;
+static sqlite3_stmt *select_pending_stmt;
+
+static const struct {
+    sqlite3_stmt **stmt;
+    const char *sql;
+} dictionary_statements[] = {
+    { &select_genre_stmt, "SELECT ID FROM Genre WHERE Name = ?;" },
+    { &insert_genre_stmt, "INSERT INTO Genre (Name) VALUES (?);" },
+    { &select_shards_stmt, "SELECT Count FROM Shards WHERE ID = 1;" },
+    { &insert_shards_stmt, "INSERT INTO Shards (ID, Count) VALUES (1, ?);" },
+    { &select_title_stmt, "SELECT Title FROM Title WHERE MovieID = ?;" },
+    { &insert_title_stmt, "INSERT INTO Title (MovieID, Title) VALUES (?, ?);" },
+    { &rename_title_stmt, "UPDATE Title SET Title = ? WHERE MovieID = ?;" },
+    { &delete_title_stmt, "DELETE FROM Title WHERE MovieID = ?;" },
+    // The shard has the last word on the title of a movie
+    { &replace_title_stmt, "INSERT OR REPLACE INTO Title (MovieID, Title) VALUES (?, ?);" },
+    { &any_title_stmt, "SELECT 1 FROM Title LIMIT 1;" },
+    { &insert_pending_stmt, "INSERT OR IGNORE INTO Pending (MovieID) VALUES (?);" },
+    { &select_pending_stmt, "SELECT MovieID FROM Pending;" },
+};
+
+#define NUM_DICTIONARY_STATEMENTS (sizeof(dictionary_statements) / sizeof(dictionary_statements[0]))
+
+static Shard *shards = NULL;
+static int num_shards = 0;
+static int new_catalog_shards = DEFAULT_SHARDS;
+static char last_error[256];
+static long long catalog_version = 0; // sum of the shard versions, this process is the only writer
+static bool unsettled = false;        // a write of the last batch failed after the dictionary committed
+
+// Remember the current SQLite error of a connection, it would be lost by a following ROLLBACK
+static int fail(sqlite3 *db, const char *what)
+{
+    snprintf(last_error, sizeof(last_error), "%s", sqlite3_errmsg(db));
+    fprintf(stderr, "%s: %s\n", what, last_error);
+    return STORAGE_ERROR;
+}
+
+static int exec(sqlite3 *db, const char *sql)
+{
+    char *zErrMsg = 0;
+    if (sqlite3_exec(db, sql, NULL, NULL, &zErrMsg) != SQLITE_OK) {
+        snprintf(last_error, sizeof(last_error), "%s", zErrMsg ? zErrMsg : sqlite3_errmsg(db));
+        fprintf(stderr, "SQL error: %s\n", last_error);
+        sqlite3_free(zErrMsg);
+        return STORAGE_ERROR;
+    }
+    return STORAGE_OK;
+}
+
+// Run a statement that returns no rows and make it ready for the next use
+static int step_once(sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
+}
+
+// Shard holding the movie with this ID, NULL for an ID no movie can have
+static Shard *shard_of(int id)
+{
+    return id >= 1 ? &shards[(id - 1) % num_shards] : NULL;
+}
+
+// Find the ID of a genre in the dictionary
+static int find_genre(const char *name, int *id)
+{
+    sqlite3_bind_text(select_genre_stmt, 1, name, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(select_genre_stmt);
+    if (rc == SQLITE_ROW) {
+        *id = sqlite3_column_int(select_genre_stmt, 0);
+    }
+    sqlite3_reset(select_genre_stmt);
+    sqlite3_clear_bindings(select_genre_stmt);
+
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    return rc == SQLITE_DONE ? STORAGE_NOT_FOUND : fail(dictionary, "Failed to query genre");
+}
+
+// Find the ID of a genre, adding it to the dictionary when it is new. A genre added for a write
+// that fails later stays, unused.
+static int genre_id(const char *name, int *id)
+{
+    int rc = find_genre(name, id);
+    if (rc != STORAGE_NOT_FOUND) return rc;
+
+    sqlite3_bind_text(insert_genre_stmt, 1, name, -1, SQLITE_STATIC);
+    if (step_once(insert_genre_stmt) != SQLITE_DONE) return fail(dictionary, "Failed to insert genre");
+
+    *id = (int)sqlite3_last_insert_rowid(dictionary);
+    return STORAGE_OK;
+}
+
+static bool contains_id(const int *ids, int num_ids, int id)
+{
+    for (int i = 0; i < num_ids; i++) {
+        if (ids[i] == id) return true;
+    }
+    return false;
+}
+
+// Remember why a write of a batch failed. Shards run their writes at once, each write keeps its own error.
+static int write_failed(StorageWrite *write, sqlite3 *db, const char *what)
+{
+    snprintf(write->error, sizeof(write->error), "%s", sqlite3_errmsg(db));
+    fprintf(stderr, "%s: %s\n", what, write->error);
+    return STORAGE_ERROR;
+}
+
+// Read a movie of a shard, returns the result of the step: SQLITE_ROW when it exists
+static int read_shard_movie(Shard *shard, int id, Movie *movie)
+{
+    sqlite3_stmt *stmt = shard->stmts[SELECT_MOVIE];
+    sqlite3_bind_int(stmt, 1, id);
+
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) read_movie(stmt, movie);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
+}
+
+// Bring the Movie_Genre rows of a movie in line with its genres, only the ones that changed
+// are written. A new movie has none yet.
+static int store_genres(Shard *shard, const ShardWrite *w)
+{
+    sqlite3_stmt *select_ids = shard->stmts[SELECT_MOVIE_GENRE_IDS];
+    int movie_id = w->write->movie.id;
+    int old_ids[MAX_GENRES];
+    int num_old = 0;
+    int rc;
+
+    // At most MAX_GENRES rows, one per distinct genre
+    sqlite3_bind_int(select_ids, 1, movie_id);
+    while ((rc = sqlite3_step(select_ids)) == SQLITE_ROW && num_old < MAX_GENRES) {
+        old_ids[num_old++] = sqlite3_column_int(select_ids, 0);
+    }
+    sqlite3_reset(select_ids);
+    sqlite3_clear_bindings(select_ids);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) return write_failed(w->write, shard->db, "Failed to read movie genres");
+
+    for (int i = 0; i < num_old; i++) {
+        if (contains_id(w->genre_ids, w->num_genre_ids, old_ids[i])) continue;
+        sqlite3_bind_int(shard->stmts[DELETE_MOVIE_GENRE], 1, movie_id);
+        sqlite3_bind_int(shard->stmts[DELETE_MOVIE_GENRE], 2, old_ids[i]);
+        if (step_once(shard->stmts[DELETE_MOVIE_GENRE]) != SQLITE_DONE) {
+            return write_failed(w->write, shard->db, "Failed to delete movie genre");
+        }
+    }
+    for (int i = 0; i < w->num_genre_ids; i++) {
+        if (contains_id(old_ids, num_old, w->genre_ids[i])) continue;
+        sqlite3_bind_int(shard->stmts[INSERT_MOVIE_GENRE], 1, movie_id);
+        sqlite3_bind_int(shard->stmts[INSERT_MOVIE_GENRE], 2, w->genre_ids[i]);
+        if (step_once(shard->stmts[INSERT_MOVIE_GENRE]) != SQLITE_DONE) {
+            return write_failed(w->write, shard->db, "Failed to insert into Movie_Genre");
+        }
+    }
+    return STORAGE_OK;
+}
+
+// Run a write in the transaction of its shard, on the worker of the shard
+static int apply_write(Shard *shard, const ShardWrite *w)
+{
+    StorageWrite *write = w->write;
+    Movie *movie = &write->movie;
+    unsigned char genres[GENRES_BLOB_SIZE];
+    sqlite3_stmt *stmt;
+
+    // Every write of the movie runs on this shard, the row read is the one replaced
+    if (write->type != WRITE_CREATE) {
+        int rc = read_shard_movie(shard, movie->id, &write->previous);
+        if (rc == SQLITE_DONE) return STORAGE_NOT_FOUND;
+        if (rc != SQLITE_ROW) return write_failed(write, shard->db, "Failed to read movie");
+    }
+
+    switch (write->type) {
+    case WRITE_CREATE:
+        stmt = shard->stmts[INSERT_MOVIE];
+        sqlite3_bind_int(stmt, 1, movie->id);
+        sqlite3_bind_text(stmt, 2, movie->title, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, movie->director, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 4, movie->release_year);
+        sqlite3_bind_blob(stmt, 5, genres, encode_genres(movie, genres), SQLITE_STATIC);
+        if (step_once(stmt) != SQLITE_DONE) return write_failed(write, shard->db, "Failed to insert movie");
+        break;
+    case WRITE_UPDATE:
+        stmt = shard->stmts[UPDATE_MOVIE];
+        sqlite3_bind_text(stmt, 1, movie->title, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, movie->director, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 3, movie->release_year);
+        sqlite3_bind_blob(stmt, 4, genres, encode_genres(movie, genres), SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 5, movie->id);
+        if (step_once(stmt) != SQLITE_DONE) return write_failed(write, shard->db, "Failed to update movie");
+        movie->version = write->previous.version + 1;
+        break;
+    case WRITE_REMOVE:
+        // Its Movie_Genre rows go with it
+        sqlite3_bind_int(shard->stmts[DELETE_MOVIE], 1, movie->id);
+        if (step_once(shard->stmts[DELETE_MOVIE]) != SQLITE_DONE) return write_failed(write, shard->db, "Failed to delete movie");
+        return STORAGE_OK;
+    }
+    return store_genres(shard, w);
+}
+
+// Fail the writes of a shard that were to be stored, their transaction is rolled back
+static void fail_shard_writes(Shard *shard, ShardWrite *batch, int batch_size, const char *what)
+{
+    for (int i = 0; i < batch_size; i++) {
+        if (batch[i].shard == shard && batch[i].write->status == STORAGE_OK) {
+            batch[i].write->status = write_failed(batch[i].write, shard->db, what);
+        }
+    }
+}
+
+// Run the writes of a batch that go to this shard in one transaction, each in a savepoint of its own
+// so that a failed write leaves the others. Runs on the worker of the shard.
+static void run_shard_writes(Shard *shard, ShardWrite *batch, int batch_size)
+{
+    int done = 0, next_id = 0;
+    bool lost = false;
+
+    if (sqlite3_exec(shard->db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+        fail_shard_writes(shard, batch, batch_size, "Failed to start writes");
+        return;
+    }
+    for (int i = 0; i < batch_size && !lost; i++) {
+        StorageWrite *write = batch[i].write;
+        if (batch[i].shard != shard) continue;
+
+        if (sqlite3_exec(shard->db, "SAVEPOINT write;", NULL, NULL, NULL) != SQLITE_OK) {
+            lost = true;
+            break;
+        }
+        write->status = apply_write(shard, &batch[i]);
+        // An error like a full disk may have rolled the whole transaction back
+        if (write->status != STORAGE_OK && sqlite3_exec(shard->db, "ROLLBACK TO write;", NULL, NULL, NULL) != SQLITE_OK) {
+            lost = true;
+        } else if (sqlite3_exec(shard->db, "RELEASE write;", NULL, NULL, NULL) != SQLITE_OK) {
+            lost = true;
+        }
+    }
+    if (lost) {
+        fail_shard_writes(shard, batch, batch_size, "Failed to write to shard");
+        sqlite3_exec(shard->db, "ROLLBACK;", NULL, NULL, NULL);
+        return;
+    }
+
+    for (int i = 0; i < batch_size; i++) {
+        StorageWrite *write = batch[i].write;
+        if (batch[i].shard != shard || write->status != STORAGE_OK) continue;
+        done++;
+        if (write->type == WRITE_CREATE && write->movie.id + num_shards > next_id) next_id = write->movie.id + num_shards;
+    }
+    if (done == 0) {
+        sqlite3_exec(shard->db, "ROLLBACK;", NULL, NULL, NULL);
+        return;
+    }
+
+    // One commit for every write of the batch
+    sqlite3_bind_int(shard->stmts[BUMP_CATALOG], 1, next_id);
+    sqlite3_bind_int(shard->stmts[BUMP_CATALOG], 2, done);
+    if (step_once(shard->stmts[BUMP_CATALOG]) != SQLITE_DONE || sqlite3_exec(shard->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        fail_shard_writes(shard, batch, batch_size, "Failed to commit writes");
+        sqlite3_exec(shard->db, "ROLLBACK;", NULL, NULL, NULL);
+        return;
+    }
+    shard->version += done;
+    if (next_id > shard->next_id) shard->next_id = next_id;
+}
+
+// A title is taken, with the message the SQLite backend gives
+static int title_taken(void)
+{
+    snprintf(last_error, sizeof(last_error), "UNIQUE constraint failed: Movie.Title");
+    fprintf(stderr, "Failed to write movie: %s\n", last_error);
+    return STORAGE_ERROR;
+}
+
+// Run a bound statement writing the Title table, STORAGE_NOT_FOUND when it changed no row
+static int write_title(sqlite3_stmt *stmt)
+{
+    int rc = step_once(stmt);
+    if (rc == SQLITE_CONSTRAINT) return title_taken();
+    if (rc != SQLITE_DONE) return fail(dictionary, "Failed to write title");
+    return sqlite3_changes(dictionary) > 0 ? STORAGE_OK : STORAGE_NOT_FOUND;
+}
+
+// Find the title of a movie in the dictionary
+static int find_title(int id, char *title)
+{
+    sqlite3_bind_int(select_title_stmt, 1, id);
+    int rc = sqlite3_step(select_title_stmt);
+    if (rc == SQLITE_ROW) column_string(select_title_stmt, 0, title, TITLE_SIZE);
+    sqlite3_reset(select_title_stmt);
+    sqlite3_clear_bindings(select_title_stmt);
+
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    return rc == SQLITE_DONE ? STORAGE_NOT_FOUND : fail(dictionary, "Failed to look up title");
+}
+
+// Give the dictionary the title the shard of a movie has, or none when the shard does not have it
+static int settle_title(int id)
+{
+    Movie movie;
+    Shard *shard = shard_of(id);
+    sqlite3_stmt *stmt;
+
+    int rc = read_shard_movie(shard, id, &movie);
+    if (rc == SQLITE_ROW) {
+        stmt = replace_title_stmt;
+        sqlite3_bind_int(stmt, 1, id);
+        sqlite3_bind_text(stmt, 2, movie.title, -1, SQLITE_TRANSIENT);
+    } else if (rc == SQLITE_DONE) {
+        stmt = delete_title_stmt;
+        sqlite3_bind_int(stmt, 1, id);
+    } else {
+        return fail(shard->db, "Failed to read movie");
+    }
+    if (step_once(stmt) != SQLITE_DONE) return fail(dictionary, "Failed to settle title");
+    return STORAGE_OK;
+}
+
+// Check the titles the last batch changed against the shards, in the current dictionary transaction
+static int settle_pending(void)
+{
+    int rc;
+
+    while ((rc = sqlite3_step(select_pending_stmt)) == SQLITE_ROW) {
+        if (settle_title(sqlite3_column_int(select_pending_stmt, 0)) != STORAGE_OK) break;
+    }
+    sqlite3_reset(select_pending_stmt);
+    if (rc == SQLITE_ROW) return STORAGE_ERROR;
+    if (rc != SQLITE_DONE) return fail(dictionary, "Failed to read pending movies");
+    return exec(dictionary, "DELETE FROM Pending;");
+}
+
+// A catalog made before the dictionary kept the titles has them in its shards only
+static int fill_titles(void)
+{
+    int rc = sqlite3_step(any_title_stmt);
+    sqlite3_reset(any_title_stmt);
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    if (rc != SQLITE_DONE) return fail(dictionary, "Failed to read titles");
+
+    for (int k = 0; k < num_shards; k++) {
+        sqlite3_stmt *scan = shards[k].stmts[SCAN];
+
+        while ((rc = sqlite3_step(scan)) == SQLITE_ROW) {
+            sqlite3_bind_int(replace_title_stmt, 1, sqlite3_column_int(scan, 0));
+            sqlite3_bind_text(replace_title_stmt, 2, (const char *)sqlite3_column_text(scan, 1), -1, SQLITE_TRANSIENT);
+            if (step_once(replace_title_stmt) != SQLITE_DONE) break;
+        }
+        sqlite3_reset(scan);
+        if (rc == SQLITE_ROW) return fail(dictionary, "Failed to fill titles");
+        if (rc != SQLITE_DONE) return fail(shards[k].db, "Failed to read titles");
+    }
+    return STORAGE_OK;
+}
+
+// Note a movie whose title the batch changes. The batch before is settled by now, only this one is kept.
+static int add_pending(int id, bool *cleared)
+{
+    if (!*cleared) {
+        if (exec(dictionary, "DELETE FROM Pending;") != STORAGE_OK) return STORAGE_ERROR;
+        *cleared = true;
+    }
+    sqlite3_bind_int(insert_pending_stmt, 1, id);
+    if (step_once(insert_pending_stmt) != SQLITE_DONE) return fail(dictionary, "Failed to note pending movie");
+    return STORAGE_OK;
+}
+
+// Read a row of a fan-out statement, searches add the rank after the movie
+static void read_row(sqlite3_stmt *stmt, bool detail, FanoutRow *row)
+{
+    if (detail) {
+        read_movie(stmt, &row->movie);
+    } else {
+        memset(&row->movie, 0, sizeof(Movie));
+        row->movie.id = sqlite3_column_int(stmt, 0);
+        column_string(stmt, 1, row->movie.title, sizeof(row->movie.title));
+    }
+    row->rank = sqlite3_column_count(stmt) > 6 ? sqlite3_column_double(stmt, 6) : 0;
+}
+
+static void *shard_worker(void *arg)
+{
+    Shard *shard = arg;
+
+    pthread_mutex_lock(&shard->lock);
+    for (;;) {
+        while (shard->job == NULL && shard->batch == NULL && !shard->stopping) pthread_cond_wait(&shard->work, &shard->lock);
+        if (shard->stopping) break;
+
+        if (shard->batch != NULL) {
+            ShardWrite *batch = shard->batch;
+            int batch_size = shard->batch_size;
+
+            pthread_mutex_unlock(&shard->lock);
+            run_shard_writes(shard, batch, batch_size);
+            pthread_mutex_lock(&shard->lock);
+            shard->batch = NULL;
+            shard->finished = true;
+            pthread_cond_signal(&shard->ready);
+            continue;
+        }
+
+        sqlite3_stmt *stmt = shard->job;
+        int pending = 0;    // rows read after the ones handed over
+        int rc;
+
+        // Rows are read without the lock, the merge takes the ones before them meanwhile
+        for (;;) {
+            pthread_mutex_unlock(&shard->lock);
+            rc = sqlite3_step(stmt);
+            pthread_mutex_lock(&shard->lock);
+            // Pending rows are fewer than a batch here, the merge has rows to make room with
+            while (rc == SQLITE_ROW && shard->count + pending == FANOUT_ROWS && !shard->cancelled) {
+                pthread_cond_wait(&shard->work, &shard->lock);
+            }
+            if (rc != SQLITE_ROW || shard->cancelled) break;
+
+            // The merge only moves the head, the slots after the last row handed over stay this thread's
+            FanoutRow *row = &shard->rows[(shard->head + shard->count + pending) % FANOUT_ROWS];
+            pthread_mutex_unlock(&shard->lock);
+            read_row(stmt, shard->detail, row);
+            pthread_mutex_lock(&shard->lock);
+            if (++pending == FANOUT_BATCH) {
+                shard->count += pending;
+                pending = 0;
+                pthread_cond_signal(&shard->ready);
+            }
+        }
+        shard->count += pending;
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            shard->failed = true;
+            snprintf(shard->error, sizeof(shard->error), "%s", sqlite3_errmsg(shard->db));
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        shard->job = NULL;
+        shard->finished = true;
+        pthread_cond_signal(&shard->ready);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+}
+
+// Hand a bound statement over to the worker of a shard
+static void start_job(Shard *shard, sqlite3_stmt *stmt, bool detail)
+{
+    pthread_mutex_lock(&shard->lock);
+    shard->job = stmt;
+    shard->detail = detail;
+    shard->head = shard->count = 0;
+    shard->cancelled = shard->finished = shard->failed = false;
+    pthread_cond_signal(&shard->work);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Visit up to limit rows (-1 for all) of the statements started on every shard, each of them in
+// order, merged in the same order. Every worker is idle again when it returns.
+static int merge_shards(RowOrder order, int limit, MovieVisitor visit, void *ctx)
+{
+    int visited = 0;
+    bool stopped = false;
+    int rc = STORAGE_OK;
+
+    while (!stopped && (limit < 0 || visited < limit)) {
+        Shard *next = NULL;
+
+        for (int k = 0; k < num_shards; k++) {
+            Shard *shard = &shards[k];
+
+            pthread_mutex_lock(&shard->lock);
+            while (shard->count == 0 && !shard->finished) pthread_cond_wait(&shard->ready, &shard->lock);
+            bool has_row = shard->count > 0;
+            pthread_mutex_unlock(&shard->lock);
+
+            if (has_row && (next == NULL || order(&shard->rows[shard->head], &next->rows[next->head]) < 0)) {
+                next = shard;
+            }
+        }
+        if (next == NULL) break;
+
+        stopped = visit(&next->rows[next->head].movie, ctx) != 0;
+        visited++;
+
+        pthread_mutex_lock(&next->lock);
+        next->head = (next->head + 1) % FANOUT_ROWS;
+        next->count--;
+        pthread_cond_signal(&next->work);
+        pthread_mutex_unlock(&next->lock);
+    }
+
+    // Shards still reading stop at their next row
+    for (int k = 0; k < num_shards; k++) {
+        Shard *shard = &shards[k];
+
+        pthread_mutex_lock(&shard->lock);
+        shard->cancelled = true;
+        pthread_cond_signal(&shard->work);
+        while (!shard->finished) pthread_cond_wait(&shard->ready, &shard->lock);
+        if (shard->failed) {
+            snprintf(last_error, sizeof(last_error), "%s", shard->error);
+            fprintf(stderr, "Query execution error: %s\n", last_error);
+            rc = STORAGE_ERROR;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return rc;
+}
+
+static int by_id(const FanoutRow *a, const FanoutRow *b)
+{
+    return (a->movie.id > b->movie.id) - (a->movie.id < b->movie.id);
+}
+
+static int by_year(const FanoutRow *a, const FanoutRow *b)
+{
+    if (a->movie.release_year != b->movie.release_year) return a->movie.release_year < b->movie.release_year ? -1 : 1;
+    return by_id(a, b);
+}
+
+// Same order as SQLite's BINARY collation, titles are unique
+static int by_title(const FanoutRow *a, const FanoutRow *b)
+{
+    return strcmp(a->movie.title, b->movie.title);
+}
+
+// Best match first, bm25 ranks are negative
+static int by_rank(const FanoutRow *a, const FanoutRow *b)
+{
+    if (a->rank != b->rank) return a->rank < b->rank ? -1 : 1;
+    return by_id(a, b);
+}
+
+static void close_shard(Shard *shard)
+{
+    if (shard->started) {
+        pthread_mutex_lock(&shard->lock);
+        shard->stopping = true;
+        pthread_cond_signal(&shard->work);
+        pthread_mutex_unlock(&shard->lock);
+        pthread_join(shard->worker, NULL);
+        pthread_cond_destroy(&shard->ready);
+        pthread_cond_destroy(&shard->work);
+        pthread_mutex_destroy(&shard->lock);
+        shard->started = false;
+    }
+    for (int i = 0; i < NUM_SHARD_STATEMENTS; i++) {
+        sqlite3_finalize(shard->stmts[i]);
+        shard->stmts[i] = NULL;
+    }
+    sqlite3_close(shard->db);
+    shard->db = NULL;
+}
+
+static int open_shard(Shard *shard, const char *path, int k, bool reset)
+{
+    char shard_path[PATH_MAX];
+
+    snprintf(shard_path, sizeof(shard_path), "%s.shard%d", path, k);
+    if (sqlite3_open(shard_path, &shard->db) != SQLITE_OK) return fail(shard->db, "Can't open shard");
+
+    if (reset && exec(shard->db, shard_drop_sql) != STORAGE_OK) return STORAGE_ERROR;
+    if (exec(shard->db, shard_schema_sql) != STORAGE_OK || exec(shard->db, "PRAGMA foreign_keys = ON;") != STORAGE_OK) {
+        return STORAGE_ERROR;
+    }
+    for (int i = 0; i < NUM_SHARD_STATEMENTS; i++) {
+        if (sqlite3_prepare_v2(shard->db, shard_sql[i], -1, &shard->stmts[i], NULL) != SQLITE_OK) {
+            return fail(shard->db, "Failed to prepare statement");
+        }
+    }
+
+    sqlite3_stmt *stmt = shard->stmts[SELECT_CATALOG];
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        shard->version = sqlite3_column_int64(stmt, 0);
+        shard->next_id = sqlite3_column_int(stmt, 1);
+    }
+    sqlite3_reset(stmt);
+    // The first movie of shard k has ID k + 1
+    if (shard->next_id == 0) shard->next_id = k + 1;
+
+    pthread_mutex_init(&shard->lock, NULL);
+    pthread_cond_init(&shard->work, NULL);
+    pthread_cond_init(&shard->ready, NULL);
+    if (pthread_create(&shard->worker, NULL, shard_worker, shard) != 0) {
+        pthread_cond_destroy(&shard->ready);
+        pthread_cond_destroy(&shard->work);
+        pthread_mutex_destroy(&shard->lock);
+        snprintf(last_error, sizeof(last_error), "Can't start the worker of shard %d", k);
+        return STORAGE_ERROR;
+    }
+    shard->started = true;
+    return STORAGE_OK;
+}
+
+static void sharded_close(void)
+{
+    sqlite_profile_stop();
+    for (int k = 0; k < num_shards; k++) close_shard(&shards[k]);
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+
+    for (size_t i = 0; i < NUM_DICTIONARY_STATEMENTS; i++) {
+        sqlite3_finalize(*dictionary_statements[i].stmt);
+        *dictionary_statements[i].stmt = NULL;
+    }
+    sqlite3_close(dictionary);
+    dictionary = NULL;
+}
+
+// Number of shards of the catalog, a new catalog gets new_catalog_shards
+static int shard_count(int *count)
+{
+    int rc = sqlite3_step(select_shards_stmt);
+    if (rc == SQLITE_ROW) *count = sqlite3_column_int(select_shards_stmt, 0);
+    sqlite3_reset(select_shards_stmt);
+
+    if (rc == SQLITE_ROW) {
+        if (*count < 1 || *count > MAX_SHARDS) {
+            snprintf(last_error, sizeof(last_error), "Bad shard count %d", *count);
+            return STORAGE_ERROR;
+        }
+        if (*count != new_catalog_shards) fprintf(stdout, "Keeping the %d shards of the catalog\n", *count);
+        return STORAGE_OK;
+    }
+    if (rc != SQLITE_DONE) return fail(dictionary, "Failed to read shard count");
+
+    *count = new_catalog_shards;
+    sqlite3_bind_int(insert_shards_stmt, 1, *count);
+    if (step_once(insert_shards_stmt) != SQLITE_DONE) return fail(dictionary, "Failed to store shard count");
+    return STORAGE_OK;
+}
+
+static int sharded_open(const char *path, bool reset)
+{
+    int count = 0;
+
+    /* Open the dictionary, it knows how many shards there are */
+    if (sqlite3_open(path, &dictionary) != SQLITE_OK) {
+        fail(dictionary, "Can't open database");
+        sharded_close();
+        return STORAGE_ERROR;
+    }
+    fprintf(stdout, "Opened database successfully\n");
+
+    if (reset) {
+        fprintf(stdout, "Initializing database...\n");
+        if (exec(dictionary, dictionary_drop_sql) != STORAGE_OK) {
+            sharded_close();
+            return STORAGE_ERROR;
+        }
+    }
+    if (exec(dictionary, dictionary_schema_sql) != STORAGE_OK) {
+        sharded_close();
+        return STORAGE_ERROR;
+    }
+    for (size_t i = 0; i < NUM_DICTIONARY_STATEMENTS; i++) {
+        if (sqlite3_prepare_v2(dictionary, dictionary_statements[i].sql, -1, dictionary_statements[i].stmt, NULL) != SQLITE_OK) {
+            fail(dictionary, "Failed to prepare statement");
+            sharded_close();
+            return STORAGE_ERROR;
+        }
+    }
+    if (shard_count(&count) != STORAGE_OK) {
+        sharded_close();
+        return STORAGE_ERROR;
+    }
+
+    shards = calloc(count, sizeof(Shard));
+    if (shards == NULL) {
+        snprintf(last_error, sizeof(last_error), "Can't allocate %d shards", count);
+        sharded_close();
+        return STORAGE_ERROR;
+    }
+    num_shards = count;
+
+    catalog_version = 0;
+    for (int k = 0; k < num_shards; k++) {
+        if (open_shard(&shards[k], path, k, reset) != STORAGE_OK) {
+            sharded_close();
+            return STORAGE_ERROR;
+        }
+        catalog_version += shards[k].version;
+    }
+
+    // The last batch may not have committed on every shard, the titles it changed are checked
+    if (exec(dictionary, "BEGIN;") != STORAGE_OK || settle_pending() != STORAGE_OK || fill_titles() != STORAGE_OK
+            || exec(dictionary, "COMMIT;") != STORAGE_OK) {
+        sharded_close();
+        return STORAGE_ERROR;
+    }
+    unsettled = false;
+    fprintf(stdout, "Opened %d shards\n", num_shards);
+    return STORAGE_OK;
+}
+
+// A write before in the batch gave the title up
+static bool title_freed(const ShardWrite *batch, int num_writes, const char *title)
+{
+    for (int i = 0; i < num_writes; i++) {
+        if (batch[i].frees_title && strcmp(batch[i].freed_title, title) == 0) return true;
+    }
+    return false;
+}
+
+// Claim the title and genres of a write in the dictionary, a create gets its ID there.
+// The shard running the write is set when it is to run.
+static int claim_write(ShardWrite *w, int *next_ids, bool *cleared)
+{
+    Movie *movie = &w->write->movie;
+    char title[TITLE_SIZE];
+    int rc;
+
+    w->shard = NULL;
+    w->num_genre_ids = 0;
+    w->frees_title = false;
+
+    if (w->write->type != WRITE_REMOVE) {
+        for (int i = 0; i < movie->num_genres; i++) {
+            int id;
+            if (genre_id(movie->genre[i], &id) != STORAGE_OK) return STORAGE_ERROR;
+            if (!contains_id(w->genre_ids, w->num_genre_ids, id)) w->genre_ids[w->num_genre_ids++] = id;
+        }
+    }
+
+    if (w->write->type == WRITE_CREATE) {
+        // IDs are handed out in order, the next one is the smallest next ID of a shard
+        int k = 0;
+        for (int j = 1; j < num_shards; j++) {
+            if (next_ids[j] < next_ids[k]) k = j;
+        }
+
+        if ((rc = add_pending(next_ids[k], cleared)) != STORAGE_OK) return rc;
+        sqlite3_bind_int(insert_title_stmt, 1, next_ids[k]);
+        sqlite3_bind_text(insert_title_stmt, 2, movie->title, -1, SQLITE_STATIC);
+        if ((rc = write_title(insert_title_stmt)) != STORAGE_OK) return rc;
+
+        movie->id = next_ids[k];
+        movie->version = 1;
+        next_ids[k] += num_shards;
+    } else {
+        // A movie the dictionary has no title of does not exist
+        if (shard_of(movie->id) == NULL) return STORAGE_NOT_FOUND;
+        if ((rc = find_title(movie->id, title)) != STORAGE_OK) return rc;
+
+        if (w->write->type == WRITE_UPDATE && strcmp(title, movie->title) == 0) {
+            w->shard = shard_of(movie->id);
+            return STORAGE_OK;
+        }
+        if ((rc = add_pending(movie->id, cleared)) != STORAGE_OK) return rc;
+        if (w->write->type == WRITE_REMOVE) {
+            sqlite3_bind_int(delete_title_stmt, 1, movie->id);
+            rc = write_title(delete_title_stmt);
+        } else {
+            sqlite3_bind_text(rename_title_stmt, 1, movie->title, -1, SQLITE_STATIC);
+            sqlite3_bind_int(rename_title_stmt, 2, movie->id);
+            rc = write_title(rename_title_stmt);
+        }
+        if (rc != STORAGE_OK) return rc;
+
+        w->frees_title = true;
+        snprintf(w->freed_title, sizeof(w->freed_title), "%s", title);
+    }
+    w->shard = shard_of(movie->id);
+    return STORAGE_OK;
+}
+
+// Turn a write down with the last error, it does not reach its shard
+static void turn_down(ShardWrite *w)
+{
+    w->write->status = STORAGE_ERROR;
+    snprintf(w->write->error, sizeof(w->write->error), "%s", last_error);
+    w->shard = NULL;
+}
+
+// Claim the writes of a batch in one dictionary transaction, committed before any shard runs them.
+// The batch ends before a write taking a title given up earlier in it: were the shard giving it up
+// to fail, two shards would have the title. Returns the number of writes of the batch.
+static int claim_writes(ShardWrite *batch, int num_writes)
+{
+    int next_ids[MAX_SHARDS];
+    bool cleared = false, lost = false;
+    int taken = 0;
+
+    for (int k = 0; k < num_shards; k++) next_ids[k] = shards[k].next_id;
+
+    if (exec(dictionary, "BEGIN;") != STORAGE_OK) {
+        for (int i = 0; i < num_writes; i++) turn_down(&batch[i]);
+        return num_writes;
+    }
+    if (unsettled) {
+        if (settle_pending() != STORAGE_OK) {
+            sqlite3_exec(dictionary, "ROLLBACK;", NULL, NULL, NULL);
+            for (int i = 0; i < num_writes; i++) turn_down(&batch[i]);
+            return num_writes;
+        }
+        cleared = true;
+    }
+
+    for (; taken < num_writes; taken++) {
+        ShardWrite *w = &batch[taken];
+        if (w->write->type != WRITE_REMOVE && title_freed(batch, taken, w->write->movie.title)) break;
+
+        w->write->status = claim_write(w, next_ids, &cleared);
+        if (w->write->status == STORAGE_ERROR) {
+            snprintf(w->write->error, sizeof(w->write->error), "%s", last_error);
+            // An error like a full disk may have rolled the whole transaction back
+            if (sqlite3_get_autocommit(dictionary)) {
+                lost = true;
+                taken++;
+                break;
+            }
+        }
+    }
+
+    if (lost || exec(dictionary, "COMMIT;") != STORAGE_OK) {
+        sqlite3_exec(dictionary, "ROLLBACK;", NULL, NULL, NULL);
+        for (int i = 0; i < taken; i++) {
+            if (batch[i].shard != NULL) turn_down(&batch[i]);
+        }
+        return taken;
+    }
+    unsettled = false;
+    return taken;
+}
+
+// Run the claimed writes of a batch, on every shard having some at once
+static void run_writes(ShardWrite *batch, int batch_size)
+{
+    bool busy[MAX_SHARDS] = { false };
+
+    for (int i = 0; i < batch_size; i++) {
+        if (batch[i].shard != NULL) busy[batch[i].shard - shards] = true;
+    }
+    for (int k = 0; k < num_shards; k++) {
+        if (!busy[k]) continue;
+        pthread_mutex_lock(&shards[k].lock);
+        shards[k].batch = batch;
+        shards[k].batch_size = batch_size;
+        shards[k].finished = false;
+        pthread_cond_signal(&shards[k].work);
+        pthread_mutex_unlock(&shards[k].lock);
+    }
+    for (int k = 0; k < num_shards; k++) {
+        if (!busy[k]) continue;
+        pthread_mutex_lock(&shards[k].lock);
+        while (!shards[k].finished) pthread_cond_wait(&shards[k].ready, &shards[k].lock);
+        pthread_mutex_unlock(&shards[k].lock);
+    }
+}
+
+// The dictionary claims the titles and genres of the writes and commits first, then every shard
+// stores its writes in one transaction on its own thread. A shard failing after the dictionary
+// committed leaves titles it does not have: they are checked again before the next batch or when
+// the catalog is opened after a crash.
+static void sharded_write_batch(StorageWrite *writes, int num_writes)
+{
+    ShardWrite *batch = calloc(num_writes, sizeof(ShardWrite));
+
+    if (batch == NULL) {
+        for (int i = 0; i < num_writes; i++) {
+            writes[i].status = STORAGE_ERROR;
+            snprintf(writes[i].error, sizeof(writes[i].error), "Can't allocate a batch of %d writes", num_writes);
+            writes[i].catalog_version = catalog_version;
+        }
+        return;
+    }
+    for (int i = 0; i < num_writes; i++) batch[i].write = &writes[i];
+
+    for (int done = 0; done < num_writes; ) {
+        int taken = claim_writes(batch + done, num_writes - done);
+        run_writes(batch + done, taken);
+
+        // Each write brings the catalog one version further, in the order of the batch
+        for (int i = done; i < done + taken; i++) {
+            if (writes[i].status == STORAGE_OK) {
+                catalog_version++;
+            } else if (batch[i].shard != NULL) {
+                unsettled = true;
+            }
+            writes[i].catalog_version = catalog_version;
+        }
+        done += taken;
+    }
+    free(batch);
+}
+
+// Run a single write as a batch of its own
+static int write_single(StorageWrite *write)
+{
+    sharded_write_batch(write, 1);
+    if (write->status == STORAGE_ERROR) snprintf(last_error, sizeof(last_error), "%s", write->error);
+    return write->status;
+}
+
+static int sharded_create(Movie *movie)
+{
+    StorageWrite write = { .type = WRITE_CREATE, .movie = *movie };
+
+    int rc = write_single(&write);
+    if (rc == STORAGE_OK) *movie = write.movie;
+    return rc;
+}
+
+// Visit every row of a prepared (and bound) statement run on this thread, then reset it
+static int visit_rows(sqlite3_stmt *stmt, MovieVisitor visit, void *ctx)
+{
+    Movie movie;
+    int rc;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        read_movie(stmt, &movie);
+        if (visit(&movie, ctx) != 0) {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+    if (rc != SQLITE_DONE) fail(sqlite3_db_handle(stmt), "Query execution error");
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc == SQLITE_DONE ? STORAGE_OK : STORAGE_ERROR;
+}
+
+static int sharded_get(int id, Movie *movie)
+{
+    Shard *shard = shard_of(id);
+    if (shard == NULL) return STORAGE_NOT_FOUND;
+
+    int rc = read_shard_movie(shard, id, movie);
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    return rc == SQLITE_DONE ? STORAGE_NOT_FOUND : fail(shard->db, "Failed to execute statement");
+}
+
+static int sharded_get_many(const int *ids, int num_ids, MovieVisitor visit, void *ctx)
+{
+    char list[BATCH_CHUNK * 12 + 2];
+
+    // Each shard looks up its own IDs
+    for (int k = 0; k < num_shards; k++) {
+        int i = 0;
+
+        while (i < num_ids) {
+            int len = 0, listed = 0;
+
+            list[len++] = '[';
+            for (; i < num_ids && listed < BATCH_CHUNK; i++) {
+                if (shard_of(ids[i]) != &shards[k]) continue;
+                len += snprintf(list + len, sizeof(list) - len, listed++ > 0 ? ",%d" : "%d", ids[i]);
+            }
+            list[len++] = ']';
+            if (listed == 0) break;
+
+            sqlite3_bind_text(shards[k].stmts[SELECT_MOVIES], 1, list, len, SQLITE_STATIC);
+            if (visit_rows(shards[k].stmts[SELECT_MOVIES], visit, ctx) != STORAGE_OK) return STORAGE_ERROR;
+        }
+    }
+    return STORAGE_OK;
+}
+
+static int sharded_update(const Movie *movie, Movie *previous)
+{
+    StorageWrite write = { .type = WRITE_UPDATE, .movie = *movie };
+
+    int rc = write_single(&write);
+    if (rc == STORAGE_OK && previous != NULL) *previous = write.previous;
+    return rc;
+}
+
+static int sharded_remove(int id, Movie *previous)
+{
+    StorageWrite write = { .type = WRITE_REMOVE, .movie.id = id };
+
+    int rc = write_single(&write);
+    if (rc == STORAGE_OK && previous != NULL) *previous = write.previous;
+    return rc;
+}
+
+static int sharded_version(int id, int *version)
+{
+    Shard *shard = shard_of(id);
+    if (shard == NULL) return STORAGE_NOT_FOUND;
+
+    sqlite3_stmt *stmt = shard->stmts[SELECT_VERSION];
+    sqlite3_bind_int(stmt, 1, id);
+
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        *version = sqlite3_column_int(stmt, 0);
+    } else if (rc != SQLITE_DONE) {
+        fail(shard->db, "Failed to execute statement");
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    return rc == SQLITE_DONE ? STORAGE_NOT_FOUND : STORAGE_ERROR;
+}
+
+static long long sharded_catalog_version(void)
+{
+    return catalog_version;
+}
+
+static int sharded_scan(bool detail, MovieVisitor visit, void *ctx)
+{
+    for (int k = 0; k < num_shards; k++) {
+        start_job(&shards[k], shards[k].stmts[detail ? SCAN_DETAIL : SCAN], detail);
+    }
+    return merge_shards(by_id, -1, visit, ctx);
+}
+
+static int sharded_search(const char *query, bool prefix, int limit, MovieVisitor visit, void *ctx)
+{
+    char match_expr[256];
+
+    if (build_match_expr(query, prefix, match_expr, sizeof(match_expr)) == 0) return STORAGE_OK;
+
+    // Every shard returns its limit best matches, the best of them all are among those
+    for (int k = 0; k < num_shards; k++) {
+        sqlite3_stmt *stmt = shards[k].stmts[SEARCH];
+        sqlite3_bind_text(stmt, 1, match_expr, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, limit);
+        start_job(&shards[k], stmt, true);
+    }
+    return merge_shards(by_rank, limit, visit, ctx);
+}
+
+static int sharded_query(const MovieQuery *query, MovieVisitor visit, void *ctx)
+{
+    static const RowOrder orders[] = { [SORT_ID] = by_id, [SORT_YEAR] = by_year, [SORT_TITLE] = by_title };
+    bool by_genre = query->genre[0] != '\0';
+    int genre = 0;
+
+    // A genre missing from the dictionary has no movies
+    if (by_genre) {
+        int rc = find_genre(query->genre, &genre);
+        if (rc != STORAGE_OK) return rc == STORAGE_NOT_FOUND ? STORAGE_OK : rc;
+    }
+
+    for (int k = 0; k < num_shards; k++) {
+        sqlite3_stmt *stmt = shards[k].stmts[QUERY_STMT(by_genre, query->sort)];
+        sqlite3_bind_int(stmt, 1, query->year_from);
+        sqlite3_bind_int(stmt, 2, query->year_to);
+        sqlite3_bind_int(stmt, 3, query->limit);
+        if (by_genre) sqlite3_bind_int(stmt, 4, genre);
+        start_job(&shards[k], stmt, true);
+    }
+    return merge_shards(orders[query->sort], query->limit, visit, ctx);
+}
+
+static int sharded_profile(const char *slow_log, double slow_ms)
+{
+    int rc = sqlite_profile_start(dictionary, slow_log, slow_ms);
+    for (int k = 0; k < num_shards && rc == 0; k++) {
+        rc = sqlite_profile_start(shards[k].db, slow_log, slow_ms);
+    }
+    if (rc != 0) {
+        snprintf(last_error, sizeof(last_error), "Can't profile statements");
+        return STORAGE_ERROR;
+    }
+    return STORAGE_OK;
+}
+
+static const char *sharded_errmsg(void)
+{
+    return last_error;
+}
+
+int sharded_storage_set_shards(int count)
+{
+    if (count < 1 || count > MAX_SHARDS) return STORAGE_ERROR;
+    new_catalog_shards = count;
+    return STORAGE_OK;
+}
+
+const Storage sharded_storage = {
+    .name = "sharded",
+    .open = sharded_open,
+    .close = sharded_close,
+    .create = sharded_create,
+    .get = sharded_get,
+    .get_many = sharded_get_many,
+    .update = sharded_update,
+    .remove = sharded_remove,
+    .write_batch = sharded_write_batch,
+    .version = sharded_version,
+    .catalog_version = sharded_catalog_version,
+    .scan = sharded_scan,
+    .search = sharded_search,
+    .query = sharded_query,
+    .profile = sharded_profile,
+    .statement_stats = sqlite_profile_visit,
+    .errmsg = sharded_errmsg,
+};
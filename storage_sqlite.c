@@ -0,0 +1,651 @@
+/*
+** storage_sqlite.c -- SQLite storage backend
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "storage.h"
+#include "sqlite_profile.h"
+#include "sqlite_rows.h"
+
+#define BATCH_CHUNK 256 // IDs looked up by one run of the batch statement
+#define FILL_CHUNK 256  // movies read by one run of the unfilled genres statement, filled after it
+
+// Rows of Movie_Genre go with their movie, a movie has a genre at most once
+#define MOVIE_GENRE_COLUMNS \
+    "(MovieID INTEGER NOT NULL REFERENCES Movie(ID) ON DELETE CASCADE,"\
+    "GenreID INTEGER NOT NULL REFERENCES Genre(ID),"\
+    "PRIMARY KEY (MovieID, GenreID))"
+
+static sqlite3 *db = NULL;
+static char last_error[256];
+static long long catalog_version = 0; // cached copy of Catalog.Version, this process is the only writer
+
+// Statements are prepared once when the database is opened and reset after each use
+static sqlite3_stmt *insert_movie_stmt;
+static sqlite3_stmt *update_movie_stmt;
+static sqlite3_stmt *delete_movie_stmt;
+static sqlite3_stmt *select_movie_stmt;
+static sqlite3_stmt *select_movies_stmt;
+static sqlite3_stmt *select_genre_stmt;
+static sqlite3_stmt *insert_genre_stmt;
+static sqlite3_stmt *insert_movie_genre_stmt;
+static sqlite3_stmt *select_movie_genre_ids_stmt;
+static sqlite3_stmt *delete_movie_genre_stmt;
+static sqlite3_stmt *scan_stmt;
+static sqlite3_stmt *scan_detail_stmt;
+static sqlite3_stmt *search_stmt;
+static sqlite3_stmt *select_version_stmt;
+static sqlite3_stmt *bump_catalog_stmt;
+static sqlite3_stmt *select_catalog_stmt;
+static sqlite3_stmt *unfilled_genres_stmt;
+static sqlite3_stmt *movie_genre_names_stmt;
+static sqlite3_stmt *fill_genres_stmt;
+static sqlite3_stmt *query_stmts[2][3]; // [genre filter][MovieSort]
+
+static const struct {
+    sqlite3_stmt **stmt;
+    const char *sql;
+} statements[] = {
+    { &insert_movie_stmt, "INSERT INTO Movie (Title, Director, ReleaseYear, Genres) VALUES (?, ?, ?, ?);" },
+    { &update_movie_stmt, "UPDATE Movie SET Title = ?, Director = ?, ReleaseYear = ?, Genres = ?, Version = Version + 1 WHERE ID = ?;" },
+    // Movie_Genre rows go with the movie (ON DELETE CASCADE)
+    { &delete_movie_stmt, "DELETE FROM Movie WHERE ID = ?;" },
+    // Reads take the genres stored with the movie, Movie_Genre is only used to filter by genre
+    { &select_movie_stmt, "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie WHERE ID = ?;" },
+    // The IDs come as one JSON array, each of them is a primary key lookup
+    { &select_movies_stmt,
+        "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie "\
+        "WHERE ID IN (SELECT value FROM json_each(?));" },
+    { &select_genre_stmt, "SELECT ID FROM Genre WHERE Name = ?;" },
+    { &insert_genre_stmt, "INSERT INTO Genre (Name) VALUES (?);" },
+    // A genre listed twice is stored once
+    { &insert_movie_genre_stmt, "INSERT OR IGNORE INTO Movie_Genre (MovieID, GenreID) VALUES (?, ?);" },
+    { &select_movie_genre_ids_stmt, "SELECT GenreID FROM Movie_Genre WHERE MovieID = ?;" },
+    { &delete_movie_genre_stmt, "DELETE FROM Movie_Genre WHERE MovieID = ? AND GenreID = ?;" },
+    { &scan_stmt, "SELECT ID, Title FROM Movie ORDER BY ID;" },
+    { &scan_detail_stmt, "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie ORDER BY ID;" },
+    // The index is walked in rank order and stops at the limit, so only matching rows
+    // are read from Movie. Title matches weigh more than Director ones.
+    { &search_stmt,
+        "SELECT m.ID, m.Title, m.Director, m.ReleaseYear, m.Genres, m.Version "\
+        "FROM Movie_Search "\
+        "JOIN Movie m ON m.ID = Movie_Search.rowid "\
+        "WHERE Movie_Search MATCH ? "\
+        "ORDER BY bm25(Movie_Search, 10.0, 1.0) "\
+        "LIMIT ?;" },
+    { &select_version_stmt, "SELECT Version FROM Movie WHERE ID = ?;" },
+    { &bump_catalog_stmt, "UPDATE Catalog SET Version = Version + 1 WHERE ID = 1;" },
+    { &select_catalog_stmt, "SELECT Version FROM Catalog WHERE ID = 1;" },
+    // Movies stored before Movie.Genres existed get it filled from Movie_Genre once
+    { &unfilled_genres_stmt,
+        "SELECT ID FROM Movie WHERE Genres IS NULL AND ID > ? ORDER BY ID LIMIT ?;" },
+    { &movie_genre_names_stmt,
+        "SELECT g.Name FROM Movie_Genre mg JOIN Genre g ON mg.GenreID = g.ID "\
+        "WHERE mg.MovieID = ? ORDER BY mg.rowid;" },
+    { &fill_genres_stmt, "UPDATE Movie SET Genres = ? WHERE ID = ?;" },
+    // Listings by release year range: Movie_Year gives the range in (ReleaseYear, ID) order, Title
+    // has its own unique index. With a genre the movies come from Movie_Genre_Genre, in ID order,
+    // and are then checked for the year. ?1 and ?2 are the years, ?3 the limit and ?4 the genre.
+    { &query_stmts[0][SORT_ID],
+        "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie "\
+        "WHERE ReleaseYear BETWEEN ?1 AND ?2 ORDER BY ID LIMIT ?3;" },
+    { &query_stmts[0][SORT_YEAR],
+        "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie "\
+        "WHERE ReleaseYear BETWEEN ?1 AND ?2 ORDER BY ReleaseYear, ID LIMIT ?3;" },
+    { &query_stmts[0][SORT_TITLE],
+        "SELECT ID, Title, Director, ReleaseYear, Genres, Version FROM Movie "\
+        "WHERE ReleaseYear BETWEEN ?1 AND ?2 ORDER BY Title LIMIT ?3;" },
+    { &query_stmts[1][SORT_ID],
+        "SELECT m.ID, m.Title, m.Director, m.ReleaseYear, m.Genres, m.Version "\
+        "FROM Movie_Genre mg JOIN Movie m ON m.ID = mg.MovieID "\
+        "WHERE mg.GenreID = (SELECT ID FROM Genre WHERE Name = ?4) AND m.ReleaseYear BETWEEN ?1 AND ?2 "\
+        "ORDER BY mg.MovieID LIMIT ?3;" },
+    { &query_stmts[1][SORT_YEAR],
+        "SELECT m.ID, m.Title, m.Director, m.ReleaseYear, m.Genres, m.Version "\
+        "FROM Movie_Genre mg JOIN Movie m ON m.ID = mg.MovieID "\
+        "WHERE mg.GenreID = (SELECT ID FROM Genre WHERE Name = ?4) AND m.ReleaseYear BETWEEN ?1 AND ?2 "\
+        "ORDER BY m.ReleaseYear, m.ID LIMIT ?3;" },
+    { &query_stmts[1][SORT_TITLE],
+        "SELECT m.ID, m.Title, m.Director, m.ReleaseYear, m.Genres, m.Version "\
+        "FROM Movie_Genre mg JOIN Movie m ON m.ID = mg.MovieID "\
+        "WHERE mg.GenreID = (SELECT ID FROM Genre WHERE Name = ?4) AND m.ReleaseYear BETWEEN ?1 AND ?2 "\
+        "ORDER BY m.Title LIMIT ?3;" },
+};
+
+#define NUM_STATEMENTS (sizeof(statements) / sizeof(statements[0]))
+
+static const char *drop_sql =
+    "DROP TABLE IF EXISTS Genre;"\
+    "DROP TABLE IF EXISTS Movie;"\
+    "DROP TABLE IF EXISTS Movie_Genre;"\
+    "DROP TABLE IF EXISTS Movie_Search;"\
+    "DROP TABLE IF EXISTS Catalog;";
+
+/*
+sqlite> SELECT * FROM Movie m
+...> JOIN Movie_Genre mg on m.ID = mg.MovieID
+...> JOIN Genre g ON mg.GenreID = g.id;
+*/
+static const char *schema_sql =
+    "CREATE TABLE IF NOT EXISTS Genre(" \
+        "ID   INTEGER    PRIMARY KEY AUTOINCREMENT,"
+        "Name TEXT                 NOT NULL UNIQUE);"
+    "CREATE TABLE IF NOT EXISTS Movie("  \
+        "ID INTEGER PRIMARY KEY AUTOINCREMENT," \
+        "Title          TEXT    NOT NULL UNIQUE," \
+        "Director       TEXT    NOT NULL, " \
+        "ReleaseYear    INT     NOT NULL," \
+        "Version        INT     NOT NULL DEFAULT 1," \
+        "Genres         BLOB);"
+    "CREATE TABLE IF NOT EXISTS Movie_Genre" MOVIE_GENRE_COLUMNS ";"
+    "CREATE INDEX IF NOT EXISTS Movie_Year ON Movie(ReleaseYear);"
+    "CREATE INDEX IF NOT EXISTS Movie_Genre_Genre ON Movie_Genre(GenreID, MovieID);"
+    /* Single row holding the version of the whole catalog, bumped by every write */
+    "CREATE TABLE IF NOT EXISTS Catalog("\
+        "ID      INTEGER PRIMARY KEY CHECK (ID = 1),"\
+        "Version INT     NOT NULL);"
+    "INSERT OR IGNORE INTO Catalog (ID, Version) VALUES (1, 0);"
+    MOVIE_SEARCH_SCHEMA;
+
+// Remember the current SQLite error, it would be lost by a following ROLLBACK
+static int fail(const char *what)
+{
+    snprintf(last_error, sizeof(last_error), "%s", sqlite3_errmsg(db));
+    fprintf(stderr, "%s: %s\n", what, last_error);
+    return STORAGE_ERROR;
+}
+
+static int exec(const char *sql)
+{
+    char *zErrMsg = 0;
+    if (sqlite3_exec(db, sql, NULL, NULL, &zErrMsg) != SQLITE_OK) {
+        snprintf(last_error, sizeof(last_error), "%s", zErrMsg ? zErrMsg : sqlite3_errmsg(db));
+        fprintf(stderr, "SQL error: %s\n", last_error);
+        sqlite3_free(zErrMsg);
+        return STORAGE_ERROR;
+    }
+    return STORAGE_OK;
+}
+
+// Run a statement that returns no rows and make it ready for the next use
+static int step_once(sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
+}
+
+static int rollback(int status)
+{
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return status;
+}
+
+// Bump the catalog version inside the current transaction and commit it
+static int commit_write(void)
+{
+    if (step_once(bump_catalog_stmt) != SQLITE_DONE) return rollback(fail("Failed to bump catalog version"));
+    if (exec("COMMIT;") != STORAGE_OK) return rollback(STORAGE_ERROR);
+
+    catalog_version++;
+    return STORAGE_OK;
+}
+
+// Find the ID of a genre, adding it to the Genre table when it is new
+static int genre_id(const char *name, int *id)
+{
+    sqlite3_bind_text(select_genre_stmt, 1, name, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(select_genre_stmt);
+    if (rc == SQLITE_ROW) {
+        *id = sqlite3_column_int(select_genre_stmt, 0);
+    }
+    sqlite3_reset(select_genre_stmt);
+    sqlite3_clear_bindings(select_genre_stmt);
+
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    if (rc != SQLITE_DONE) return fail("Failed to query genre");
+
+    /* If genre not found, insert it in table with genres */
+    sqlite3_bind_text(insert_genre_stmt, 1, name, -1, SQLITE_STATIC);
+    if (step_once(insert_genre_stmt) != SQLITE_DONE) return fail("Failed to insert genre");
+
+    *id = (int)sqlite3_last_insert_rowid(db);
+    return STORAGE_OK;
+}
+
+// Link a movie to each of its genres
+static int insert_genres(const Movie *movie)
+{
+    for (int i = 0; i < movie->num_genres; i++) {
+        int id;
+        if (genre_id(movie->genre[i], &id) != STORAGE_OK) return STORAGE_ERROR;
+
+        sqlite3_bind_int(insert_movie_genre_stmt, 1, movie->id);
+        sqlite3_bind_int(insert_movie_genre_stmt, 2, id);
+        if (step_once(insert_movie_genre_stmt) != SQLITE_DONE) {
+            return fail("Failed to insert into Movie_Genre");
+        }
+    }
+    return STORAGE_OK;
+}
+
+static bool contains_id(const int *ids, int num_ids, int id)
+{
+    for (int i = 0; i < num_ids; i++) {
+        if (ids[i] == id) return true;
+    }
+    return false;
+}
+
+// Bring the Movie_Genre rows of a movie in line with its genres, only the ones that changed are written
+static int update_genres(const Movie *movie)
+{
+    int new_ids[MAX_GENRES], old_ids[MAX_GENRES];
+    int num_new = 0, num_old = 0;
+    int rc;
+
+    for (int i = 0; i < movie->num_genres; i++) {
+        int id;
+        if (genre_id(movie->genre[i], &id) != STORAGE_OK) return STORAGE_ERROR;
+        if (!contains_id(new_ids, num_new, id)) new_ids[num_new++] = id;
+    }
+
+    // At most MAX_GENRES rows, one per distinct genre
+    sqlite3_bind_int(select_movie_genre_ids_stmt, 1, movie->id);
+    while ((rc = sqlite3_step(select_movie_genre_ids_stmt)) == SQLITE_ROW && num_old < MAX_GENRES) {
+        old_ids[num_old++] = sqlite3_column_int(select_movie_genre_ids_stmt, 0);
+    }
+    sqlite3_reset(select_movie_genre_ids_stmt);
+    sqlite3_clear_bindings(select_movie_genre_ids_stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) return fail("Failed to read movie genres");
+
+    for (int i = 0; i < num_old; i++) {
+        if (contains_id(new_ids, num_new, old_ids[i])) continue;
+        sqlite3_bind_int(delete_movie_genre_stmt, 1, movie->id);
+        sqlite3_bind_int(delete_movie_genre_stmt, 2, old_ids[i]);
+        if (step_once(delete_movie_genre_stmt) != SQLITE_DONE) return fail("Failed to delete movie genre");
+    }
+    for (int i = 0; i < num_new; i++) {
+        if (contains_id(old_ids, num_old, new_ids[i])) continue;
+        sqlite3_bind_int(insert_movie_genre_stmt, 1, movie->id);
+        sqlite3_bind_int(insert_movie_genre_stmt, 2, new_ids[i]);
+        if (step_once(insert_movie_genre_stmt) != SQLITE_DONE) return fail("Failed to insert into Movie_Genre");
+    }
+    return STORAGE_OK;
+}
+
+// Add Movie.Genres to a database created before it existed
+static int add_genres_column(void)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('Movie') WHERE name = 'Genres';", -1, &stmt, NULL) != SQLITE_OK) {
+        return fail("Failed to read Movie columns");
+    }
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    if (rc != SQLITE_DONE) return fail("Failed to read Movie columns");
+    return exec("ALTER TABLE Movie ADD COLUMN Genres BLOB;");
+}
+
+// Recreate a Movie_Genre made before deletes cascaded to it. Rows of movies or genres that no
+// longer exist are dropped, the others are copied in their order.
+static int cascade_movie_genres(void)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_foreign_key_list('Movie_Genre') "\
+                               "WHERE \"table\" = 'Movie' AND on_delete = 'CASCADE';", -1, &stmt, NULL) != SQLITE_OK) {
+        return fail("Failed to read Movie_Genre foreign keys");
+    }
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    if (rc != SQLITE_DONE) return fail("Failed to read Movie_Genre foreign keys");
+
+    fprintf(stdout, "Making movie deletes cascade to Movie_Genre...\n");
+    if (exec("BEGIN;"
+             "CREATE TABLE Movie_Genre_Cascade" MOVIE_GENRE_COLUMNS ";"
+             "INSERT OR IGNORE INTO Movie_Genre_Cascade (MovieID, GenreID) "\
+                 "SELECT MovieID, GenreID FROM Movie_Genre "\
+                 "WHERE MovieID IN (SELECT ID FROM Movie) AND GenreID IN (SELECT ID FROM Genre) ORDER BY rowid;"
+             "DROP TABLE Movie_Genre;"
+             "ALTER TABLE Movie_Genre_Cascade RENAME TO Movie_Genre;"
+             "CREATE INDEX Movie_Genre_Genre ON Movie_Genre(GenreID, MovieID);"
+             "COMMIT;") != STORAGE_OK) {
+        return rollback(STORAGE_ERROR);
+    }
+    return STORAGE_OK;
+}
+
+// Store the genres of a movie that has none stored yet, taken from Movie_Genre
+static int fill_movie_genres(int id)
+{
+    unsigned char genres[GENRES_BLOB_SIZE];
+    int len = 0, count = 0;
+    int rc;
+
+    sqlite3_bind_int(movie_genre_names_stmt, 1, id);
+    while ((rc = sqlite3_step(movie_genre_names_stmt)) == SQLITE_ROW && count < MAX_GENRES) {
+        const char *name = (const char *)sqlite3_column_text(movie_genre_names_stmt, 0);
+        len = append_genre(genres, len, name ? name : "");
+        count++;
+    }
+    sqlite3_reset(movie_genre_names_stmt);
+    sqlite3_clear_bindings(movie_genre_names_stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) return rc;
+
+    sqlite3_bind_blob(fill_genres_stmt, 1, genres, len, SQLITE_STATIC);
+    sqlite3_bind_int(fill_genres_stmt, 2, id);
+    return step_once(fill_genres_stmt);
+}
+
+// Store the genres of the movies that have none stored yet. Their IDs are read a chunk at a
+// time and the select is done with before they are updated, Movie is not changed under it.
+static int fill_genres(void)
+{
+    int ids[FILL_CHUNK];
+    int num_ids, last_id = 0, filled = 0;
+    int rc;
+
+    if (exec("BEGIN;") != STORAGE_OK) return STORAGE_ERROR;
+    do {
+        num_ids = 0;
+        sqlite3_bind_int(unfilled_genres_stmt, 1, last_id);
+        sqlite3_bind_int(unfilled_genres_stmt, 2, FILL_CHUNK);
+        while ((rc = sqlite3_step(unfilled_genres_stmt)) == SQLITE_ROW) {
+            ids[num_ids++] = sqlite3_column_int(unfilled_genres_stmt, 0);
+        }
+        sqlite3_reset(unfilled_genres_stmt);
+        if (rc != SQLITE_DONE) break;
+
+        for (int i = 0; i < num_ids && rc == SQLITE_DONE; i++) {
+            rc = fill_movie_genres(ids[i]);
+            last_id = ids[i];
+        }
+        filled += num_ids;
+    } while (rc == SQLITE_DONE && num_ids == FILL_CHUNK);
+
+    if (rc != SQLITE_DONE) return rollback(fail("Failed to fill movie genres"));
+    if (exec("COMMIT;") != STORAGE_OK) return rollback(STORAGE_ERROR);
+    if (filled > 0) fprintf(stdout, "Stored the genres of %d movies with them\n", filled);
+    return STORAGE_OK;
+}
+
+static void sqlite_close(void)
+{
+    sqlite_profile_stop();
+    for (size_t i = 0; i < NUM_STATEMENTS; i++) {
+        sqlite3_finalize(*statements[i].stmt);
+        *statements[i].stmt = NULL;
+    }
+    sqlite3_close(db);
+    db = NULL;
+}
+
+static int sqlite_open(const char *path, bool reset)
+{
+    /* Open database */
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        fail("Can't open database");
+        sqlite3_close(db);
+        db = NULL;
+        return STORAGE_ERROR;
+    }
+    fprintf(stdout, "Opened database successfully\n");
+
+    if (reset) {
+        fprintf(stdout, "Initializing database...\n");
+        if (exec(drop_sql) != STORAGE_OK) {
+            sqlite_close();
+            return STORAGE_ERROR;
+        }
+    }
+    // Foreign keys are enforced once the schema is up to date, cascading deletes rely on them
+    if (exec(schema_sql) != STORAGE_OK || add_genres_column() != STORAGE_OK || cascade_movie_genres() != STORAGE_OK
+            || exec("PRAGMA foreign_keys = ON;") != STORAGE_OK) {
+        sqlite_close();
+        return STORAGE_ERROR;
+    }
+
+    for (size_t i = 0; i < NUM_STATEMENTS; i++) {
+        if (sqlite3_prepare_v2(db, statements[i].sql, -1, statements[i].stmt, NULL) != SQLITE_OK) {
+            fail("Failed to prepare statement");
+            sqlite_close();
+            return STORAGE_ERROR;
+        }
+    }
+
+    if (sqlite3_step(select_catalog_stmt) == SQLITE_ROW) {
+        catalog_version = sqlite3_column_int64(select_catalog_stmt, 0);
+    }
+    sqlite3_reset(select_catalog_stmt);
+
+    if (fill_genres() != STORAGE_OK) {
+        sqlite_close();
+        return STORAGE_ERROR;
+    }
+    return STORAGE_OK;
+}
+
+static int sqlite_create(Movie *movie)
+{
+    if (exec("BEGIN;") != STORAGE_OK) return STORAGE_ERROR;
+
+    /* Bind values with movie data */
+    sqlite3_bind_text(insert_movie_stmt, 1, movie->title, -1, SQLITE_STATIC);
+    sqlite3_bind_text(insert_movie_stmt, 2, movie->director, -1, SQLITE_STATIC);
+    sqlite3_bind_int(insert_movie_stmt, 3, movie->release_year);
+    unsigned char genres[GENRES_BLOB_SIZE];
+    sqlite3_bind_blob(insert_movie_stmt, 4, genres, encode_genres(movie, genres), SQLITE_STATIC);
+
+    if (step_once(insert_movie_stmt) != SQLITE_DONE) {
+        return rollback(fail("Failed to insert movie"));
+    }
+
+    /* Get the last inserted Movie ID */
+    movie->id = (int)sqlite3_last_insert_rowid(db);
+    movie->version = 1;
+
+    if (insert_genres(movie) != STORAGE_OK) return rollback(STORAGE_ERROR);
+
+    return commit_write();
+}
+
+static int sqlite_get(int id, Movie *movie)
+{
+    sqlite3_bind_int(select_movie_stmt, 1, id);
+
+    int rc = sqlite3_step(select_movie_stmt);
+    if (rc == SQLITE_ROW) {
+        read_movie(select_movie_stmt, movie);
+    } else if (rc != SQLITE_DONE) {
+        fail("Failed to execute statement");
+    }
+    sqlite3_reset(select_movie_stmt);
+    sqlite3_clear_bindings(select_movie_stmt);
+
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    return rc == SQLITE_DONE ? STORAGE_NOT_FOUND : STORAGE_ERROR;
+}
+
+static int sqlite_update(const Movie *movie, Movie *previous)
+{
+    if (exec("BEGIN;") != STORAGE_OK) return STORAGE_ERROR;
+
+    // Read in the same transaction, nothing can change the movie in between
+    if (previous != NULL) {
+        int rc = sqlite_get(movie->id, previous);
+        if (rc != STORAGE_OK) return rollback(rc);
+    }
+
+    sqlite3_bind_text(update_movie_stmt, 1, movie->title, -1, SQLITE_STATIC);
+    sqlite3_bind_text(update_movie_stmt, 2, movie->director, -1, SQLITE_STATIC);
+    sqlite3_bind_int(update_movie_stmt, 3, movie->release_year);
+    unsigned char genres[GENRES_BLOB_SIZE];
+    sqlite3_bind_blob(update_movie_stmt, 4, genres, encode_genres(movie, genres), SQLITE_STATIC);
+    sqlite3_bind_int(update_movie_stmt, 5, movie->id);
+
+    if (step_once(update_movie_stmt) != SQLITE_DONE) {
+        return rollback(fail("Failed to update movie"));
+    }
+    if (sqlite3_changes(db) == 0) return rollback(STORAGE_NOT_FOUND);
+
+    if (update_genres(movie) != STORAGE_OK) return rollback(STORAGE_ERROR);
+
+    return commit_write();
+}
+
+static int sqlite_remove(int id, Movie *previous)
+{
+    if (exec("BEGIN;") != STORAGE_OK) return STORAGE_ERROR;
+
+    if (previous != NULL) {
+        int rc = sqlite_get(id, previous);
+        if (rc != STORAGE_OK) return rollback(rc);
+    }
+
+    sqlite3_bind_int(delete_movie_stmt, 1, id);
+    if (step_once(delete_movie_stmt) != SQLITE_DONE) {
+        return rollback(fail("Failed to delete movie"));
+    }
+    if (sqlite3_changes(db) == 0) return rollback(STORAGE_NOT_FOUND);
+
+    return commit_write();
+}
+
+static int sqlite_version(int id, int *version)
+{
+    sqlite3_bind_int(select_version_stmt, 1, id);
+
+    int rc = sqlite3_step(select_version_stmt);
+    if (rc == SQLITE_ROW) {
+        *version = sqlite3_column_int(select_version_stmt, 0);
+    } else if (rc != SQLITE_DONE) {
+        fail("Failed to execute statement");
+    }
+    sqlite3_reset(select_version_stmt);
+    sqlite3_clear_bindings(select_version_stmt);
+
+    if (rc == SQLITE_ROW) return STORAGE_OK;
+    return rc == SQLITE_DONE ? STORAGE_NOT_FOUND : STORAGE_ERROR;
+}
+
+static long long sqlite_catalog_version(void)
+{
+    return catalog_version;
+}
+
+// Visit every row of a prepared (and bound) statement, then reset it
+static int visit_rows(sqlite3_stmt *stmt, bool detail, MovieVisitor visit, void *ctx)
+{
+    Movie movie;
+    int rc;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (detail) {
+            read_movie(stmt, &movie);
+        } else {
+            memset(&movie, 0, sizeof(Movie));
+            movie.id = sqlite3_column_int(stmt, 0);
+            column_string(stmt, 1, movie.title, sizeof(movie.title));
+        }
+        if (visit(&movie, ctx) != 0) {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+    if (rc != SQLITE_DONE) fail("Query execution error");
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc == SQLITE_DONE ? STORAGE_OK : STORAGE_ERROR;
+}
+
+static int sqlite_scan(bool detail, MovieVisitor visit, void *ctx)
+{
+    return visit_rows(detail ? scan_detail_stmt : scan_stmt, detail, visit, ctx);
+}
+
+static int sqlite_get_many(const int *ids, int num_ids, MovieVisitor visit, void *ctx)
+{
+    char list[BATCH_CHUNK * 12 + 2];
+
+    for (int start = 0; start < num_ids; start += BATCH_CHUNK) {
+        int end = num_ids - start > BATCH_CHUNK ? start + BATCH_CHUNK : num_ids;
+        int len = 0;
+
+        list[len++] = '[';
+        for (int i = start; i < end; i++) {
+            len += snprintf(list + len, sizeof(list) - len, i > start ? ",%d" : "%d", ids[i]);
+        }
+        list[len++] = ']';
+
+        sqlite3_bind_text(select_movies_stmt, 1, list, len, SQLITE_STATIC);
+        if (visit_rows(select_movies_stmt, true, visit, ctx) != STORAGE_OK) return STORAGE_ERROR;
+    }
+    return STORAGE_OK;
+}
+
+static int sqlite_search(const char *query, bool prefix, int limit, MovieVisitor visit, void *ctx)
+{
+    char match_expr[256];
+
+    if (build_match_expr(query, prefix, match_expr, sizeof(match_expr)) == 0) return STORAGE_OK;
+
+    sqlite3_bind_text(search_stmt, 1, match_expr, -1, SQLITE_STATIC);
+    sqlite3_bind_int(search_stmt, 2, limit);
+    return visit_rows(search_stmt, true, visit, ctx);
+}
+
+static int sqlite_query(const MovieQuery *query, MovieVisitor visit, void *ctx)
+{
+    bool by_genre = query->genre[0] != '\0';
+    sqlite3_stmt *stmt = query_stmts[by_genre][query->sort];
+
+    sqlite3_bind_int(stmt, 1, query->year_from);
+    sqlite3_bind_int(stmt, 2, query->year_to);
+    sqlite3_bind_int(stmt, 3, query->limit);
+    if (by_genre) sqlite3_bind_text(stmt, 4, query->genre, -1, SQLITE_STATIC);
+    return visit_rows(stmt, true, visit, ctx);
+}
+
+static int sqlite_profile(const char *slow_log, double slow_ms)
+{
+    if (sqlite_profile_start(db, slow_log, slow_ms) != 0) {
+        snprintf(last_error, sizeof(last_error), "Can't profile statements");
+        return STORAGE_ERROR;
+    }
+    return STORAGE_OK;
+}
+
+static const char *sqlite_errmsg(void)
+{
+    return last_error;
+}
+
+const Storage sqlite_storage = {
+    .name = "sqlite",
+    .open = sqlite_open,
+    .close = sqlite_close,
+    .create = sqlite_create,
+    .get = sqlite_get,
+    .get_many = sqlite_get_many,
+    .update = sqlite_update,
+    .remove = sqlite_remove,
+    .version = sqlite_version,
+    .catalog_version = sqlite_catalog_version,
+    .scan = sqlite_scan,
+    .search = sqlite_search,
+    .query = sqlite_query,
+    .profile = sqlite_profile,
+    .statement_stats = sqlite_profile_visit,
+    .errmsg = sqlite_errmsg,
+};
@@ -0,0 +1,574 @@
+/*
+** tcpstreaming_client.c -- client library of the movie server
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include "tcpstreaming_client.h"
+#include "compression.h"
+
+#define BUFFER_SIZE 2048 // initial size of the connection buffers
+
+struct TsCall {
+    TsCall *next;          // next call waiting on the same connection
+    bool done;
+    bool freed;            // freed while in flight, released with its response
+    char *response;
+    TsResult result;
+    TsCallback cb;
+    void *ctx;
+};
+
+// Pooled connection
+typedef struct {
+    int fd;                // -1 while not connected
+    char *out;             // requests not sent yet
+    size_t out_len, out_sent, out_size;
+    char *in;              // bytes of responses not parsed yet
+    size_t in_len, in_size;
+    TsCall *head, *tail;   // calls waiting for a response, in request order
+    int in_flight;
+} TsConn;
+
+struct TsClient {
+    char *host;
+    char port[16];
+    int pool_size;
+    TsConn *conns;
+};
+
+int ts_connect(const char *host, const char *port)
+{
+    struct addrinfo hints, *servinfo, *p;
+    int fd = -1;
+    int rv;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, port ? port : TS_DEFAULT_PORT, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    // Connect to the first address we can
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(servinfo);
+
+    return fd;
+}
+
+TsClient *ts_client_new(const char *host, const char *port, int pool_size)
+{
+    TsClient *client = calloc(1, sizeof(TsClient));
+    if (client == NULL) return NULL;
+
+    if (pool_size <= 0) pool_size = TS_DEFAULT_POOL_SIZE;
+    client->host = strdup(host);
+    client->conns = calloc(pool_size, sizeof(TsConn));
+    if (client->host == NULL || client->conns == NULL) {
+        free(client->host);
+        free(client->conns);
+        free(client);
+        return NULL;
+    }
+    snprintf(client->port, sizeof(client->port), "%s", port ? port : TS_DEFAULT_PORT);
+    client->pool_size = pool_size;
+    for (int i = 0; i < pool_size; i++) {
+        client->conns[i].fd = -1;
+    }
+    return client;
+}
+
+static void release_call(TsCall *call)
+{
+    free(call->response);
+    free(call->result.movies);
+    cJSON_Delete(call->result.json);
+    free(call);
+}
+
+// Mark a call done, running its callback or releasing it when it was freed in flight
+static void complete_call(TsCall *call, bool run_callback)
+{
+    call->done = true;
+    if (call->freed) {
+        release_call(call);
+    } else if (run_callback && call->cb != NULL) {
+        call->cb(call, call->ctx);
+    }
+}
+
+// Drop a connection, the calls waiting on it fail
+static void conn_fail(TsConn *conn, bool run_callbacks)
+{
+    TsCall *call = conn->head;
+
+    if (conn->fd != -1) close(conn->fd);
+    conn->fd = -1;
+    conn->out_len = conn->out_sent = 0;
+    conn->in_len = 0;
+    conn->head = conn->tail = NULL;
+    conn->in_flight = 0;
+
+    while (call != NULL) {
+        TsCall *next = call->next;
+        call->result.status = TS_ERROR;
+        complete_call(call, run_callbacks);
+        call = next;
+    }
+}
+
+void ts_client_free(TsClient *client)
+{
+    if (client == NULL) return;
+
+    for (int i = 0; i < client->pool_size; i++) {
+        conn_fail(&client->conns[i], false);
+        free(client->conns[i].out);
+        free(client->conns[i].in);
+    }
+    free(client->conns);
+    free(client->host);
+    free(client);
+}
+
+static int conn_open(TsClient *client, TsConn *conn)
+{
+    int one = 1;
+
+    conn->fd = ts_connect(client->host, client->port);
+    if (conn->fd == -1) return -1;
+
+    // Requests are small and pipelined, don't hold them back waiting for more
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    int flags = fcntl(conn->fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// An idle connection the server has closed meanwhile (idle timeout, restart) must not take a request
+static bool conn_closed_by_server(const TsConn *conn)
+{
+    char byte;
+    ssize_t n = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Grow a buffer so that it holds at least size bytes
+static int reserve(char **buf, size_t *buf_size, size_t size)
+{
+    if (size <= *buf_size) return 0;
+
+    size_t new_size = *buf_size ? *buf_size : BUFFER_SIZE;
+    while (new_size < size) new_size *= 2;
+
+    char *grown = realloc(*buf, new_size);
+    if (grown == NULL) return -1;
+    *buf = grown;
+    *buf_size = new_size;
+    return 0;
+}
+
+// Send as much of the queued requests as the socket takes, returns -1 when the connection failed
+static int conn_flush(TsConn *conn)
+{
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->out_sent += n;
+    }
+    conn->out_len = conn->out_sent = 0;
+    return 0;
+}
+
+static void movie_from_json(const cJSON *json, Movie *movie)
+{
+    const cJSON *item;
+
+    memset(movie, 0, sizeof(Movie));
+    if ((item = cJSON_GetObjectItemCaseSensitive(json, "id")) && cJSON_IsNumber(item)) movie->id = item->valueint;
+    if ((item = cJSON_GetObjectItemCaseSensitive(json, "version")) && cJSON_IsNumber(item)) movie->version = item->valueint;
+    if ((item = cJSON_GetObjectItemCaseSensitive(json, "title")) && cJSON_IsString(item)) {
+        strncpy(movie->title, item->valuestring, sizeof(movie->title) - 1);
+    }
+    if ((item = cJSON_GetObjectItemCaseSensitive(json, "director")) && cJSON_IsString(item)) {
+        strncpy(movie->director, item->valuestring, sizeof(movie->director) - 1);
+    }
+    if ((item = cJSON_GetObjectItemCaseSensitive(json, "release_year")) && cJSON_IsNumber(item)) {
+        movie->release_year = item->valueint;
+    }
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(json, "genre")) {
+        if (!cJSON_IsString(item) || movie->num_genres >= MAX_GENRES) continue;
+        strncpy(movie->genre[movie->num_genres], item->valuestring, GENRE_NAME_SIZE - 1);
+        movie->num_genres++;
+    }
+}
+
+// Fill the typed result of a call from its response text
+static void parse_result(TsCall *call)
+{
+    TsResult *result = &call->result;
+    const cJSON *item;
+
+    result->json = cJSON_Parse(call->response);
+    if (result->json == NULL) {
+        result->status = TS_ERROR;
+        return;
+    }
+
+    item = cJSON_GetObjectItemCaseSensitive(result->json, "status");
+    result->status = cJSON_IsNumber(item) ? item->valueint : TS_ERROR;
+    item = cJSON_GetObjectItemCaseSensitive(result->json, "message");
+    if (cJSON_IsString(item)) strncpy(result->message, item->valuestring, sizeof(result->message) - 1);
+    item = cJSON_GetObjectItemCaseSensitive(result->json, "version");
+    if (cJSON_IsNumber(item)) result->version = (long long)item->valuedouble;
+
+    item = cJSON_GetObjectItemCaseSensitive(result->json, "movie");
+    if (cJSON_IsObject(item)) movie_from_json(item, &result->movie);
+
+    item = cJSON_GetObjectItemCaseSensitive(result->json, "movies");
+    if (cJSON_IsArray(item) && cJSON_GetArraySize(item) > 0) {
+        const cJSON *movie;
+        result->movies = malloc(cJSON_GetArraySize(item) * sizeof(Movie));
+        if (result->movies == NULL) {
+            result->status = TS_ERROR;
+            return;
+        }
+        cJSON_ArrayForEach(movie, item) {
+            movie_from_json(movie, &result->movies[result->num_movies++]);
+        }
+    }
+}
+
+// Complete the calls whose responses were fully received, returns how many or -1 on a bad response.
+// Once the server hung up (eof), bytes without a header are the last response.
+static int conn_parse(TsConn *conn, bool eof)
+{
+    int completed = 0;
+    size_t offset = 0;
+
+    while (conn->head != NULL && offset < conn->in_len) {
+        size_t length, original_length;
+        int header_len = parse_response_header(conn->in + offset, conn->in_len - offset, &length, &original_length);
+        if (header_len == -1 || (header_len > 0 && conn->in_len - offset - header_len < length)) break;
+        // Responses on a kept alive connection come with a header, but a server turning down
+        // the connection ("overloaded") answers before knowing it and hangs up
+        if (header_len == 0) {
+            if (!eof) break;
+            length = conn->in_len - offset;
+            original_length = 0;
+        }
+
+        TsCall *call = conn->head;
+        const char *payload = conn->in + offset + header_len;
+        if (original_length > 0) {
+            if (inflate_buffer(payload, length, original_length, &call->response) != 0) return -1;
+        } else {
+            call->response = malloc(length + 1);
+            if (call->response == NULL) return -1;
+            memcpy(call->response, payload, length);
+            call->response[length] = '\0';
+        }
+        offset += header_len + length;
+
+        conn->head = call->next;
+        if (conn->head == NULL) conn->tail = NULL;
+        conn->in_flight--;
+
+        parse_result(call);
+        complete_call(call, true);
+        completed++;
+        // A callback queued a call that found the connection dead, nothing is left to parse
+        if (conn->fd == -1) return completed;
+    }
+
+    memmove(conn->in, conn->in + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+    return completed;
+}
+
+// Read what the socket has, returns the number of calls completed or -1 when the connection failed
+static int conn_read(TsConn *conn)
+{
+    while (1) {
+        if (reserve(&conn->in, &conn->in_size, conn->in_len + BUFFER_SIZE) != 0) return -1;
+
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        // The server hung up, calls still waiting after its last response will never be answered
+        if (n == 0) {
+            conn_parse(conn, true);
+            return -1;
+        }
+        conn->in_len += n;
+    }
+    return conn_parse(conn, false);
+}
+
+TsCall *ts_request(TsClient *client, cJSON *request)
+{
+    TsConn *conn = NULL;
+    TsCall *call = NULL;
+    char *req_str = NULL;
+
+    if (request == NULL) return NULL;
+
+    // Queue on the connection with the fewest calls in flight
+    for (int i = 0; i < client->pool_size; i++) {
+        if (conn == NULL || client->conns[i].in_flight < conn->in_flight) conn = &client->conns[i];
+    }
+    if (conn->fd != -1 && conn->in_flight == 0 && conn_closed_by_server(conn)) conn_fail(conn, false);
+    if (conn->fd == -1 && conn_open(client, conn) != 0) goto fail;
+
+    cJSON_AddBoolToObject(request, "keep_alive", true);
+    cJSON_AddStringToObject(request, "accept_encoding", ENCODING_DEFLATE);
+    req_str = cJSON_PrintUnformatted(request);
+    call = calloc(1, sizeof(TsCall));
+    if (req_str == NULL || call == NULL) goto fail;
+
+    size_t len = strlen(req_str);
+    if (reserve(&conn->out, &conn->out_size, conn->out_len + len) != 0) goto fail;
+    memcpy(conn->out + conn->out_len, req_str, len);
+    conn->out_len += len;
+
+    if (conn->tail != NULL) conn->tail->next = call;
+    else conn->head = call;
+    conn->tail = call;
+    conn->in_flight++;
+
+    // Send right away, what the socket does not take goes out from ts_client_poll()
+    if (conn_flush(conn) != 0) conn_fail(conn, true);
+
+    cJSON_free(req_str);
+    cJSON_Delete(request);
+    return call;
+
+fail:
+    free(call);
+    cJSON_free(req_str);
+    cJSON_Delete(request);
+    return NULL;
+}
+
+int ts_client_poll(TsClient *client, int timeout_ms)
+{
+    struct pollfd pfds[client->pool_size];
+    TsConn *polled[client->pool_size];
+    int count = 0;
+    int completed = 0;
+
+    for (int i = 0; i < client->pool_size; i++) {
+        TsConn *conn = &client->conns[i];
+        if (conn->fd == -1 || (conn->in_flight == 0 && conn->out_sent == conn->out_len)) continue;
+
+        pfds[count].fd = conn->fd;
+        pfds[count].events = POLLIN | (conn->out_sent < conn->out_len ? POLLOUT : 0);
+        pfds[count].revents = 0;
+        polled[count++] = conn;
+    }
+    if (count == 0) return 0;
+
+    if (poll(pfds, count, timeout_ms) == -1) {
+        if (errno == EINTR) return 0;
+        // Nothing can make progress any more, don't leave calls waiting forever
+        for (int i = 0; i < count; i++) conn_fail(polled[i], true);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        TsConn *conn = polled[i];
+
+        if ((pfds[i].revents & POLLOUT) && conn_flush(conn) != 0) {
+            conn_fail(conn, true);
+            continue;
+        }
+        if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int n = conn_read(conn);
+            if (n == -1) {
+                conn_fail(conn, true);
+                continue;
+            }
+            completed += n;
+        }
+    }
+    return completed;
+}
+
+bool ts_call_done(const TsCall *call)
+{
+    return call->done;
+}
+
+int ts_call_wait(TsClient *client, TsCall *call)
+{
+    while (!call->done) {
+        ts_client_poll(client, -1);
+    }
+    return call->result.status;
+}
+
+void ts_call_on_done(TsCall *call, TsCallback cb, void *ctx)
+{
+    call->cb = cb;
+    call->ctx = ctx;
+    if (call->done) cb(call, ctx);
+}
+
+const TsResult *ts_call_result(const TsCall *call)
+{
+    return &call->result;
+}
+
+const char *ts_call_response(const TsCall *call)
+{
+    return call->response;
+}
+
+void ts_call_free(TsCall *call)
+{
+    if (call == NULL) return;
+    if (!call->done) {
+        call->freed = true;
+        return;
+    }
+    release_call(call);
+}
+
+static cJSON *new_request(const char *method, const char *resource)
+{
+    cJSON *request = cJSON_CreateObject();
+    cJSON_AddStringToObject(request, "method", method);
+    cJSON_AddStringToObject(request, "resource", resource);
+    return request;
+}
+
+static cJSON *movie_body(const Movie *movie)
+{
+    cJSON *body = cJSON_CreateObject();
+    cJSON_AddStringToObject(body, "title", movie->title);
+    cJSON_AddStringToObject(body, "director", movie->director);
+    cJSON_AddNumberToObject(body, "release_year", movie->release_year);
+
+    cJSON *genres = cJSON_CreateArray();
+    for (int i = 0; i < movie->num_genres; i++) {
+        cJSON_AddItemToArray(genres, cJSON_CreateString(movie->genre[i]));
+    }
+    cJSON_AddItemToObject(body, "genre", genres);
+    return body;
+}
+
+// Request on the resource of one movie
+static cJSON *movie_request(const char *method, int id)
+{
+    char resource[64];
+    snprintf(resource, sizeof(resource), "/movies/%d", id);
+    return new_request(method, resource);
+}
+
+TsCall *ts_create(TsClient *client, const Movie *movie)
+{
+    cJSON *request = new_request("POST", "/movies");
+    cJSON_AddItemToObject(request, "body", movie_body(movie));
+    return ts_request(client, request);
+}
+
+TsCall *ts_get(TsClient *client, int id)
+{
+    return ts_request(client, movie_request("GET", id));
+}
+
+TsCall *ts_update(TsClient *client, const Movie *movie)
+{
+    cJSON *request = movie_request("PUT", movie->id);
+    cJSON_AddItemToObject(request, "body", movie_body(movie));
+    return ts_request(client, request);
+}
+
+TsCall *ts_delete(TsClient *client, int id)
+{
+    return ts_request(client, movie_request("DELETE", id));
+}
+
+TsCall *ts_list(TsClient *client, bool detail)
+{
+    return ts_request(client, new_request("GET", detail ? "/movies/detail" : "/movies"));
+}
+
+TsCall *ts_by_genre(TsClient *client, const char genres[][GENRE_NAME_SIZE], int num_genres, bool match_all)
+{
+    cJSON *request = new_request("GET", "/movies/genre");
+    cJSON *body = cJSON_CreateObject();
+    cJSON *genre_array = cJSON_CreateArray();
+
+    for (int i = 0; i < num_genres; i++) {
+        cJSON_AddItemToArray(genre_array, cJSON_CreateString(genres[i]));
+    }
+    cJSON_AddItemToObject(body, "genres", genre_array);
+    cJSON_AddStringToObject(body, "match", match_all ? "all" : "any");
+    cJSON_AddItemToObject(request, "body", body);
+    return ts_request(client, request);
+}
+
+TsCall *ts_query(TsClient *client, const MovieQuery *query)
+{
+    static const char *sort_names[] = {
+        [SORT_ID] = "id",
+        [SORT_YEAR] = "year",
+        [SORT_TITLE] = "title",
+    };
+    cJSON *request = new_request("GET", "/movies");
+    cJSON *body = cJSON_CreateObject();
+
+    cJSON_AddNumberToObject(body, "year_from", query->year_from);
+    cJSON_AddNumberToObject(body, "year_to", query->year_to);
+    if (query->genre[0] != '\0') cJSON_AddStringToObject(body, "genre", query->genre);
+    cJSON_AddStringToObject(body, "sort", sort_names[query->sort]);
+    if (query->limit > 0) cJSON_AddNumberToObject(body, "limit", query->limit);
+    cJSON_AddItemToObject(request, "body", body);
+    return ts_request(client, request);
+}
+
+TsCall *ts_get_batch(TsClient *client, const int *ids, int num_ids)
+{
+    cJSON *request = new_request("GET", "/movies/batch");
+    cJSON *body = cJSON_CreateObject();
+    cJSON *id_array = cJSON_CreateArray();
+
+    for (int i = 0; i < num_ids; i++) {
+        cJSON_AddItemToArray(id_array, cJSON_CreateNumber(ids[i]));
+    }
+    cJSON_AddItemToObject(body, "ids", id_array);
+    cJSON_AddItemToObject(request, "body", body);
+    return ts_request(client, request);
+}
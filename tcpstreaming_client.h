@@ -0,0 +1,88 @@
+/*
+** tcpstreaming_client.h -- client library of the movie server
+**
+** A TsClient keeps a pool of persistent connections to one server. Every
+** call is queued on the least busy connection and returns at once: several
+** requests may be in flight on the same connection (pipelining), responses
+** come back in request order. ts_client_poll() moves the bytes and
+** completes calls, ts_call_wait() blocks until a given call is done.
+**
+**     TsClient *client = ts_client_new("localhost", NULL, 0);
+**     TsCall *call = ts_get(client, 1);
+**     if (ts_call_wait(client, call) == 200) puts(ts_call_result(call)->movie.title);
+**     ts_call_free(call);
+**     ts_client_free(client);
+*/
+
+#ifndef TCPSTREAMING_CLIENT_H
+#define TCPSTREAMING_CLIENT_H
+
+#include <stdbool.h>
+
+#include "vendor/cJSON/cJSON.h"
+
+#include "storage.h"
+
+#define TS_DEFAULT_PORT "7777"
+#define TS_DEFAULT_POOL_SIZE 4
+
+// Status of a call that got no response (connection failed or closed, invalid response)
+#define TS_ERROR -1
+
+typedef struct TsClient TsClient;
+typedef struct TsCall TsCall;
+
+// Response of a call, the fields that do not apply to it are left empty
+typedef struct {
+    int status;            // status of the response, TS_ERROR when there is none
+    char message[128];
+    Movie movie;           // create, get and update
+    Movie *movies;         // list, by-genre and batch, ordered as sent by the server
+    int num_movies;
+    long long version;     // catalog version of a list
+    cJSON *json;           // the whole response
+} TsResult;
+
+// Called from ts_client_poll() when a call completes, the call may be freed from it
+typedef void (*TsCallback)(TsCall *call, void *ctx);
+
+// Client of the server at host:port (TS_DEFAULT_PORT when NULL) using up to pool_size
+// connections (TS_DEFAULT_POOL_SIZE when 0). Connections are opened on first use.
+TsClient *ts_client_new(const char *host, const char *port, int pool_size);
+// Close every connection, calls still in flight fail with TS_ERROR
+void ts_client_free(TsClient *client);
+
+// Typed calls, NULL when the call could not be queued
+TsCall *ts_create(TsClient *client, const Movie *movie);
+TsCall *ts_get(TsClient *client, int id);
+TsCall *ts_update(TsClient *client, const Movie *movie);
+TsCall *ts_delete(TsClient *client, int id);
+TsCall *ts_list(TsClient *client, bool detail);
+TsCall *ts_by_genre(TsClient *client, const char genres[][GENRE_NAME_SIZE], int num_genres, bool match_all);
+// Movies released from query->year_from to query->year_to, of query->genre unless empty, in query->sort
+// order, up to query->limit of them (-1 for all)
+TsCall *ts_query(TsClient *client, const MovieQuery *query);
+// Movies of a list of IDs in the same order, the ones that do not exist are left with version 0
+TsCall *ts_get_batch(TsClient *client, const int *ids, int num_ids);
+// Any other request, the request object is freed
+TsCall *ts_request(TsClient *client, cJSON *request);
+
+// Send queued requests and read responses, waiting up to timeout_ms for progress
+// (-1 waits forever, 0 not at all). Returns the number of calls completed, -1 on error.
+int ts_client_poll(TsClient *client, int timeout_ms);
+
+bool ts_call_done(const TsCall *call);
+// Block until the call is done, returns the status of its response
+int ts_call_wait(TsClient *client, TsCall *call);
+// Run cb once the call is done, at once when it already is
+void ts_call_on_done(TsCall *call, TsCallback cb, void *ctx);
+const TsResult *ts_call_result(const TsCall *call);
+// Response text, NULL when there is none
+const char *ts_call_response(const TsCall *call);
+// Free a call, one still in flight is freed once its response arrives
+void ts_call_free(TsCall *call);
+
+// Open a dedicated connection, for streams such as change feed subscriptions. Returns -1 on error.
+int ts_connect(const char *host, const char *port);
+
+#endif
@@ -0,0 +1,139 @@
+/*
+** timer_wheel.c -- hierarchical timer wheel for connection deadlines
+*/
+
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define MAX_DELTA (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static void list_add(Timer *head, Timer *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_del(Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now)
+{
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            Timer *head = &wheel->slots[level][i];
+            head->next = head->prev = head;
+        }
+    }
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+void timer_init(Timer *timer)
+{
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+}
+
+bool timer_armed(const Timer *timer)
+{
+    return timer->next != NULL;
+}
+
+// Link a timer in the slot of its expiry, at the lowest level reaching it
+static void place(TimerWheel *wheel, Timer *timer)
+{
+    uint64_t delta;
+    int level = 0;
+
+    delta = timer->expires - wheel->now;
+    if (delta > MAX_DELTA) {
+        timer->expires = wheel->now + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+
+    while (delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) level++;
+    list_add(&wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], timer);
+}
+
+void timer_arm(TimerWheel *wheel, Timer *timer, uint64_t expires)
+{
+    if (timer_armed(timer)) {
+        list_del(timer);
+        wheel->count--;
+    }
+    // The current tick is processed already: a timer due fires on the next one
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    place(wheel, timer);
+    wheel->count++;
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer)
+{
+    if (!timer_armed(timer)) return;
+    list_del(timer);
+    wheel->count--;
+}
+
+void timer_moved(Timer *timer)
+{
+    if (!timer_armed(timer)) return;
+    timer->prev->next = timer;
+    timer->next->prev = timer;
+}
+
+// Move the timers of a slot down to the levels below, now that the wheel reached their span
+static void cascade(TimerWheel *wheel, int level, int index)
+{
+    Timer *head = &wheel->slots[level][index];
+
+    while (head->next != head) {
+        Timer *timer = head->next;
+        list_del(timer);
+        place(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now, TimerExpire expire, void *ctx)
+{
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // Each time a level wraps around, the next slot of the level above comes in range
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) != 0) break;
+            cascade(wheel, level, (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+
+        Timer *head = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            list_del(timer);
+            wheel->count--;
+            expire(timer, ctx);
+        }
+
+        // No timer left, the remaining ticks have nothing to do
+        if (wheel->count == 0) wheel->now = now;
+    }
+}
+
+long timer_wheel_next(const TimerWheel *wheel)
+{
+    if (wheel->count == 0) return -1;
+
+    // The next due timer of level 0, or the next cascade which may bring one down
+    for (long ticks = 1; ticks <= WHEEL_SIZE; ticks++) {
+        uint64_t tick = wheel->now + ticks;
+        const Timer *head = &wheel->slots[0][tick & WHEEL_MASK];
+        if (head->next != head || (tick & WHEEL_MASK) == 0) return ticks;
+    }
+    return WHEEL_SIZE;
+}
@@ -0,0 +1,52 @@
+/*
+** timer_wheel.h -- hierarchical timer wheel for connection deadlines
+**
+** Time is counted in ticks. Level 0 has one slot per tick for the next 64
+** ticks, each level above covers 64 times the span of the one below. A
+** timer sits in the slot of its expiry at the lowest level that reaches it
+** and is moved down (cascaded) as the wheel turns, so arming and cancelling
+** are O(1) and advancing is O(1) per tick plus the timers that expire.
+**
+** Timers are embedded in the objects they belong to and linked in place.
+*/
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks ahead at most, later expiries are clamped
+
+typedef struct Timer {
+    struct Timer *next, *prev; // NULL while not armed
+    uint64_t expires;          // tick at which the timer is due
+} Timer;
+
+typedef struct {
+    Timer slots[WHEEL_LEVELS][WHEEL_SIZE]; // list heads
+    uint64_t now;                          // last tick processed
+    int count;                             // armed timers
+} TimerWheel;
+
+// Called for every due timer, which is disarmed already and may be armed again
+typedef void (*TimerExpire)(Timer *timer, void *ctx);
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now);
+
+void timer_init(Timer *timer);
+bool timer_armed(const Timer *timer);
+// Arm (or re-arm) a timer to expire at the given tick
+void timer_arm(TimerWheel *wheel, Timer *timer, uint64_t expires);
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+// Fix the links of an armed timer that was copied to a new address, the old copy is left unused
+void timer_moved(Timer *timer);
+
+// Process every tick up to now, expiring the timers due
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now, TimerExpire expire, void *ctx);
+// Ticks after which the wheel must be advanced again, -1 when no timer is armed
+long timer_wheel_next(const TimerWheel *wheel);
+
+#endif